@@ -0,0 +1,858 @@
+//  Copyright (C) 2024  IcePanorama
+//
+//  This file is part of BMtoBMP.
+//
+//  BMtoBMP is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by the
+//  Free Software Foundation, either version 3 of the License, or (at your
+//  option) any later version.
+//  This program is distributed in the hope that it will be useful, but WITHOUT
+//  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+//  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+//  more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program.  If not, see <https://www.gnu.org/licenses/>.
+/* clang-format off */
+/**
+ *
+ *  BMtoBMP_bench - measures the throughput and memory use of each conversion
+ *  path on synthetic images of several sizes (Linux).
+ *
+ *  Each size and path is run in a child process of its own, so that its peak
+ *  RSS can be read from `wait4(2)`. Allocations made by the library are
+ *  counted by the `__wrap_*` functions below, which the build puts in front
+ *  of the C library's allocator with
+ *  `-Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free`.
+ *
+ *  `--save-baseline PATH` saves the results as JSON, and `--compare PATH`
+ *  exits non-zero if throughput dropped, or memory use grew, by more than
+ *  `--tolerance` percent against such a baseline.
+ */
+/* clang-format on */
+#include "bm_to_bmp_batch.h"
+
+#if !defined(__linux__)
+#error "BMtoBMP_bench only runs on Linux"
+#endif /* !__linux__ */
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define BENCH_DEFAULT_ITERATIONS (5)
+#define BENCH_MAX_ITERATIONS (1000)
+#define BENCH_MIB (1024.0 * 1024.0)
+#define BENCH_DEFAULT_TOLERANCE (10.0) // percent
+
+/* Memory growth that never counts as a regression, so that allocator and
+ * page cache noise doesn't fail small images. */
+#define BENCH_MEMORY_SLACK ((size_t)256 * 1024)
+
+typedef struct BenchSize_s
+{
+  const char *name;
+  uint32_t width;
+  uint32_t height;
+} BenchSize_t;
+
+/* 1366 pixels leave two bytes of padding per 24-bit row. The 192 MiB BMP of
+ * 8192x8192 outgrows the last-level cache of most machines. */
+static const BenchSize_t bench_sizes[] = {
+  { "64x64", 64, 64 },
+  { "1366x768", 1366, 768 },
+  { "1920x1080", 1920, 1080 },
+  { "4096x4096", 4096, 4096 },
+  { "8192x8192", 8192, 8192 },
+};
+#define BENCH_NUM_SIZES (sizeof (bench_sizes) / sizeof (bench_sizes[0]))
+
+typedef enum BenchPath_e
+{
+  BENCH_PATH_FILE = 0,  // `BMtoBMP_convert_image()`, whole-image buffer
+  BENCH_PATH_PER_ROW,   // the same with one `calloc()` per row, as it was
+  BENCH_PATH_BUFFERED,  // top-down, whole BM and BMP files in memory
+  BENCH_PATH_INDEXED,   // 8-bit, copied from file to file
+  BENCH_PATH_IN_MEMORY, // `BMtoBMP_encode_bmp()` into the caller's buffer
+  BENCH_PATH_BATCH,     // `BMtoBMP_convert_file_at()`, reused buffers
+  /* `BMtoBMP_encode_bmp()` with each kernel forced, only for sizes whose
+   * output outgrows the last-level cache. */
+  BENCH_PATH_SCALAR,
+  BENCH_PATH_PAIR_LUT,
+  BENCH_PATH_STREAM,
+  BENCH_PATH_VBMI,
+  BENCH_PATH_COUNT
+} BenchPath_t;
+
+static const char *const bench_path_names[BENCH_PATH_COUNT]
+    = { "file",          "per-row",     "buffered",    "indexed",
+        "in-memory",     "batch",       "kernel/scalar", "kernel/pair",
+        "kernel/stream", "kernel/vbmi" };
+
+/* Allocations made through the `__wrap_*` functions. */
+typedef struct AllocStats_s
+{
+  uint64_t count; // malloc, calloc and realloc calls
+  uint64_t bytes; // bytes requested by them
+  size_t live;    // usable bytes currently allocated
+  size_t peak;    // most usable bytes allocated at once
+} AllocStats_t;
+
+/* What a child reports for one size and path. */
+typedef struct BenchResult_s
+{
+  int8_t status;
+  double mib_per_s;   // BMP bytes written, median of the timed conversions
+  double allocs;      // allocations per conversion
+  double alloc_bytes; // bytes requested per conversion
+  size_t peak_heap;   // most bytes allocated at once
+  size_t peak_rss;    // filled in by the parent, from `wait4(2)`
+} BenchResult_t;
+
+/* A result read back from a baseline. */
+typedef struct BaselineEntry_s
+{
+  char size[16];
+  char path[16];
+  BenchResult_t result;
+} BaselineEntry_t;
+
+static AllocStats_t alloc_stats;
+
+void *__real_malloc (size_t size);
+void *__real_calloc (size_t nmemb, size_t size);
+void *__real_realloc (void *ptr, size_t size);
+void __real_free (void *ptr);
+
+static void count_allocation (void *ptr, size_t size);
+static void handle_improper_usage_error (const char *exe_name);
+static BMtoBMP_Kernel_t path_kernel (BenchPath_t path);
+static int8_t case_applies (const BenchSize_t *size, BenchPath_t path);
+static int8_t write_inputs (int dir_fd);
+static int8_t convert_per_row (FILE *bm_file, FILE *pal_file,
+                               const char *out_base,
+                               const BMtoBMP_Options_t *opts);
+static void remove_files (int dir_fd);
+static int8_t run_case (int dir_fd, const char *dir_path,
+                        const BenchSize_t *size, BenchPath_t path,
+                        uint32_t iterations, BenchResult_t *result);
+static int8_t run_case_in_child (int dir_fd, const char *dir_path,
+                                 const BenchSize_t *size, BenchPath_t path,
+                                 uint32_t iterations, BenchResult_t *result);
+static void print_result (const BenchSize_t *size, BenchPath_t path,
+                          const BenchResult_t *result);
+static int8_t save_baseline (const char *baseline_path,
+                             BenchResult_t results[][BENCH_PATH_COUNT]);
+static int8_t compare_to_baseline (const char *baseline_path,
+                                   BenchResult_t results[][BENCH_PATH_COUNT],
+                                   double tolerance, uint32_t *regressions);
+static uint32_t check_metric (const char *size, const char *path,
+                              const char *metric, double value,
+                              double baseline, double slack,
+                              double tolerance, int8_t higher_is_better);
+
+int
+main (int argc, char **argv)
+{
+  uint32_t iterations = BENCH_DEFAULT_ITERATIONS;
+  const char *dir_arg = NULL;
+  const char *save_path = NULL;
+  const char *compare_path = NULL;
+  double tolerance = BENCH_DEFAULT_TOLERANCE;
+  for (int i = 1; i < argc; i++)
+    {
+      if (strcmp (argv[i], "--iterations") == 0 && i + 1 < argc)
+        {
+          char *end;
+          const unsigned long n = strtoul (argv[++i], &end, 10);
+          if (*end != '\0' || n == 0 || n > BENCH_MAX_ITERATIONS)
+            {
+              handle_improper_usage_error (argv[0]);
+              return 1;
+            }
+          iterations = (uint32_t)n;
+        }
+      else if (strcmp (argv[i], "--dir") == 0 && i + 1 < argc)
+        dir_arg = argv[++i];
+      else if (strcmp (argv[i], "--save-baseline") == 0 && i + 1 < argc)
+        save_path = argv[++i];
+      else if (strcmp (argv[i], "--compare") == 0 && i + 1 < argc)
+        compare_path = argv[++i];
+      else if (strcmp (argv[i], "--tolerance") == 0 && i + 1 < argc)
+        {
+          char *end;
+          tolerance = strtod (argv[++i], &end);
+          if (*end != '\0' || !(tolerance >= 0.0))
+            {
+              handle_improper_usage_error (argv[0]);
+              return 1;
+            }
+        }
+      else
+        {
+          handle_improper_usage_error (argv[0]);
+          return 1;
+        }
+    }
+
+  char dir_path[128] = "/tmp/BMtoBMP_bench.XXXXXX";
+  if (dir_arg != NULL)
+    {
+      if (strlen (dir_arg) >= sizeof (dir_path))
+        {
+          fprintf (stderr, "Error: directory path is too long, %s.\n",
+                   dir_arg);
+          return 1;
+        }
+      strcpy (dir_path, dir_arg);
+    }
+  else if (mkdtemp (dir_path) == NULL)
+    {
+      fprintf (stderr, "Error: unable to create a temporary directory.\n");
+      return 1;
+    }
+  const int dir_fd = open (dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0 || write_inputs (dir_fd) != 0)
+    {
+      fprintf (stderr, "Error: unable to write test images to %s.\n",
+               dir_path);
+      if (dir_fd >= 0)
+        close (dir_fd);
+      return 1;
+    }
+
+  printf ("%-10s %-13s %9s %9s %10s %10s %10s\n", "size", "path", "MiB/s",
+          "allocs", "alloc MiB", "heap MiB", "RSS MiB");
+  int exit_code = 0;
+  int8_t ran_kernels = 0;
+  BenchResult_t results[BENCH_NUM_SIZES][BENCH_PATH_COUNT];
+  for (size_t i = 0; i < BENCH_NUM_SIZES; i++)
+    {
+      for (int path = 0; path < BENCH_PATH_COUNT; path++)
+        {
+          BenchResult_t *result = &results[i][path];
+          if (!case_applies (&bench_sizes[i], (BenchPath_t)path))
+            {
+              result->status = 1; // neither printed nor saved
+              continue;
+            }
+          if (path_kernel ((BenchPath_t)path) != BMtoBMP_KERNEL_AUTO)
+            ran_kernels = 1;
+          if (run_case (dir_fd, dir_path, &bench_sizes[i], (BenchPath_t)path,
+                        iterations, result)
+              != 0)
+            {
+              fprintf (stderr, "Error: %s %s failed.\n", bench_sizes[i].name,
+                       bench_path_names[path]);
+              result->status = -1;
+              exit_code = 1;
+              continue;
+            }
+          print_result (&bench_sizes[i], (BenchPath_t)path, result);
+        }
+    }
+  if (!ran_kernels)
+    printf ("No kernel cases: no size outgrows the %zu MiB last-level "
+            "cache.\n",
+            stream_kernel_threshold () >> 20);
+
+  remove_files (dir_fd);
+  close (dir_fd);
+  if (dir_arg == NULL)
+    rmdir (dir_path);
+
+  if (save_path != NULL && save_baseline (save_path, results) != 0)
+    {
+      fprintf (stderr, "Error: unable to save the baseline to %s.\n",
+               save_path);
+      exit_code = 1;
+    }
+  if (compare_path != NULL)
+    {
+      uint32_t regressions;
+      if (compare_to_baseline (compare_path, results, tolerance / 100.0,
+                               &regressions)
+          != 0)
+        {
+          fprintf (stderr, "Error: unable to read the baseline, %s.\n",
+                   compare_path);
+          exit_code = 1;
+        }
+      else if (regressions > 0)
+        {
+          printf ("%" PRIu32 " regression(s) against %s (tolerance %g%%).\n",
+                  regressions, compare_path, tolerance);
+          exit_code = 1;
+        }
+      else
+        printf ("No regressions against %s (tolerance %g%%).\n",
+                compare_path, tolerance);
+    }
+  return exit_code;
+}
+
+/**
+ *  count_allocation - records an allocation in `alloc_stats`.
+ *
+ *  @param  ptr the allocated memory, or NULL if the allocation failed.
+ *  @param  size  the number of bytes requested.
+ */
+void
+count_allocation (void *ptr, size_t size)
+{
+  if (ptr == NULL)
+    return;
+  alloc_stats.count++;
+  alloc_stats.bytes += size;
+  alloc_stats.live += malloc_usable_size (ptr);
+  if (alloc_stats.live > alloc_stats.peak)
+    alloc_stats.peak = alloc_stats.live;
+}
+
+void *
+__wrap_malloc (size_t size)
+{
+  void *ptr = __real_malloc (size);
+  count_allocation (ptr, size);
+  return ptr;
+}
+
+void *
+__wrap_calloc (size_t nmemb, size_t size)
+{
+  void *ptr = __real_calloc (nmemb, size);
+  count_allocation (ptr, nmemb * size);
+  return ptr;
+}
+
+void *
+__wrap_realloc (void *ptr, size_t size)
+{
+  const size_t old_size = ptr != NULL ? malloc_usable_size (ptr) : 0;
+  void *grown = __real_realloc (ptr, size);
+  if (grown != NULL || size == 0)
+    alloc_stats.live -= old_size;
+  count_allocation (grown, size);
+  return grown;
+}
+
+void
+__wrap_free (void *ptr)
+{
+  if (ptr != NULL)
+    alloc_stats.live -= malloc_usable_size (ptr);
+  __real_free (ptr);
+}
+
+void
+handle_improper_usage_error (const char *exe_name)
+{
+  fprintf (stderr, "Improper usage.\n");
+  fprintf (stderr,
+           "\ttry: %s [--iterations N] [--dir DIR] [--save-baseline PATH] "
+           "[--compare PATH [--tolerance PERCENT]]\n",
+           exe_name);
+}
+
+/**
+ *  path_kernel - returns the kernel that `path` forces.
+ *
+ *  @param  path  some `BenchPath_t`.
+ *  @return the kernel, or `BMtoBMP_KERNEL_AUTO` if `path` doesn't force one.
+ */
+BMtoBMP_Kernel_t
+path_kernel (BenchPath_t path)
+{
+  switch (path)
+    {
+    case BENCH_PATH_SCALAR:
+      return BMtoBMP_KERNEL_SCALAR;
+    case BENCH_PATH_PAIR_LUT:
+      return BMtoBMP_KERNEL_PAIR_LUT;
+    case BENCH_PATH_STREAM:
+      return BMtoBMP_KERNEL_STREAM;
+    case BENCH_PATH_VBMI:
+      return BMtoBMP_KERNEL_VBMI;
+    default:
+      return BMtoBMP_KERNEL_AUTO;
+    }
+}
+
+/**
+ *  case_applies - checks whether `path` is measured at `size`. The kernel
+ *  paths are only measured when the kernel runs on this CPU and the 24-bit
+ *  output is larger than the last-level cache, where the streaming kernel
+ *  is meant to pay off.
+ *
+ *  @param  size  the image size.
+ *  @param  path  the conversion path.
+ *  @return non-zero if it is, zero otherwise.
+ */
+int8_t
+case_applies (const BenchSize_t *size, BenchPath_t path)
+{
+  const BMtoBMP_Kernel_t kernel = path_kernel (path);
+  if (kernel == BMtoBMP_KERNEL_AUTO)
+    return 1;
+  return kernel_is_available (kernel)
+         && BMtoBMP_bmp_size (size->width, size->height, NULL)
+                > stream_kernel_threshold ();
+}
+
+/**
+ *  write_inputs - writes a PAL file and a BM file of random indices for
+ *  each of `bench_sizes`, a row at a time so that the children forked later
+ *  don't inherit a large RSS.
+ *
+ *  @param  dir_fd  directory to write them to.
+ *  @return zero on success, non-zero on failure.
+ */
+int8_t
+write_inputs (int dir_fd)
+{
+  uint8_t rgb[BMtoBMP_PALETTE_NUM_COLORS * 3];
+  for (uint32_t i = 0; i < sizeof (rgb); i++)
+    rgb[i] = (uint8_t)(i * 7);
+  int fd = openat (dir_fd, "bench.PAL", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return -1;
+  int8_t status = write_all (fd, rgb, sizeof (rgb));
+  if (close (fd) != 0 || status != 0)
+    return -1;
+
+  uint32_t state = 0x2545F491u;
+  for (size_t i = 0; i < BENCH_NUM_SIZES; i++)
+    {
+      const BenchSize_t *size = &bench_sizes[i];
+      char name[64];
+      snprintf (name, sizeof (name), "%s.BM", size->name);
+      fd = openat (dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      uint8_t *row = (uint8_t *)malloc (size->width);
+      uint8_t header[BMtoBMP_BM_PIXEL_DATA_OFFSET] = { 0 };
+      store_le32 (header, size->width);
+      store_le32 (header + 4, size->height);
+      status = (fd < 0 || row == NULL) ? -1 : write_all (fd, header,
+                                                         sizeof (header));
+      for (uint32_t y = 0; y < size->height && status == 0; y++)
+        {
+          for (uint32_t x = 0; x < size->width; x++)
+            {
+              /* xorshift32 */
+              state ^= state << 13;
+              state ^= state >> 17;
+              state ^= state << 5;
+              row[x] = (uint8_t)state;
+            }
+          status = write_all (fd, row, size->width);
+        }
+      free (row);
+      if ((fd >= 0 && close (fd) != 0) || status != 0)
+        return -1;
+    }
+  return 0;
+}
+
+/**
+ *  convert_per_row - converts like `BMtoBMP_convert_image_ex()` does for
+ *  24-bit output, but gives each row of the image buffer a `calloc()` of
+ *  its own, as `allocate_img_data()` used to.
+ *
+ *  @param  bm_file  file ptr (`FILE *`)to some open bm_file.
+ *  @param  pal_file  file ptr (`FILE *`) to some open pal_file.
+ *  @param  out_base  sz of the output filename, without ".bmp".
+ *  @param  opts  conversion options, or NULL for the defaults.
+ *  @return zero on success, non-zero on failure.
+ */
+int8_t
+convert_per_row (FILE *bm_file, FILE *pal_file, const char *out_base,
+                 const BMtoBMP_Options_t *opts)
+{
+  BMtoBMP_BitmapImage_t img;
+  if (set_output_filename (&img, out_base) != 0
+      || read_image_dimensions (bm_file, &img) != 0)
+    return -1;
+
+  const size_t row_len = (size_t)img.width * BMtoBMP_BYTES_PER_PIXEL;
+  img.data = (uint8_t **)calloc (img.height, sizeof (uint8_t *));
+  if (img.data == NULL)
+    return -1;
+  int8_t status = 0;
+  for (uint32_t y = 0; y < img.height && status == 0; y++)
+    {
+      img.data[y] = (uint8_t *)calloc (row_len + 1, sizeof (uint8_t));
+      if (img.data[y] == NULL)
+        status = -1;
+    }
+  if (status == 0)
+    status = process_image (bm_file, pal_file, &img, opts);
+  if (status == 0)
+    status = output_image_to_file (&img, opts);
+
+  for (uint32_t y = 0; y < img.height; y++)
+    free (img.data[y]);
+  free (img.data);
+  return status;
+}
+
+/**
+ *  remove_files - removes the files written by `write_inputs()` and the
+ *  conversions.
+ *
+ *  @param  dir_fd  directory they were written to.
+ */
+void
+remove_files (int dir_fd)
+{
+  unlinkat (dir_fd, "bench.PAL", 0);
+  for (size_t i = 0; i < BENCH_NUM_SIZES; i++)
+    {
+      char name[64];
+      snprintf (name, sizeof (name), "%s.BM", bench_sizes[i].name);
+      unlinkat (dir_fd, name, 0);
+      snprintf (name, sizeof (name), "%s.bmp", bench_sizes[i].name);
+      unlinkat (dir_fd, name, 0);
+    }
+}
+
+/**
+ *  run_case - measures one size and path in a child process.
+ *
+ *  @param  dir_fd  directory holding the inputs.
+ *  @param  dir_path  sz of its path.
+ *  @param  size  the image size.
+ *  @param  path  the conversion path.
+ *  @param  iterations  number of timed conversions.
+ *  @param  result  the measurements (output).
+ *  @return zero on success, non-zero on failure.
+ */
+int8_t
+run_case (int dir_fd, const char *dir_path, const BenchSize_t *size,
+          BenchPath_t path, uint32_t iterations, BenchResult_t *result)
+{
+  int fds[2];
+  if (pipe (fds) != 0)
+    return -1;
+  fflush (stdout);
+  const pid_t pid = fork ();
+  if (pid < 0)
+    {
+      close (fds[0]);
+      close (fds[1]);
+      return -1;
+    }
+  if (pid == 0)
+    {
+      close (fds[0]);
+      memset (result, 0, sizeof (*result));
+      result->status = run_case_in_child (dir_fd, dir_path, size, path,
+                                          iterations, result);
+      const int8_t sent
+          = write_all (fds[1], (const uint8_t *)result, sizeof (*result));
+      _exit (sent == 0 ? 0 : 1);
+    }
+
+  close (fds[1]);
+  const ssize_t got = read (fds[0], result, sizeof (*result));
+  close (fds[0]);
+  int wstatus;
+  struct rusage usage;
+  if (wait4 (pid, &wstatus, 0, &usage) != pid || !WIFEXITED (wstatus)
+      || WEXITSTATUS (wstatus) != 0 || got != (ssize_t)sizeof (*result))
+    return -1;
+  result->peak_rss = (size_t)usage.ru_maxrss * 1024; // in KiB on Linux
+  return result->status;
+}
+
+/**
+ *  run_case_in_child - converts the image of `size` one warm-up and
+ *  `iterations` timed times along `path`. Setup, such as opening the input
+ *  files, isn't counted.
+ *
+ *  @param  dir_fd  directory holding the inputs.
+ *  @param  dir_path  sz of its path.
+ *  @param  size  the image size.
+ *  @param  path  the conversion path.
+ *  @param  iterations  number of timed conversions.
+ *  @param  result  the measurements (output), except `peak_rss`.
+ *  @return zero on success, non-zero on failure.
+ */
+int8_t
+run_case_in_child (int dir_fd, const char *dir_path, const BenchSize_t *size,
+                   BenchPath_t path, uint32_t iterations,
+                   BenchResult_t *result)
+{
+  char bm_name[64];
+  char bm_path[256];
+  char out_base[BMtoBMP_OUTPUT_FILENAME_MAX_LEN];
+  snprintf (bm_name, sizeof (bm_name), "%s.BM", size->name);
+  snprintf (bm_path, sizeof (bm_path), "%s/%s", dir_path, bm_name);
+  if (snprintf (out_base, sizeof (out_base), "%s/%s", dir_path, size->name)
+      >= (int)sizeof (out_base) - 5) // len(".bmp\0") = 5
+    return -1;
+
+  BMtoBMP_Options_t opts;
+  memset (&opts, 0, sizeof (opts));
+  if (path == BENCH_PATH_BUFFERED)
+    opts.top_down = 1;
+  else if (path == BENCH_PATH_INDEXED)
+    opts.format = BMtoBMP_FORMAT_8BPP_INDEXED;
+  opts.kernel = path_kernel (path);
+  const size_t bmp_len = BMtoBMP_bmp_size (size->width, size->height, &opts);
+
+  FILE *bm_file = fopen (bm_path, "rb");
+  const int pal_fd = openat (dir_fd, "bench.PAL", O_RDONLY);
+  FILE *pal_file = pal_fd >= 0 ? fdopen (pal_fd, "rb") : NULL;
+  const size_t bm_len = BMtoBMP_BM_PIXEL_DATA_OFFSET
+                        + (size_t)size->width * size->height;
+  uint8_t *bm = (uint8_t *)malloc (bm_len);
+  uint8_t *bmp = (uint8_t *)malloc (bmp_len);
+  uint64_t *times_ns = (uint64_t *)calloc (iterations, sizeof (uint64_t));
+  BMtoBMP_Palette_t pal;
+  BMtoBMP_ConversionBuffers_t bufs;
+  memset (&bufs, 0, sizeof (bufs));
+  int8_t status = -1;
+  if (bm_file == NULL || pal_file == NULL || bm == NULL || bmp == NULL
+      || times_ns == NULL || load_palette (pal_file, &pal) != 0)
+    goto clean_up;
+  if (fread (bm, 1, bm_len, bm_file) != bm_len)
+    goto clean_up;
+
+  /* Only count what the conversions themselves allocate. */
+  const size_t live_before = alloc_stats.live;
+  alloc_stats.count = 0;
+  alloc_stats.bytes = 0;
+  alloc_stats.peak = live_before;
+
+  status = 0;
+  for (uint32_t i = 0; i <= iterations && status == 0; i++)
+    {
+      const uint64_t start = monotonic_ns ();
+      switch (path)
+        {
+        case BENCH_PATH_FILE:
+        case BENCH_PATH_BUFFERED:
+        case BENCH_PATH_INDEXED:
+          status = BMtoBMP_convert_image_ex (bm_file, pal_file, out_base,
+                                             &opts);
+          break;
+        case BENCH_PATH_PER_ROW:
+          status = convert_per_row (bm_file, pal_file, out_base, &opts);
+          break;
+        case BENCH_PATH_IN_MEMORY:
+        case BENCH_PATH_SCALAR:
+        case BENCH_PATH_PAIR_LUT:
+        case BENCH_PATH_STREAM:
+        case BENCH_PATH_VBMI:
+          status = BMtoBMP_encode_bmp (bm, bm_len, &pal, bmp, bmp_len, &opts);
+          break;
+        case BENCH_PATH_BATCH:
+          status
+              = BMtoBMP_convert_file_at (dir_fd, bm_name, &pal, &opts, &bufs);
+          break;
+        default:
+          status = -1;
+          break;
+        }
+      /* The first conversion warms up the caches and isn't timed. */
+      if (i > 0)
+        times_ns[i - 1] = monotonic_ns () - start;
+    }
+  if (status != 0)
+    goto clean_up;
+
+  result->allocs = (double)alloc_stats.count / (iterations + 1);
+  result->alloc_bytes = (double)alloc_stats.bytes / (iterations + 1);
+  result->peak_heap = alloc_stats.peak - live_before;
+
+  /* Median, by insertion sort; there are only a few. */
+  for (uint32_t i = 1; i < iterations; i++)
+    {
+      const uint64_t t = times_ns[i];
+      uint32_t j = i;
+      for (; j > 0 && times_ns[j - 1] > t; j--)
+        times_ns[j] = times_ns[j - 1];
+      times_ns[j] = t;
+    }
+  const uint64_t median_ns = times_ns[iterations / 2];
+  result->mib_per_s = median_ns > 0 ? (double)bmp_len / BENCH_MIB
+                                          / ((double)median_ns / 1e9)
+                                    : 0.0;
+
+clean_up:
+  BMtoBMP_release_buffers (&bufs);
+  free (times_ns);
+  free (bmp);
+  free (bm);
+  if (pal_file != NULL)
+    fclose (pal_file);
+  else if (pal_fd >= 0)
+    close (pal_fd);
+  if (bm_file != NULL)
+    fclose (bm_file);
+  return status;
+}
+
+/**
+ *  print_result - prints a row of the results table.
+ *
+ *  @param  size  the image size.
+ *  @param  path  the conversion path.
+ *  @param  result  its measurements.
+ */
+void
+print_result (const BenchSize_t *size, BenchPath_t path,
+              const BenchResult_t *result)
+{
+  printf ("%-10s %-13s %9.1f %9.1f %10.2f %10.2f %10.2f\n", size->name,
+          bench_path_names[path], result->mib_per_s, result->allocs,
+          result->alloc_bytes / BENCH_MIB,
+          (double)result->peak_heap / BENCH_MIB,
+          (double)result->peak_rss / BENCH_MIB);
+}
+
+/**
+ *  save_baseline - saves the successful results as JSON, one result per
+ *  line, in the layout `compare_to_baseline()` reads back.
+ *
+ *  @param  baseline_path sz of the path to save them to.
+ *  @param  results the results, by size and path.
+ *  @return zero on success, non-zero on failure.
+ */
+int8_t
+save_baseline (const char *baseline_path,
+               BenchResult_t results[][BENCH_PATH_COUNT])
+{
+  FILE *out = fopen (baseline_path, "w");
+  if (out == NULL)
+    return -1;
+  fprintf (out, "{\n  \"results\": [");
+  const char *separator = "\n";
+  for (size_t i = 0; i < BENCH_NUM_SIZES; i++)
+    {
+      for (int path = 0; path < BENCH_PATH_COUNT; path++)
+        {
+          const BenchResult_t *result = &results[i][path];
+          if (result->status != 0)
+            continue;
+          fprintf (out,
+                   "%s    { \"size\": \"%s\", \"path\": \"%s\", "
+                   "\"mib_per_s\": %.1f, \"allocs\": %.2f, "
+                   "\"alloc_bytes\": %.0f, \"peak_heap\": %zu, "
+                   "\"peak_rss\": %zu }",
+                   separator, bench_sizes[i].name, bench_path_names[path],
+                   result->mib_per_s, result->allocs, result->alloc_bytes,
+                   result->peak_heap, result->peak_rss);
+          separator = ",\n";
+        }
+    }
+  fprintf (out, "\n  ]\n}\n");
+  return fclose (out) != 0 ? -1 : 0;
+}
+
+/**
+ *  compare_to_baseline - prints every metric that regressed against a
+ *  baseline saved by `save_baseline()`. Results without a baseline, and
+ *  failed ones, are skipped.
+ *
+ *  @param  baseline_path sz of the baseline's path.
+ *  @param  results the results, by size and path.
+ *  @param  tolerance the fraction by which a metric may regress.
+ *  @param  regressions the number of metrics that regressed (output).
+ *  @return zero on success, non-zero if the baseline can't be read.
+ */
+int8_t
+compare_to_baseline (const char *baseline_path,
+                     BenchResult_t results[][BENCH_PATH_COUNT],
+                     double tolerance, uint32_t *regressions)
+{
+  FILE *baseline = fopen (baseline_path, "r");
+  if (baseline == NULL)
+    return -1;
+
+  uint32_t num_entries = 0;
+  *regressions = 0;
+  char line[512];
+  while (fgets (line, sizeof (line), baseline) != NULL)
+    {
+      BaselineEntry_t entry;
+      if (sscanf (line,
+                  " { \"size\": \"%15[^\"]\", \"path\": \"%15[^\"]\", "
+                  "\"mib_per_s\": %lf, \"allocs\": %lf, "
+                  "\"alloc_bytes\": %lf, \"peak_heap\": %zu, "
+                  "\"peak_rss\": %zu }",
+                  entry.size, entry.path, &entry.result.mib_per_s,
+                  &entry.result.allocs, &entry.result.alloc_bytes,
+                  &entry.result.peak_heap, &entry.result.peak_rss)
+          != 7)
+        continue;
+      num_entries++;
+
+      for (size_t i = 0; i < BENCH_NUM_SIZES; i++)
+        {
+          for (int path = 0; path < BENCH_PATH_COUNT; path++)
+            {
+              const BenchResult_t *result = &results[i][path];
+              const BenchResult_t *base = &entry.result;
+              if (result->status != 0
+                  || strcmp (entry.size, bench_sizes[i].name) != 0
+                  || strcmp (entry.path, bench_path_names[path]) != 0)
+                continue;
+              *regressions += check_metric (
+                  entry.size, entry.path, "MiB/s", result->mib_per_s,
+                  base->mib_per_s, 0, tolerance, 1);
+              *regressions += check_metric (entry.size, entry.path,
+                                            "allocations", result->allocs,
+                                            base->allocs, 0.5, tolerance, 0);
+              *regressions += check_metric (
+                  entry.size, entry.path, "allocated bytes",
+                  result->alloc_bytes, base->alloc_bytes,
+                  BENCH_MEMORY_SLACK, tolerance, 0);
+              *regressions += check_metric (
+                  entry.size, entry.path, "peak heap bytes",
+                  (double)result->peak_heap, (double)base->peak_heap,
+                  BENCH_MEMORY_SLACK, tolerance, 0);
+              *regressions += check_metric (
+                  entry.size, entry.path, "peak RSS bytes",
+                  (double)result->peak_rss, (double)base->peak_rss,
+                  BENCH_MEMORY_SLACK, tolerance, 0);
+            }
+        }
+    }
+
+  fclose (baseline);
+  return num_entries > 0 ? 0 : -1;
+}
+
+/**
+ *  check_metric - prints a metric if it regressed by more than `tolerance`
+ *  and `slack` against its baseline.
+ *
+ *  @param  size  sz of the image size's name.
+ *  @param  path  sz of the conversion path's name.
+ *  @param  metric  sz of the metric's name.
+ *  @param  value the metric now.
+ *  @param  baseline  the metric in the baseline.
+ *  @param  slack an absolute change that is always tolerated.
+ *  @param  tolerance the fraction by which the metric may regress.
+ *  @param  higher_is_better  non-zero for throughput, zero for memory.
+ *  @return one if the metric regressed, zero otherwise.
+ */
+uint32_t
+check_metric (const char *size, const char *path, const char *metric,
+              double value, double baseline, double slack, double tolerance,
+              int8_t higher_is_better)
+{
+  const int8_t regressed
+      = higher_is_better ? value < baseline * (1.0 - tolerance) - slack
+                         : value > baseline * (1.0 + tolerance) + slack;
+  if (!regressed)
+    return 0;
+  printf ("Regression: %s %s %s is %.1f, baseline %.1f", size, path, metric,
+          value, baseline);
+  if (baseline > 0)
+    printf (" (%+.1f%%)", (value / baseline - 1.0) * 100.0);
+  printf (".\n");
+  return 1;
+}
@@ -0,0 +1,608 @@
+//  Copyright (C) 2024  IcePanorama
+//
+//  This file is part of BMtoBMP.
+//
+//  BMtoBMP is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by the
+//  Free Software Foundation, either version 3 of the License, or (at your
+//  option) any later version.
+//  This program is distributed in the hope that it will be useful, but WITHOUT
+//  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+//  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+//  more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program.  If not, see <https://www.gnu.org/licenses/>.
+/* clang-format off */
+/**
+ *
+ *  BMtoBMP_microbench - times the building blocks of a conversion in
+ *  isolation (Linux): little endian integer loads and stores, BMP header
+ *  encoding and writing, row expansion with each available kernel, row
+ *  padding, reading and checking palette indices, and allocating an image
+ *  buffer with one allocation per row or with one for all of them.
+ *
+ *  Each benchmark first doubles its iteration count until one sample takes
+ *  `MICRO_SAMPLE_NS`, then warms up, then takes `--samples` samples and
+ *  prints the min, median, mean, standard deviation and 95th percentile of
+ *  the time per operation.
+ */
+/* clang-format on */
+#include "bm_to_bmp_converter.h"
+
+#if !defined(__linux__) || !defined(__GNUC__)
+#error "BMtoBMP_microbench only runs on Linux, built with GCC or Clang"
+#endif /* !__linux__ || !__GNUC__ */
+
+#include <fcntl.h>
+#include <math.h>
+
+#define MICRO_DEFAULT_SAMPLES (25)
+#define MICRO_MAX_SAMPLES (1000)
+#define MICRO_DEFAULT_WARMUP_MS (20)
+#define MICRO_SAMPLE_NS (1000000u)
+#define MICRO_MAX_BENCHMARKS (20)
+
+/* 1366 pixels leave two bytes of padding per 24-bit row. */
+#define MICRO_ROW_WIDTH (1366u)
+#define MICRO_ROW_LEN (MICRO_ROW_WIDTH * BMtoBMP_BYTES_PER_PIXEL)
+#define MICRO_ROW_PAD ((4 - MICRO_ROW_LEN % 4) % 4)
+#define MICRO_ROW_STRIDE (MICRO_ROW_LEN + MICRO_ROW_PAD)
+#define MICRO_ROWS (64u) // rows per image, and per gathered write
+#define MICRO_BM_LEN                                                         \
+  (BMtoBMP_BM_PIXEL_DATA_OFFSET + MICRO_ROWS * MICRO_ROW_WIDTH)
+#define MICRO_IMAGE_HEIGHT (768u) // rows per allocated image buffer
+
+/* Keeps the compiler from optimizing away or hoisting work on `ptr`. */
+#define MICRO_CLOBBER(ptr) __asm__ __volatile__ ("" : : "r"(ptr) : "memory")
+
+typedef struct MicroState_s
+{
+  BMtoBMP_Palette_t pal;
+  BMtoBMP_Kernel_t kernel; // for the expand_row benchmarks
+  uint8_t *indices;        // `MICRO_ROW_WIDTH` indices
+  uint8_t *image;          // `MICRO_ROWS` rows of `MICRO_ROW_STRIDE` bytes
+  uint8_t *rows[MICRO_ROWS];
+  uint8_t *bm_data; // `MICRO_BM_LEN` bytes of a BM file
+  FILE *bm_file;    // reads `bm_data`
+  FILE *null_file;  // writes to /dev/null
+  uint8_t header[BMtoBMP_BMP_HEADER_SIZE];
+  uint32_t sink;
+  int8_t failed;
+} MicroState_t;
+
+typedef void (*MicroBenchFn_t) (MicroState_t *state, uint64_t iterations);
+
+typedef struct MicroBench_s
+{
+  char name[48];
+  MicroBenchFn_t run;
+  BMtoBMP_Kernel_t kernel;
+  size_t bytes_per_op; // for the throughput column, zero for none
+} MicroBench_t;
+
+typedef struct MicroSummary_s
+{
+  double min_ns;
+  double median_ns;
+  double mean_ns;
+  double stddev_ns;
+  double p95_ns;
+} MicroSummary_t;
+
+static void handle_improper_usage_error (const char *exe_name);
+static int8_t init_state (MicroState_t *state);
+static void destroy_state (MicroState_t *state);
+static uint32_t list_benchmarks (MicroBench_t *benches);
+static void bench_store_le32 (MicroState_t *state, uint64_t iterations);
+static void bench_load_le32 (MicroState_t *state, uint64_t iterations);
+static void bench_read_uint32 (MicroState_t *state, uint64_t iterations);
+static void bench_encode_header (MicroState_t *state, uint64_t iterations);
+static void bench_write_header (MicroState_t *state, uint64_t iterations);
+static void bench_expand_row (MicroState_t *state, uint64_t iterations);
+static void bench_pad_row (MicroState_t *state, uint64_t iterations);
+static void bench_write_row (MicroState_t *state, uint64_t iterations);
+static void bench_write_rows (MicroState_t *state, uint64_t iterations);
+static void bench_read_indices (MicroState_t *state, uint64_t iterations);
+static void bench_check_indices (MicroState_t *state, uint64_t iterations);
+static void bench_alloc_per_row (MicroState_t *state, uint64_t iterations);
+static void bench_alloc_single (MicroState_t *state, uint64_t iterations);
+static uint64_t time_run (const MicroBench_t *bench, MicroState_t *state,
+                          uint64_t iterations);
+static int8_t measure (const MicroBench_t *bench, MicroState_t *state,
+                       uint32_t num_samples, uint64_t warmup_ns,
+                       MicroSummary_t *summary);
+static int compare_doubles (const void *a, const void *b);
+
+int
+main (int argc, char **argv)
+{
+  uint32_t num_samples = MICRO_DEFAULT_SAMPLES;
+  uint64_t warmup_ms = MICRO_DEFAULT_WARMUP_MS;
+  const char *filter = NULL;
+  for (int i = 1; i < argc; i++)
+    {
+      char *end = NULL;
+      if (strcmp (argv[i], "--samples") == 0 && i + 1 < argc)
+        {
+          const unsigned long n = strtoul (argv[++i], &end, 10);
+          if (*end != '\0' || n < 2 || n > MICRO_MAX_SAMPLES)
+            {
+              handle_improper_usage_error (argv[0]);
+              return 1;
+            }
+          num_samples = (uint32_t)n;
+        }
+      else if (strcmp (argv[i], "--warmup-ms") == 0 && i + 1 < argc)
+        {
+          warmup_ms = strtoull (argv[++i], &end, 10);
+          if (*end != '\0')
+            {
+              handle_improper_usage_error (argv[0]);
+              return 1;
+            }
+        }
+      else if (strcmp (argv[i], "--filter") == 0 && i + 1 < argc)
+        filter = argv[++i];
+      else
+        {
+          handle_improper_usage_error (argv[0]);
+          return 1;
+        }
+    }
+
+  MicroState_t state;
+  if (init_state (&state) != 0)
+    {
+      fprintf (stderr, "Error: unable to set up the benchmarks.\n");
+      destroy_state (&state);
+      return 1;
+    }
+
+  MicroBench_t benches[MICRO_MAX_BENCHMARKS];
+  const uint32_t num_benches = list_benchmarks (benches);
+  printf ("%-26s %10s %10s %10s %10s %10s %10s\n", "benchmark", "median ns",
+          "min ns", "mean ns", "stddev ns", "p95 ns", "MiB/s");
+  int exit_code = 0;
+  for (uint32_t i = 0; i < num_benches; i++)
+    {
+      if (filter != NULL && strstr (benches[i].name, filter) == NULL)
+        continue;
+
+      MicroSummary_t summary;
+      if (measure (&benches[i], &state, num_samples, warmup_ms * 1000000,
+                   &summary)
+          != 0)
+        {
+          fprintf (stderr, "Error: %s failed.\n", benches[i].name);
+          exit_code = 1;
+          continue;
+        }
+      printf ("%-26s %10.2f %10.2f %10.2f %10.2f %10.2f", benches[i].name,
+              summary.median_ns, summary.min_ns, summary.mean_ns,
+              summary.stddev_ns, summary.p95_ns);
+      if (benches[i].bytes_per_op > 0 && summary.median_ns > 0)
+        printf (" %10.1f\n", (double)benches[i].bytes_per_op
+                                 / (1024.0 * 1024.0)
+                                 / (summary.median_ns / 1e9));
+      else
+        printf (" %10s\n", "-");
+    }
+
+  destroy_state (&state);
+  return exit_code;
+}
+
+void
+handle_improper_usage_error (const char *exe_name)
+{
+  fprintf (stderr, "Improper usage.\n");
+  fprintf (stderr,
+           "\ttry: %s [--samples N] [--warmup-ms MS] [--filter SUBSTRING]\n",
+           exe_name);
+}
+
+/**
+ *  init_state - fills the buffers the benchmarks work on with random
+ *  indices into a 255-color palette, so that `indices_in_palette()` has to
+ *  check each of them.
+ *
+ *  @param  state some zeroed `MicroState_t`.
+ *  @return zero on success, non-zero on failure.
+ */
+int8_t
+init_state (MicroState_t *state)
+{
+  memset (state, 0, sizeof (*state));
+  uint8_t rgb[(BMtoBMP_PALETTE_NUM_COLORS - 1) * 3];
+  for (uint32_t i = 0; i < sizeof (rgb); i++)
+    rgb[i] = (uint8_t)(i * 7);
+  if (BMtoBMP_palette_from_buffer (rgb, sizeof (rgb), &state->pal) != 0
+      || build_pair_table (&state->pal) != 0)
+    return -1;
+
+  state->indices = (uint8_t *)malloc (MICRO_ROW_WIDTH);
+  state->image = (uint8_t *)calloc (MICRO_ROWS, MICRO_ROW_STRIDE);
+  state->bm_data = (uint8_t *)calloc (1, MICRO_BM_LEN);
+  if (state->indices == NULL || state->image == NULL
+      || state->bm_data == NULL)
+    return -1;
+
+  uint32_t rng = 0x2545F491u;
+  for (uint32_t i = 0; i < MICRO_BM_LEN; i++)
+    {
+      /* xorshift32 */
+      rng ^= rng << 13;
+      rng ^= rng >> 17;
+      rng ^= rng << 5;
+      state->bm_data[i] = (uint8_t)(rng % (BMtoBMP_PALETTE_NUM_COLORS - 1));
+    }
+  store_le32 (state->bm_data, MICRO_ROW_WIDTH);
+  store_le32 (state->bm_data + 4, MICRO_ROWS);
+  memcpy (state->indices, state->bm_data + BMtoBMP_BM_PIXEL_DATA_OFFSET,
+          MICRO_ROW_WIDTH);
+  for (uint32_t i = 0; i < MICRO_ROWS; i++)
+    state->rows[i] = state->image + (size_t)i * MICRO_ROW_STRIDE;
+
+  state->bm_file = fmemopen (state->bm_data, MICRO_BM_LEN, "rb");
+  state->null_file = fopen ("/dev/null", "wb");
+  if (state->bm_file == NULL || state->null_file == NULL)
+    return -1;
+  return 0;
+}
+
+/**
+ *  destroy_state - frees everything `init_state()` set up.
+ *
+ *  @param  state some `MicroState_t` passed to `init_state()`.
+ */
+void
+destroy_state (MicroState_t *state)
+{
+  if (state->null_file != NULL)
+    fclose (state->null_file);
+  if (state->bm_file != NULL)
+    fclose (state->bm_file);
+  free (state->bm_data);
+  free (state->image);
+  free (state->indices);
+  release_palette (&state->pal);
+}
+
+/**
+ *  list_benchmarks - lists every benchmark, with one row expansion
+ *  benchmark per kernel available on this CPU.
+ *
+ *  @param  benches room for `MICRO_MAX_BENCHMARKS` benchmarks (output).
+ *  @return the number of benchmarks.
+ */
+uint32_t
+list_benchmarks (MicroBench_t *benches)
+{
+  uint32_t n = 0;
+#define MICRO_ADD(NAME, RUN, KERNEL, BYTES)                                  \
+  do                                                                         \
+    {                                                                        \
+      snprintf (benches[n].name, sizeof (benches[n].name), "%s", NAME);      \
+      benches[n].run = RUN;                                                  \
+      benches[n].kernel = KERNEL;                                            \
+      benches[n].bytes_per_op = BYTES;                                       \
+      n++;                                                                   \
+    }                                                                        \
+  while (0)
+
+  MICRO_ADD ("store_le32", bench_store_le32, BMtoBMP_KERNEL_AUTO, 4);
+  MICRO_ADD ("load_le32", bench_load_le32, BMtoBMP_KERNEL_AUTO, 4);
+  MICRO_ADD ("read_uint32_from_file", bench_read_uint32, BMtoBMP_KERNEL_AUTO,
+             4);
+  MICRO_ADD ("encode_bmp_header", bench_encode_header, BMtoBMP_KERNEL_AUTO,
+             BMtoBMP_BMP_HEADER_SIZE);
+  MICRO_ADD ("write_bmp_header", bench_write_header, BMtoBMP_KERNEL_AUTO,
+             BMtoBMP_BMP_HEADER_SIZE);
+  for (int k = BMtoBMP_KERNEL_SCALAR; k < BMtoBMP_KERNEL_COUNT; k++)
+    {
+      if (!kernel_is_available ((BMtoBMP_Kernel_t)k))
+        continue;
+      char name[48];
+      snprintf (name, sizeof (name), "expand_row/%s",
+                BMtoBMP_kernel_name ((BMtoBMP_Kernel_t)k));
+      MICRO_ADD (name, bench_expand_row, (BMtoBMP_Kernel_t)k, MICRO_ROW_LEN);
+    }
+  MICRO_ADD ("pad_row", bench_pad_row, BMtoBMP_KERNEL_AUTO, MICRO_ROW_PAD);
+  MICRO_ADD ("write_row_padded", bench_write_row, BMtoBMP_KERNEL_AUTO,
+             MICRO_ROW_STRIDE);
+  MICRO_ADD ("write_rows_gathered", bench_write_rows, BMtoBMP_KERNEL_AUTO,
+             (size_t)MICRO_ROWS * MICRO_ROW_STRIDE);
+  MICRO_ADD ("read_indices", bench_read_indices, BMtoBMP_KERNEL_AUTO,
+             MICRO_ROW_WIDTH);
+  MICRO_ADD ("indices_in_palette", bench_check_indices, BMtoBMP_KERNEL_AUTO,
+             MICRO_ROW_WIDTH);
+  MICRO_ADD ("alloc_image/per_row", bench_alloc_per_row, BMtoBMP_KERNEL_AUTO,
+             (size_t)MICRO_IMAGE_HEIGHT * MICRO_ROW_LEN);
+  MICRO_ADD ("alloc_image/single", bench_alloc_single, BMtoBMP_KERNEL_AUTO,
+             (size_t)MICRO_IMAGE_HEIGHT * MICRO_ROW_LEN);
+#undef MICRO_ADD
+  return n;
+}
+
+/* `store_le32()`, one header field per operation. */
+void
+bench_store_le32 (MicroState_t *state, uint64_t iterations)
+{
+  for (uint64_t i = 0; i < iterations; i++)
+    {
+      store_le32 (state->header + (i & 12), (uint32_t)i);
+      MICRO_CLOBBER (state->header);
+    }
+}
+
+/* `load_le32()`, one header field per operation. */
+void
+bench_load_le32 (MicroState_t *state, uint64_t iterations)
+{
+  uint32_t sum = 0;
+  for (uint64_t i = 0; i < iterations; i++)
+    {
+      sum += load_le32 (state->bm_data + (i & 12));
+      MICRO_CLOBBER (state->bm_data);
+    }
+  state->sink = sum;
+}
+
+/* `read_uint32_from_file()` through stdio, rewinding every 4096 reads. */
+void
+bench_read_uint32 (MicroState_t *state, uint64_t iterations)
+{
+  uint32_t x = 0;
+  for (uint64_t i = 0; i < iterations; i++)
+    {
+      if (i % 4096 == 0)
+        fseek (state->bm_file, 0x0, SEEK_SET);
+      if (read_uint32_from_file (state->bm_file, &x) != 0)
+        state->failed = 1;
+    }
+  state->sink = x;
+}
+
+/* `encode_bmp_header()` for a 24-bit image. */
+void
+bench_encode_header (MicroState_t *state, uint64_t iterations)
+{
+  for (uint64_t i = 0; i < iterations; i++)
+    {
+      encode_bmp_header (state->header, BMtoBMP_FORMAT_24BPP,
+                         MICRO_ROW_WIDTH, (int32_t)(i & 0xFFFF));
+      MICRO_CLOBBER (state->header);
+    }
+}
+
+/* `write_bmp_header()` into a buffered /dev/null. */
+void
+bench_write_header (MicroState_t *state, uint64_t iterations)
+{
+  for (uint64_t i = 0; i < iterations; i++)
+    {
+      if (write_bmp_header (state->null_file, BMtoBMP_FORMAT_24BPP,
+                            MICRO_ROW_WIDTH, MICRO_ROWS, NULL)
+          != 0)
+        state->failed = 1;
+    }
+}
+
+/* One row through `state->kernel`'s `BMtoBMP_RowKernel_t`. */
+void
+bench_expand_row (MicroState_t *state, uint64_t iterations)
+{
+  const BMtoBMP_RowKernel_t expand_row = get_row_kernel (state->kernel);
+  for (uint64_t i = 0; i < iterations; i++)
+    {
+      expand_row (state->rows[i % MICRO_ROWS], state->indices,
+                  MICRO_ROW_WIDTH, &state->pal);
+      MICRO_CLOBBER (state->image);
+    }
+  finish_kernel (state->kernel);
+}
+
+/* Zeroing a row's padding, as `encode_pixel_rows()` does. */
+void
+bench_pad_row (MicroState_t *state, uint64_t iterations)
+{
+  for (uint64_t i = 0; i < iterations; i++)
+    {
+      memset (state->rows[i % MICRO_ROWS] + MICRO_ROW_LEN, 0, MICRO_ROW_PAD);
+      MICRO_CLOBBER (state->image);
+    }
+}
+
+/* A row and its padding through `write_string_to_file()`, as
+ * `output_image_to_file()` does without POSIX. */
+void
+bench_write_row (MicroState_t *state, uint64_t iterations)
+{
+  for (uint64_t i = 0; i < iterations; i++)
+    {
+      if (write_string_to_file (state->null_file,
+                                (const char *)state->rows[i % MICRO_ROWS],
+                                MICRO_ROW_LEN)
+              != 0
+          || write_string_to_file (state->null_file,
+                                   (const char *)BMtoBMP_zero_pad,
+                                   MICRO_ROW_PAD)
+                 != 0)
+        state->failed = 1;
+    }
+}
+
+/* `MICRO_ROWS` rows and their padding through `write_rows_gathered()`. */
+void
+bench_write_rows (MicroState_t *state, uint64_t iterations)
+{
+  const int fd = fileno (state->null_file);
+  for (uint64_t i = 0; i < iterations; i++)
+    {
+      if (write_rows_gathered (fd, state->rows, MICRO_ROWS, MICRO_ROW_LEN,
+                               MICRO_ROW_PAD, NULL, NULL)
+          != 0)
+        state->failed = 1;
+    }
+}
+
+/* A row of indices through `fread()`, as `process_image()` does, rewinding
+ * at the end of the image. */
+void
+bench_read_indices (MicroState_t *state, uint64_t iterations)
+{
+  for (uint64_t i = 0; i < iterations; i++)
+    {
+      if (i % MICRO_ROWS == 0)
+        fseek (state->bm_file, BMtoBMP_BM_PIXEL_DATA_OFFSET, SEEK_SET);
+      if (fread (state->indices, 1, MICRO_ROW_WIDTH, state->bm_file)
+          != MICRO_ROW_WIDTH)
+        state->failed = 1;
+    }
+}
+
+/* `indices_in_palette()` on a row. */
+void
+bench_check_indices (MicroState_t *state, uint64_t iterations)
+{
+  for (uint64_t i = 0; i < iterations; i++)
+    {
+      if (indices_in_palette (state->indices, MICRO_ROW_WIDTH, &state->pal)
+          != 0)
+        state->failed = 1;
+      MICRO_CLOBBER (state->indices);
+    }
+}
+
+/* Allocating, filling and freeing a `MICRO_IMAGE_HEIGHT` row image with
+ * one `calloc()` per row, as `allocate_img_data()` used to. */
+void
+bench_alloc_per_row (MicroState_t *state, uint64_t iterations)
+{
+  for (uint64_t i = 0; i < iterations; i++)
+    {
+      uint8_t **data
+          = (uint8_t **)calloc (MICRO_IMAGE_HEIGHT, sizeof (uint8_t *));
+      if (data == NULL)
+        {
+          state->failed = 1;
+          return;
+        }
+      for (uint32_t y = 0; y < MICRO_IMAGE_HEIGHT; y++)
+        {
+          data[y] = (uint8_t *)calloc (MICRO_ROW_LEN, sizeof (uint8_t));
+          if (data[y] == NULL)
+            state->failed = 1;
+          else
+            memset (data[y], (int)y, MICRO_ROW_LEN);
+        }
+      MICRO_CLOBBER (data);
+      for (uint32_t y = 0; y < MICRO_IMAGE_HEIGHT; y++)
+        free (data[y]);
+      free (data);
+    }
+}
+
+/* The same through `allocate_img_data()`, which makes the row pointer array
+ * and one buffer for every row. */
+void
+bench_alloc_single (MicroState_t *state, uint64_t iterations)
+{
+  BMtoBMP_BitmapImage_t img;
+  memset (&img, 0, sizeof (img));
+  img.width = MICRO_ROW_WIDTH;
+  img.height = MICRO_IMAGE_HEIGHT;
+  for (uint64_t i = 0; i < iterations; i++)
+    {
+      allocate_img_data (&img);
+      if (img.data == NULL)
+        {
+          state->failed = 1;
+          return;
+        }
+      for (uint32_t y = 0; y < MICRO_IMAGE_HEIGHT; y++)
+        memset (img.data[y], (int)y, MICRO_ROW_LEN);
+      MICRO_CLOBBER (img.data);
+      destroy_img_data (&img);
+    }
+}
+
+/**
+ *  time_run - times one run of a benchmark.
+ *
+ *  @param  bench the benchmark.
+ *  @param  state its buffers.
+ *  @param  iterations  operations to run.
+ *  @return the elapsed time in nanoseconds.
+ */
+uint64_t
+time_run (const MicroBench_t *bench, MicroState_t *state, uint64_t iterations)
+{
+  state->kernel = bench->kernel;
+  const uint64_t start = monotonic_ns ();
+  bench->run (state, iterations);
+  return monotonic_ns () - start;
+}
+
+/**
+ *  measure - calibrates, warms up and samples a benchmark.
+ *
+ *  @param  bench the benchmark.
+ *  @param  state its buffers.
+ *  @param  num_samples number of samples, at least two.
+ *  @param  warmup_ns time to run it for before sampling.
+ *  @param  summary the time per operation (output).
+ *  @return zero on success, non-zero if the benchmark failed.
+ */
+int8_t
+measure (const MicroBench_t *bench, MicroState_t *state, uint32_t num_samples,
+         uint64_t warmup_ns, MicroSummary_t *summary)
+{
+  uint64_t iterations = 1;
+  while (time_run (bench, state, iterations) < MICRO_SAMPLE_NS
+         && iterations < ((uint64_t)1 << 40))
+    iterations *= 2;
+  const uint64_t warmup_start = monotonic_ns ();
+  while (monotonic_ns () - warmup_start < warmup_ns)
+    time_run (bench, state, iterations);
+
+  double samples[MICRO_MAX_SAMPLES];
+  double sum = 0;
+  for (uint32_t i = 0; i < num_samples; i++)
+    {
+      samples[i] = (double)time_run (bench, state, iterations) / iterations;
+      sum += samples[i];
+    }
+  if (state->failed)
+    {
+      state->failed = 0;
+      return -1;
+    }
+
+  qsort (samples, num_samples, sizeof (double), compare_doubles);
+  summary->min_ns = samples[0];
+  summary->median_ns
+      = num_samples % 2 == 1 ? samples[num_samples / 2]
+                             : (samples[num_samples / 2 - 1]
+                                + samples[num_samples / 2])
+                                   / 2;
+  summary->mean_ns = sum / num_samples;
+  double sum_sq = 0;
+  for (uint32_t i = 0; i < num_samples; i++)
+    {
+      const double deviation = samples[i] - summary->mean_ns;
+      sum_sq += deviation * deviation;
+    }
+  summary->stddev_ns = sqrt (sum_sq / (num_samples - 1));
+  summary->p95_ns = samples[(num_samples * 95 + 99) / 100 - 1];
+  return 0;
+}
+
+int
+compare_doubles (const void *a, const void *b)
+{
+  const double x = *(const double *)a;
+  const double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
@@ -0,0 +1,41 @@
+//  Copyright (C) 2024  IcePanorama
+//
+//  This file is part of BMtoBMP.
+//
+//  BMtoBMP is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by the
+//  Free Software Foundation, either version 3 of the License, or (at your
+//  option) any later version.
+//  This program is distributed in the hope that it will be useful, but WITHOUT
+//  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+//  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+//  more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program.  If not, see <https://www.gnu.org/licenses/>.
+/* The second translation unit of `BMtoBMP_cxx_check`, see `main.cpp`. */
+#include "bm_to_bmp.hpp"
+#include "bm_to_bmp_async.hpp"
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+/**
+ *  encode_with_image - converts BM data to a BMP file through
+ *  `bmtobmp::Image`.
+ *
+ *  @param  bm  BM file data.
+ *  @param  pal PAL file data.
+ *  @return the BMP file.
+ */
+std::vector<std::uint8_t>
+encode_with_image (std::span<const std::uint8_t> bm,
+                   std::span<const std::uint8_t> pal)
+{
+  const bmtobmp::Image image
+      = bmtobmp::Image::from_bm (bm, bmtobmp::Palette (pal));
+  std::vector<std::uint8_t> out (image.bmp_size ());
+  image.write_bmp (out);
+  return out;
+}
@@ -0,0 +1,61 @@
+//  Copyright (C) 2024  IcePanorama
+//
+//  This file is part of BMtoBMP.
+//
+//  BMtoBMP is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by the
+//  Free Software Foundation, either version 3 of the License, or (at your
+//  option) any later version.
+//  This program is distributed in the hope that it will be useful, but WITHOUT
+//  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+//  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+//  more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program.  If not, see <https://www.gnu.org/licenses/>.
+/* clang-format off */
+/**
+ *
+ *  BMtoBMP_cxx_check - builds the C++ wrappers from two translation units,
+ *  `encode.cpp` and this one, so that the definitions the headers provide
+ *  keep linking more than once. Converts a 2x2 image in memory through both
+ *  translation units and exits with an error if the results differ.
+ */
+/* clang-format on */
+#include "bm_to_bmp.hpp"
+#include "bm_to_bmp_async.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <span>
+#include <vector>
+
+std::vector<std::uint8_t> encode_with_image (
+    std::span<const std::uint8_t> bm, std::span<const std::uint8_t> pal);
+
+int
+main ()
+{
+  std::array<std::uint8_t, BMtoBMP_BM_PIXEL_DATA_OFFSET + 4> bm{};
+  store_le32 (bm.data (), 2);
+  store_le32 (bm.data () + 4, 2);
+  for (std::size_t i = 0; i < 4; i++)
+    bm[BMtoBMP_BM_PIXEL_DATA_OFFSET + i] = static_cast<std::uint8_t> (i);
+  std::array<std::uint8_t, BMtoBMP_PALETTE_NUM_COLORS * 3> pal;
+  for (std::size_t i = 0; i < pal.size (); i++)
+    pal[i] = static_cast<std::uint8_t> (i * 7);
+
+  std::vector<std::uint8_t> out (bmtobmp::bmp_size (bm));
+  const auto bmp
+      = bmtobmp::encode_bmp (bm, bmtobmp::Palette (pal), std::span (out));
+  const std::vector<std::uint8_t> via_image = encode_with_image (bm, pal);
+  if (!std::equal (bmp.begin (), bmp.end (), via_image.begin (),
+                   via_image.end ()))
+    {
+      std::fprintf (stderr, "Error: the C++ wrappers disagree.\n");
+      return 1;
+    }
+  return 0;
+}
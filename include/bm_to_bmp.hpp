@@ -0,0 +1,344 @@
+//  Copyright (C) 2024  IcePanorama
+//
+//  This file is part of BMtoBMP.
+//
+//  BMtoBMP is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by the
+//  Free Software Foundation, either version 3 of the License, or (at your
+//  option) any later version.
+//  This program is distributed in the hope that it will be useful, but WITHOUT
+//  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+//  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+//  more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program.  If not, see <https://www.gnu.org/licenses/>.
+/* clang-format off */
+/**
+ *
+ *  BMtoBMP C++ API - a C++20 wrapper around `bm_to_bmp_converter.h` for
+ *  converting in-memory BM data without going through files.
+ *
+ *  `bmtobmp::Palette` holds a palette parsed from PAL file data.
+ *  `bmtobmp::Image` owns a single contiguous buffer of top-down BGR pixels,
+ *  is move-only, and hands out `std::span` views of it, so converted pixels
+ *  can be passed on without copying. `bmtobmp::encode_bmp()` converts BM data
+ *  straight into a caller-provided BMP buffer.
+ *
+ *  Errors are reported by throwing `bmtobmp::Error`, or `bmtobmp::Interrupted`
+ *  for conversions stopped through their cancel token or deadline.
+ */
+/* clang-format on */
+#ifndef _BM_TO_BMP_HPP_
+#define _BM_TO_BMP_HPP_
+
+#include "bm_to_bmp_converter.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <utility>
+
+namespace bmtobmp
+{
+
+class Error : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
+/* Thrown when a conversion is cancelled or runs past its deadline. */
+class Interrupted : public Error
+{
+public:
+  explicit Interrupted (std::int8_t code)
+      : Error (code == BMtoBMP_CANCELLED ? "bmtobmp: conversion cancelled"
+                                         : "bmtobmp: deadline exceeded"),
+        code_ (code)
+  {
+  }
+
+  /* `BMtoBMP_CANCELLED` or `BMtoBMP_DEADLINE_EXCEEDED`. */
+  std::int8_t
+  code () const noexcept
+  {
+    return code_;
+  }
+
+private:
+  std::int8_t code_;
+};
+
+using BmpHeader = std::array<std::uint8_t, BMtoBMP_BMP_HEADER_SIZE>;
+
+/**
+ *  bmp_header_template - returns the BMP file header and BITMAPINFOHEADER of
+ *  an output format, with the size fields left zero.
+ *
+ *  @param  format  the `BMtoBMP_OutputFormat_t` of the pixel data.
+ *  @return the header template.
+ */
+constexpr BmpHeader
+bmp_header_template (BMtoBMP_OutputFormat_t format) noexcept
+{
+  switch (format)
+    {
+    case BMtoBMP_FORMAT_8BPP_INDEXED:
+      return BMtoBMP_BMP_HEADER_TEMPLATE (8, BMtoBMP_PALETTE_NUM_COLORS);
+    case BMtoBMP_FORMAT_32BPP:
+      return BMtoBMP_BMP_HEADER_TEMPLATE (32, 0);
+    default:
+      return BMtoBMP_BMP_HEADER_TEMPLATE (24, 0);
+    }
+}
+
+/**
+ *  bmp_header - returns a complete BMP file header and BITMAPINFOHEADER,
+ *  i.e., the format's template with the size fields filled in.
+ *
+ *  @param  format  the `BMtoBMP_OutputFormat_t` of the pixel data.
+ *  @param  width image width in pixels.
+ *  @param  height  image height in pixels, negative for top-down images.
+ *  @return the header.
+ */
+constexpr BmpHeader
+bmp_header (BMtoBMP_OutputFormat_t format, std::uint32_t width,
+            std::int32_t height) noexcept
+{
+  BmpHeader header = bmp_header_template (format);
+  const auto store = [&header] (std::size_t offset, std::uint32_t x) {
+    for (std::size_t i = 0; i < 4; i++)
+      header[offset + i] = static_cast<std::uint8_t> (x >> (i * 8));
+  };
+  const std::uint32_t abs_height
+      = height < 0 ? static_cast<std::uint32_t> (-std::int64_t{ height })
+                   : static_cast<std::uint32_t> (height);
+  const std::uint32_t stride = ((width * header[0x1C] + 31) / 32) * 4;
+  const std::uint32_t pixel_data_offset
+      = header[0x0A] | static_cast<std::uint32_t> (header[0x0B]) << 8;
+
+  store (0x02, pixel_data_offset + stride * abs_height);
+  store (0x12, width);
+  store (0x16, static_cast<std::uint32_t> (height));
+  store (0x22, stride * abs_height);
+  return header;
+}
+
+static_assert (bmp_header (BMtoBMP_FORMAT_24BPP, 1, 1)[0x02] == 58);
+static_assert (bmp_header (BMtoBMP_FORMAT_8BPP_INDEXED, 0, 0)[0x0B] == 0x04);
+
+class Palette
+{
+public:
+  /**
+   *  Palette - parses PAL file data, i.e., up to 256 RGB entries.
+   *
+   *  @param  pal_data  PAL file data.
+   */
+  explicit Palette (std::span<const std::uint8_t> pal_data)
+  {
+    if (BMtoBMP_palette_from_buffer (pal_data.data (), pal_data.size (),
+                                     &native_)
+        != 0)
+      throw Error ("bmtobmp: invalid PAL data");
+  }
+
+  const BMtoBMP_Palette_t &
+  native () const noexcept
+  {
+    return native_;
+  }
+
+private:
+  BMtoBMP_Palette_t native_;
+};
+
+class Image
+{
+public:
+  Image () noexcept = default;
+  Image (Image &&other) noexcept
+      : width_ (std::exchange (other.width_, 0)),
+        height_ (std::exchange (other.height_, 0)),
+        pixels_ (std::move (other.pixels_))
+  {
+  }
+  Image &
+  operator= (Image &&other) noexcept
+  {
+    width_ = std::exchange (other.width_, 0);
+    height_ = std::exchange (other.height_, 0);
+    pixels_ = std::move (other.pixels_);
+    return *this;
+  }
+  Image (const Image &) = delete;
+  Image &operator= (const Image &) = delete;
+
+  /**
+   *  from_bm - converts in-memory BM file data into an image, expanding the
+   *  indices straight into the image's only pixel buffer.
+   *
+   *  @param  bm  BM file data.
+   *  @param  palette the palette to look indices up in.
+   *  @param  kernel  the `BMtoBMP_Kernel_t` to expand rows with.
+   *  @return the image.
+   */
+  static Image
+  from_bm (std::span<const std::uint8_t> bm, const Palette &palette,
+           BMtoBMP_Kernel_t kernel = BMtoBMP_KERNEL_AUTO)
+  {
+    Image img;
+    if (BMtoBMP_parse_bm (bm.data (), bm.size (), &img.width_, &img.height_)
+        != 0)
+      throw Error ("bmtobmp: invalid BM data");
+
+    /* One spare byte keeps zero-sized images from allocating nothing. */
+    img.pixels_ = std::make_unique_for_overwrite<std::uint8_t[]> (
+        img.stride () * img.height_ + 1);
+    if (BMtoBMP_expand_indices (bm.data () + BMtoBMP_BM_PIXEL_DATA_OFFSET,
+                                img.width_, img.height_, &palette.native (),
+                                img.pixels_.get (),
+                                static_cast<std::ptrdiff_t> (img.stride ()),
+                                kernel)
+        != 0)
+      throw Error ("bmtobmp: BM index outside of the palette");
+    return img;
+  }
+
+  std::uint32_t
+  width () const noexcept
+  {
+    return width_;
+  }
+  std::uint32_t
+  height () const noexcept
+  {
+    return height_;
+  }
+  /* Rows are tightly packed, so the stride is always `width() * 3`. */
+  std::size_t
+  stride () const noexcept
+  {
+    return std::size_t{ width_ } * BMtoBMP_BYTES_PER_PIXEL;
+  }
+
+  std::span<const std::uint8_t>
+  pixels () const noexcept
+  {
+    return { pixels_.get (), pixels_ ? stride () * height_ : 0 };
+  }
+  std::span<std::uint8_t>
+  pixels () noexcept
+  {
+    return { pixels_.get (), pixels_ ? stride () * height_ : 0 };
+  }
+  std::span<const std::uint8_t>
+  row (std::uint32_t y) const noexcept
+  {
+    return pixels ().subspan (y * stride (), stride ());
+  }
+
+  /**
+   *  release - gives up ownership of the pixel buffer, e.g. to hand it to a
+   *  renderer; the image is left empty.
+   *
+   *  @return the `width() * height() * 3` bytes of top-down BGR pixels.
+   */
+  std::unique_ptr<std::uint8_t[]>
+  release () && noexcept
+  {
+    width_ = height_ = 0;
+    return std::move (pixels_);
+  }
+
+  /* Size of the 24-bit BMP file that `write_bmp()` produces. */
+  std::size_t
+  bmp_size () const noexcept
+  {
+    return BMtoBMP_bmp_size (width_, height_, nullptr);
+  }
+
+  /**
+   *  write_bmp - writes the image as a bottom-up 24-bit BMP file.
+   *
+   *  @param  out where the BMP file should be stored, at least `bmp_size()`
+   *  bytes.
+   *  @return the part of `out` that was written.
+   */
+  std::span<std::uint8_t>
+  write_bmp (std::span<std::uint8_t> out) const
+  {
+    const std::size_t size = bmp_size ();
+    if (out.size () < size)
+      throw Error ("bmtobmp: output buffer is too small");
+
+    const std::size_t padded = (stride () + 3) & ~std::size_t{ 3 };
+    const BmpHeader header = bmp_header (
+        BMtoBMP_FORMAT_24BPP, width_, static_cast<std::int32_t> (height_));
+    std::uint8_t *dst = std::copy (header.begin (), header.end (), out.data ());
+    for (std::uint32_t y = height_; y-- > 0; dst += padded)
+      {
+        const auto src = row (y);
+        std::copy (src.begin (), src.end (), dst);
+        std::fill (dst + src.size (), dst + padded, std::uint8_t{ 0 });
+      }
+    return out.first (size);
+  }
+
+private:
+  std::uint32_t width_ = 0;
+  std::uint32_t height_ = 0;
+  std::unique_ptr<std::uint8_t[]> pixels_;
+};
+
+/**
+ *  bmp_size - returns the size of the BMP file `encode_bmp()` produces for
+ *  some BM data.
+ *
+ *  @param  bm  BM file data.
+ *  @param  opts  conversion options.
+ *  @return the size in bytes.
+ */
+inline std::size_t
+bmp_size (std::span<const std::uint8_t> bm, const BMtoBMP_Options_t &opts = {})
+{
+  std::uint32_t width, height;
+  if (BMtoBMP_parse_bm (bm.data (), bm.size (), &width, &height) != 0)
+    throw Error ("bmtobmp: invalid BM data");
+  return BMtoBMP_bmp_size (width, height, &opts);
+}
+
+/**
+ *  encode_bmp - converts BM data straight into a BMP file in `out`, without
+ *  an intermediate `Image`.
+ *
+ *  @param  bm  BM file data.
+ *  @param  palette the palette to look indices up in.
+ *  @param  out where the BMP file should be stored, at least `bmp_size()`
+ *  bytes.
+ *  @param  opts  conversion options.
+ *  @return the part of `out` that was written.
+ */
+inline std::span<std::uint8_t>
+encode_bmp (std::span<const std::uint8_t> bm, const Palette &palette,
+            std::span<std::uint8_t> out, const BMtoBMP_Options_t &opts = {})
+{
+  const std::size_t size = bmp_size (bm, opts);
+  const std::int8_t status
+      = BMtoBMP_encode_bmp (bm.data (), bm.size (), &palette.native (),
+                            out.data (), out.size (), &opts);
+  if (status == BMtoBMP_CANCELLED || status == BMtoBMP_DEADLINE_EXCEEDED)
+    throw Interrupted (status);
+  if (status != 0)
+    throw Error ("bmtobmp: conversion failed");
+  return out.first (size);
+}
+
+} // namespace bmtobmp
+
+#endif /* _BM_TO_BMP_HPP_ */
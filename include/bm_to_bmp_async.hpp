@@ -0,0 +1,858 @@
+//  Copyright (C) 2024  IcePanorama
+//
+//  This file is part of BMtoBMP.
+//
+//  BMtoBMP is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by the
+//  Free Software Foundation, either version 3 of the License, or (at your
+//  option) any later version.
+//  This program is distributed in the hope that it will be useful, but WITHOUT
+//  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+//  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+//  more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program.  If not, see <https://www.gnu.org/licenses/>.
+/* clang-format off */
+/**
+ *
+ *  BMtoBMP async C++ API - C++20 coroutines for converting BM files without
+ *  blocking the calling thread.
+ *
+ *  `co_await bmtobmp::convert_async(io, bm_fd, pal_fd, out_fd, opts)` reads
+ *  and writes through a `bmtobmp::IoBackend`, one band of rows at a time, and
+ *  suspends on every read and write, so many conversions can share a few
+ *  threads. `bmtobmp::IoUringBackend` submits the I/O to io_uring on Linux
+ *  5.6 and later; `bmtobmp::ThreadPoolBackend` runs it on a small thread pool
+ *  and works everywhere, and `bmtobmp::make_io_backend()` picks between them.
+ *  Either way, finished I/O resumes the conversion on a `bmtobmp::Executor`
+ *  (e.g. `bmtobmp::ThreadPoolExecutor`), never on the threads that wait for
+ *  it. `bmtobmp::sync_wait()` runs a `bmtobmp::Task` to completion from
+ *  ordinary code.
+ *
+ *  Errors are reported by throwing `bmtobmp::Error` from the `co_await`. The
+ *  `cancel` and `deadline_ns` options are checked between bands and throw
+ *  `bmtobmp::Interrupted`; the output file is left incomplete. Bands are
+ *  written in file order, so the `checksum` option is computed as they go.
+ */
+/* clang-format on */
+#ifndef _BM_TO_BMP_ASYNC_HPP_
+#define _BM_TO_BMP_ASYNC_HPP_
+
+#include "bm_to_bmp.hpp"
+
+#ifndef BMtoBMP_POSIX
+#error "bm_to_bmp_async.hpp needs POSIX pread(2)/pwrite(2)"
+#endif /* BMtoBMP_POSIX */
+
+#include <sys/stat.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define BMtoBMP_HAVE_IO_URING
+#endif /* __linux__ */
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace bmtobmp
+{
+
+/* One read or write in flight. */
+struct IoRequest
+{
+  std::coroutine_handle<> waiter;
+  std::int64_t result = 0; // bytes transferred, or `-errno`
+};
+
+/* Where backends resume coroutines once their I/O is done, so that
+ * conversion work never runs on the threads that wait for I/O. */
+class Executor
+{
+public:
+  virtual ~Executor () = default;
+
+  /**
+   *  post - resumes `h` on a thread of the executor's choosing, but never
+   *  from within the call itself.
+   *
+   *  @param  h the coroutine to resume.
+   */
+  virtual void post (std::coroutine_handle<> h) = 0;
+};
+
+class IoBackend
+{
+public:
+  virtual ~IoBackend () = default;
+
+  /**
+   *  read/write - start a positional read or write. Once it finishes, the
+   *  backend sets `req.result` and posts `req.waiter` to its `Executor`.
+   *
+   *  @param  fd  some open file descriptor.
+   *  @param  buf the bytes to transfer; may transfer fewer.
+   *  @param  offset  file offset to start at.
+   *  @param  req where the result goes.
+   */
+  virtual void read (int fd, std::span<std::uint8_t> buf,
+                     std::uint64_t offset, IoRequest &req)
+      = 0;
+  virtual void write (int fd, std::span<const std::uint8_t> buf,
+                      std::uint64_t offset, IoRequest &req)
+      = 0;
+};
+
+namespace detail
+{
+
+/* Runs queued jobs on a pool of threads. */
+class WorkerPool
+{
+public:
+  explicit WorkerPool (unsigned num_threads)
+  {
+    for (unsigned i = 0; i < std::max (num_threads, 1u); i++)
+      threads_.emplace_back ([this] { run (); });
+  }
+  /* Finishes every queued job before joining the threads. */
+  ~WorkerPool ()
+  {
+    {
+      std::lock_guard<std::mutex> lock (mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all ();
+    threads_.clear ();
+  }
+  WorkerPool (const WorkerPool &) = delete;
+  WorkerPool &operator= (const WorkerPool &) = delete;
+
+  void
+  enqueue (std::function<void ()> job)
+  {
+    {
+      std::lock_guard<std::mutex> lock (mutex_);
+      jobs_.push_back (std::move (job));
+    }
+    cv_.notify_one ();
+  }
+
+private:
+  void
+  run ()
+  {
+    for (;;)
+      {
+        std::function<void ()> job;
+        {
+          std::unique_lock<std::mutex> lock (mutex_);
+          cv_.wait (lock, [this] { return stopping_ || !jobs_.empty (); });
+          if (jobs_.empty ())
+            return;
+          job = std::move (jobs_.front ());
+          jobs_.pop_front ();
+        }
+        job ();
+      }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::function<void ()> > jobs_;
+  bool stopping_ = false;
+  std::vector<std::jthread> threads_; // last, so it is joined first
+};
+
+} // namespace detail
+
+/* Resumes coroutines on a pool of threads, one per CPU by default. */
+class ThreadPoolExecutor final : public Executor
+{
+public:
+  explicit ThreadPoolExecutor (unsigned num_threads
+                               = std::thread::hardware_concurrency ())
+      : pool_ (num_threads)
+  {
+  }
+
+  void
+  post (std::coroutine_handle<> h) override
+  {
+    pool_.enqueue ([h] { h.resume (); });
+  }
+
+private:
+  detail::WorkerPool pool_;
+};
+
+/* Runs `pread(2)`/`pwrite(2)` on a pool of threads and posts the waiting
+ * coroutine to `resume_on` once they return. */
+class ThreadPoolBackend final : public IoBackend
+{
+public:
+  explicit ThreadPoolBackend (Executor &resume_on, unsigned num_threads = 4)
+      : resume_on_ (resume_on), pool_ (num_threads)
+  {
+  }
+
+  void
+  read (int fd, std::span<std::uint8_t> buf, std::uint64_t offset,
+        IoRequest &req) override
+  {
+    pool_.enqueue ([this, fd, buf, offset, &req] {
+      const ssize_t n = pread (fd, buf.data (), buf.size (),
+                               static_cast<off_t> (offset));
+      req.result = n < 0 ? -errno : n;
+      resume_on_.post (req.waiter);
+    });
+  }
+
+  void
+  write (int fd, std::span<const std::uint8_t> buf, std::uint64_t offset,
+         IoRequest &req) override
+  {
+    pool_.enqueue ([this, fd, buf, offset, &req] {
+      const ssize_t n = pwrite (fd, buf.data (), buf.size (),
+                                static_cast<off_t> (offset));
+      req.result = n < 0 ? -errno : n;
+      resume_on_.post (req.waiter);
+    });
+  }
+
+private:
+  Executor &resume_on_;
+  detail::WorkerPool pool_;
+};
+
+#if defined(BMtoBMP_HAVE_IO_URING)
+/* Submits reads and writes to an io_uring(7) instance. One thread waits for
+ * them to finish and posts the waiting coroutines to `resume_on`. */
+class IoUringBackend final : public IoBackend
+{
+public:
+  /**
+   *  IoUringBackend - sets up a ring with room for `entries` requests.
+   *  Throws `bmtobmp::Error` if the kernel has no io_uring, refuses to set
+   *  one up, or predates IORING_OP_READ/IORING_OP_WRITE (Linux 5.6).
+   *
+   *  @param  resume_on where to resume coroutines.
+   *  @param  entries submission ring size, a power of two.
+   */
+  explicit IoUringBackend (Executor &resume_on, unsigned entries = 256)
+      : resume_on_ (resume_on)
+  {
+    io_uring_params params{};
+    const long fd = syscall (__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+      throw Error ("bmtobmp: io_uring_setup failed");
+    ring_fd_ = static_cast<int> (fd);
+    if ((params.features & IORING_FEAT_RW_CUR_POS) == 0
+        || !map_rings (params))
+      {
+        release ();
+        throw Error ("bmtobmp: io_uring is not supported");
+      }
+    reaper_ = std::jthread ([this] { reap (); });
+  }
+  /* Waits for every submitted request to finish. */
+  ~IoUringBackend () override
+  {
+    {
+      std::lock_guard<std::mutex> lock (mutex_);
+      stopping_ = true;
+    }
+    submit (IORING_OP_NOP, -1, nullptr, 0, 0, nullptr); // wakes the reaper
+    reaper_.join ();
+    release ();
+  }
+  IoUringBackend (const IoUringBackend &) = delete;
+  IoUringBackend &operator= (const IoUringBackend &) = delete;
+
+  void
+  read (int fd, std::span<std::uint8_t> buf, std::uint64_t offset,
+        IoRequest &req) override
+  {
+    submit (IORING_OP_READ, fd, buf.data (), buf.size (), offset, &req);
+  }
+
+  void
+  write (int fd, std::span<const std::uint8_t> buf, std::uint64_t offset,
+         IoRequest &req) override
+  {
+    submit (IORING_OP_WRITE, fd, buf.data (), buf.size (), offset, &req);
+  }
+
+private:
+  void *
+  map_ring (std::size_t len, off_t offset) const
+  {
+    void *ring = mmap (nullptr, len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd_, offset);
+    return ring == MAP_FAILED ? nullptr : ring;
+  }
+
+  /* A field of a mapped ring, which the kernel aligns for its type. */
+  template <typename T>
+  static T *
+  ring_field (char *ring, std::uint32_t offset)
+  {
+    return static_cast<T *> (static_cast<void *> (ring + offset));
+  }
+
+  bool
+  map_rings (const io_uring_params &params)
+  {
+    const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    sq_len_ = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+    cq_len_ = params.cq_off.cqes + params.cq_entries * sizeof (io_uring_cqe);
+    if (single_mmap)
+      sq_len_ = cq_len_ = std::max (sq_len_, cq_len_);
+    sqes_len_ = params.sq_entries * sizeof (io_uring_sqe);
+
+    sq_ring_ = static_cast<char *> (map_ring (sq_len_, IORING_OFF_SQ_RING));
+    cq_ring_ = single_mmap ? sq_ring_
+                           : static_cast<char *> (
+                                 map_ring (cq_len_, IORING_OFF_CQ_RING));
+    sqes_ = static_cast<io_uring_sqe *> (map_ring (sqes_len_,
+                                                   IORING_OFF_SQES));
+    if (sq_ring_ == nullptr || cq_ring_ == nullptr || sqes_ == nullptr)
+      return false;
+
+    sq_tail_ = ring_field<unsigned> (sq_ring_, params.sq_off.tail);
+    sq_mask_ = *ring_field<unsigned> (sq_ring_, params.sq_off.ring_mask);
+    sq_array_ = ring_field<unsigned> (sq_ring_, params.sq_off.array);
+    cq_head_ = ring_field<unsigned> (cq_ring_, params.cq_off.head);
+    cq_tail_ = ring_field<unsigned> (cq_ring_, params.cq_off.tail);
+    cq_mask_ = *ring_field<unsigned> (cq_ring_, params.cq_off.ring_mask);
+    cqes_ = ring_field<io_uring_cqe> (cq_ring_, params.cq_off.cqes);
+    cq_entries_ = params.cq_entries;
+    return true;
+  }
+
+  void
+  release () noexcept
+  {
+    if (sqes_ != nullptr)
+      munmap (sqes_, sqes_len_);
+    if (cq_ring_ != nullptr && cq_ring_ != sq_ring_)
+      munmap (cq_ring_, cq_len_);
+    if (sq_ring_ != nullptr)
+      munmap (sq_ring_, sq_len_);
+    close (ring_fd_);
+  }
+
+  /* Queues one request and hands it to the kernel. Requests that cannot be
+   * submitted are posted back with the error. */
+  void
+  submit (std::uint8_t opcode, int fd, const void *buf, std::size_t len,
+          std::uint64_t offset, IoRequest *req)
+  {
+    std::unique_lock<std::mutex> lock (mutex_);
+    /* Never have more in flight than the completion ring holds. */
+    room_.wait (lock, [this] { return in_flight_ < cq_entries_; });
+
+    const unsigned tail = *sq_tail_; // only submitters write it
+    const unsigned index = tail & sq_mask_;
+    io_uring_sqe &sqe = sqes_[index];
+    std::memset (&sqe, 0, sizeof (sqe));
+    sqe.opcode = opcode;
+    sqe.fd = fd;
+    sqe.off = offset;
+    sqe.addr = reinterpret_cast<std::uintptr_t> (buf);
+    sqe.len = static_cast<std::uint32_t> (
+        std::min<std::size_t> (len, std::size_t{ 1 } << 30));
+    sqe.user_data = reinterpret_cast<std::uintptr_t> (req);
+    sq_array_[index] = index;
+    std::atomic_ref<unsigned> (*sq_tail_).store (tail + 1,
+                                                 std::memory_order_release);
+
+    long submitted;
+    do
+      submitted = syscall (__NR_io_uring_enter, ring_fd_, 1, 0, 0, nullptr,
+                           0);
+    while (submitted < 0 && errno == EINTR);
+    if (submitted == 1)
+      {
+        in_flight_++;
+        return;
+      }
+
+    /* The kernel only reads the ring from io_uring_enter(2), so the entry
+     * can be taken back. */
+    std::atomic_ref<unsigned> (*sq_tail_).store (tail,
+                                                 std::memory_order_relaxed);
+    lock.unlock ();
+    if (req != nullptr)
+      {
+        req->result = submitted < 0 ? -errno : -EAGAIN;
+        resume_on_.post (req->waiter);
+      }
+  }
+
+  void
+  reap ()
+  {
+    for (;;)
+      {
+        unsigned head = *cq_head_; // only this thread writes it
+        const unsigned tail = std::atomic_ref<unsigned> (*cq_tail_).load (
+            std::memory_order_acquire);
+        if (head == tail)
+          {
+            {
+              std::lock_guard<std::mutex> lock (mutex_);
+              if (stopping_ && in_flight_ == 0)
+                return;
+            }
+            syscall (__NR_io_uring_enter, ring_fd_, 0, 1,
+                     IORING_ENTER_GETEVENTS, nullptr, 0);
+            continue;
+          }
+
+        {
+          /* Locking also orders the submitter's writes to each request
+           * before ours, which the kernel does not do for us. */
+          std::lock_guard<std::mutex> lock (mutex_);
+          in_flight_ -= tail - head;
+          for (; head != tail; head++)
+            {
+              const io_uring_cqe &cqe = cqes_[head & cq_mask_];
+              IoRequest *req = reinterpret_cast<IoRequest *> (cqe.user_data);
+              if (req == nullptr)
+                continue;
+              req->result = cqe.res;
+              resume_on_.post (req->waiter);
+            }
+          std::atomic_ref<unsigned> (*cq_head_).store (
+              head, std::memory_order_release);
+        }
+        room_.notify_all ();
+      }
+  }
+
+  Executor &resume_on_;
+  int ring_fd_ = -1;
+  char *sq_ring_ = nullptr;
+  char *cq_ring_ = nullptr;
+  io_uring_sqe *sqes_ = nullptr;
+  std::size_t sq_len_ = 0, cq_len_ = 0, sqes_len_ = 0;
+  unsigned *sq_tail_ = nullptr, *sq_array_ = nullptr;
+  unsigned *cq_head_ = nullptr, *cq_tail_ = nullptr;
+  io_uring_cqe *cqes_ = nullptr;
+  unsigned sq_mask_ = 0, cq_mask_ = 0, cq_entries_ = 0;
+
+  std::mutex mutex_; // guards submissions and the fields below
+  std::condition_variable room_;
+  unsigned in_flight_ = 0;
+  bool stopping_ = false;
+  std::jthread reaper_;
+};
+#endif /* BMtoBMP_HAVE_IO_URING */
+
+/**
+ *  make_io_backend - returns an `IoUringBackend` where the kernel supports
+ *  io_uring, and a `ThreadPoolBackend` otherwise.
+ *
+ *  @param  resume_on where the backend resumes coroutines; must outlive it.
+ *  @return the backend.
+ */
+inline std::unique_ptr<IoBackend>
+make_io_backend (Executor &resume_on)
+{
+#if defined(BMtoBMP_HAVE_IO_URING)
+  try
+    {
+      return std::make_unique<IoUringBackend> (resume_on);
+    }
+  catch (const Error &)
+    {
+    }
+#endif /* BMtoBMP_HAVE_IO_URING */
+  return std::make_unique<ThreadPoolBackend> (resume_on);
+}
+
+/* A lazily started coroutine that resumes its awaiter when it finishes. */
+class [[nodiscard]] Task
+{
+public:
+  struct promise_type
+  {
+    std::coroutine_handle<> continuation = std::noop_coroutine ();
+    std::exception_ptr error;
+
+    Task
+    get_return_object () noexcept
+    {
+      return Task (
+          std::coroutine_handle<promise_type>::from_promise (*this));
+    }
+    std::suspend_always
+    initial_suspend () noexcept
+    {
+      return {};
+    }
+    auto
+    final_suspend () noexcept
+    {
+      struct FinalAwaiter
+      {
+        bool
+        await_ready () noexcept
+        {
+          return false;
+        }
+        std::coroutine_handle<>
+        await_suspend (std::coroutine_handle<promise_type> h) noexcept
+        {
+          return h.promise ().continuation;
+        }
+        void
+        await_resume () noexcept
+        {
+        }
+      };
+      return FinalAwaiter{};
+    }
+    void
+    return_void () noexcept
+    {
+    }
+    void
+    unhandled_exception () noexcept
+    {
+      error = std::current_exception ();
+    }
+  };
+
+  Task (Task &&other) noexcept
+      : handle_ (std::exchange (other.handle_, nullptr))
+  {
+  }
+  Task &
+  operator= (Task &&other) noexcept
+  {
+    if (this != &other)
+      {
+        if (handle_)
+          handle_.destroy ();
+        handle_ = std::exchange (other.handle_, nullptr);
+      }
+    return *this;
+  }
+  Task (const Task &) = delete;
+  Task &operator= (const Task &) = delete;
+  ~Task ()
+  {
+    if (handle_)
+      handle_.destroy ();
+  }
+
+  bool
+  await_ready () const noexcept
+  {
+    return false;
+  }
+  std::coroutine_handle<>
+  await_suspend (std::coroutine_handle<> awaiting) noexcept
+  {
+    handle_.promise ().continuation = awaiting;
+    return handle_;
+  }
+  void
+  await_resume () const
+  {
+    if (handle_.promise ().error)
+      std::rethrow_exception (handle_.promise ().error);
+  }
+
+private:
+  explicit Task (std::coroutine_handle<promise_type> handle) noexcept
+      : handle_ (handle)
+  {
+  }
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail
+{
+
+/* Awaits one `IoBackend` read or write. */
+class IoAwaiter
+{
+public:
+  IoAwaiter (IoBackend &io, bool is_write, int fd, std::uint8_t *data,
+             std::size_t len, std::uint64_t offset) noexcept
+      : io_ (io), is_write_ (is_write), fd_ (fd), data_ (data), len_ (len),
+        offset_ (offset)
+  {
+  }
+
+  bool
+  await_ready () const noexcept
+  {
+    return false;
+  }
+  void
+  await_suspend (std::coroutine_handle<> h)
+  {
+    req_.waiter = h;
+    if (is_write_)
+      io_.write (fd_, { data_, len_ }, offset_, req_);
+    else
+      io_.read (fd_, { data_, len_ }, offset_, req_);
+  }
+  std::int64_t
+  await_resume () const noexcept
+  {
+    return req_.result;
+  }
+
+private:
+  IoBackend &io_;
+  bool is_write_;
+  int fd_;
+  std::uint8_t *data_;
+  std::size_t len_;
+  std::uint64_t offset_;
+  IoRequest req_;
+};
+
+/**
+ *  transfer_all - reads or writes all of `len` bytes, resubmitting after
+ *  short transfers.
+ *
+ *  @param  io  the backend to go through.
+ *  @param  is_write  true to write, false to read.
+ *  @param  fd  some open file descriptor.
+ *  @param  data  the bytes to transfer.
+ *  @param  len length of `data`.
+ *  @param  offset  file offset to start at.
+ */
+inline Task
+transfer_all (IoBackend &io, bool is_write, int fd, std::uint8_t *data,
+              std::size_t len, std::uint64_t offset)
+{
+  while (len > 0)
+    {
+      const std::int64_t n
+          = co_await IoAwaiter (io, is_write, fd, data, len, offset);
+      if (n == -EINTR)
+        continue;
+      if (n <= 0)
+        throw Error (is_write ? "bmtobmp: write failed"
+                              : "bmtobmp: unexpected end of file");
+      data += n;
+      len -= static_cast<std::size_t> (n);
+      offset += static_cast<std::uint64_t> (n);
+    }
+}
+
+/* Frees tables `prepare_kernel()` built, however the conversion ends. */
+struct PaletteTables
+{
+  BMtoBMP_Palette_t *pal;
+  ~PaletteTables () { release_palette (pal); }
+};
+
+struct SyncState
+{
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool done = false;
+  std::exception_ptr error;
+};
+
+struct Detached
+{
+  struct promise_type
+  {
+    Detached
+    get_return_object () noexcept
+    {
+      return {};
+    }
+    std::suspend_never
+    initial_suspend () noexcept
+    {
+      return {};
+    }
+    std::suspend_never
+    final_suspend () noexcept
+    {
+      return {};
+    }
+    void
+    return_void () noexcept
+    {
+    }
+    void
+    unhandled_exception () noexcept
+    {
+      std::terminate ();
+    }
+  };
+};
+
+inline Detached
+run_and_signal (Task &task, SyncState &state)
+{
+  try
+    {
+      co_await task;
+    }
+  catch (...)
+    {
+      state.error = std::current_exception ();
+    }
+  /* Notify under the lock so `state` outlives the call. */
+  std::lock_guard<std::mutex> lock (state.mutex);
+  state.done = true;
+  state.cv.notify_one ();
+}
+
+} // namespace detail
+
+/**
+ *  sync_wait - runs `task` to completion, blocking the calling thread.
+ *
+ *  @param  task  the task to run.
+ */
+inline void
+sync_wait (Task task)
+{
+  detail::SyncState state;
+  detail::run_and_signal (task, state);
+  std::unique_lock<std::mutex> lock (state.mutex);
+  state.cv.wait (lock, [&state] { return state.done; });
+  if (state.error)
+    std::rethrow_exception (state.error);
+}
+
+/**
+ *  convert_async - converts a BM file to a BMP file, reading and writing
+ *  through `io` one band of rows at a time.
+ *
+ *  @param  io  the backend to go through; must outlive the conversion.
+ *  @param  bm_fd  file descriptor of some open BM file.
+ *  @param  pal_fd  file descriptor of some open PAL file.
+ *  @param  out_fd  file descriptor of the BMP file to write, opened for
+ *  writing; it is truncated to the BMP's size.
+ *  @param  opts  conversion options; `checksum`, if set, receives the
+ *  CRC-32C of the BMP file once it is written.
+ *  @param  rows_per_chunk  rows per band, or zero to aim for 256 KiB bands.
+ *  @return a `Task` that finishes once the BMP file is written.
+ */
+inline Task
+convert_async (IoBackend &io, int bm_fd, int pal_fd, int out_fd,
+               BMtoBMP_Options_t opts = {}, std::uint32_t rows_per_chunk = 0)
+{
+  struct stat bm_stat, pal_stat;
+  if (fstat (bm_fd, &bm_stat) != 0 || fstat (pal_fd, &pal_stat) != 0)
+    throw Error ("bmtobmp: unable to stat input files");
+
+  std::array<std::uint8_t, BMtoBMP_PALETTE_NUM_COLORS * 3> rgb;
+  const std::size_t rgb_len
+      = std::min (rgb.size (), static_cast<std::size_t> (pal_stat.st_size));
+  co_await detail::transfer_all (io, false, pal_fd, rgb.data (), rgb_len, 0);
+  BMtoBMP_Palette_t pal;
+  if (BMtoBMP_palette_from_buffer (rgb.data (), rgb_len, &pal) != 0)
+    throw Error ("bmtobmp: invalid PAL data");
+  detail::PaletteTables tables{ &pal };
+
+  std::uint8_t dimensions[BMtoBMP_BM_PIXEL_DATA_OFFSET];
+  co_await detail::transfer_all (io, false, bm_fd, dimensions,
+                                 sizeof (dimensions), 0);
+  const std::uint32_t width = load_le32 (dimensions);
+  const std::uint32_t height = load_le32 (dimensions + 4);
+  if (static_cast<std::uint64_t> (bm_stat.st_size)
+      < BMtoBMP_BM_PIXEL_DATA_OFFSET + std::uint64_t{ width } * height)
+    throw Error ("bmtobmp: invalid BM data");
+
+  const std::size_t size = BMtoBMP_bmp_size (width, height, &opts);
+  if (size == 0)
+    throw Error ("bmtobmp: unsupported options");
+  if (ftruncate (out_fd, static_cast<off_t> (size)) != 0)
+    throw Error ("bmtobmp: unable to resize output file");
+
+  std::array<std::uint8_t,
+             BMtoBMP_BMP_HEADER_SIZE + BMtoBMP_PALETTE_NUM_COLORS * 4>
+      prefix;
+  const std::size_t prefix_len
+      = encode_bmp_prefix (prefix.data (), width, height, &pal, &opts);
+  co_await detail::transfer_all (io, true, out_fd, prefix.data (), prefix_len,
+                                 0);
+  std::uint32_t crc = opts.checksum != nullptr
+                          ? BMtoBMP_crc32c (0, prefix.data (), prefix_len)
+                          : 0;
+  if (width == 0 || height == 0)
+    {
+      if (opts.checksum != nullptr)
+        *opts.checksum = crc;
+      co_return;
+    }
+
+  /* Pick the kernel, and build its tables, once for the whole image. */
+  const bool indexed = opts.format == BMtoBMP_FORMAT_8BPP_INDEXED;
+  if (!indexed)
+    opts.kernel = prepare_kernel (opts.kernel, width, height, &pal);
+
+  const bool bottom_up = !indexed && !opts.top_down;
+  const std::size_t out_row_len = (size - prefix_len) / height;
+  if (rows_per_chunk == 0)
+    rows_per_chunk = static_cast<std::uint32_t> (
+        std::max<std::size_t> (1, (std::size_t{ 256 } << 10) / out_row_len));
+  rows_per_chunk = std::min (rows_per_chunk, height);
+
+  auto indices = std::make_unique_for_overwrite<std::uint8_t[]> (
+      std::size_t{ width } * rows_per_chunk);
+  auto pixels = std::make_unique_for_overwrite<std::uint8_t[]> (
+      out_row_len * rows_per_chunk);
+  /* Bands go out in file order, which for bottom-up images starts with the
+   * last BM rows, so the checksum can be extended one band at a time. */
+  for (std::uint32_t done = 0; done < height; done += rows_per_chunk)
+    {
+      const std::uint32_t n = std::min (rows_per_chunk, height - done);
+      const std::uint32_t y = bottom_up ? height - done - n : done;
+      const std::int8_t interrupted = check_interrupt (&opts);
+      if (interrupted != 0)
+        throw Interrupted (interrupted);
+      co_await detail::transfer_all (
+          io, false, bm_fd, indices.get (), std::size_t{ width } * n,
+          BMtoBMP_BM_PIXEL_DATA_OFFSET + std::uint64_t{ width } * y);
+      if (encode_pixel_rows (pixels.get (), indices.get (), width, n, &pal,
+                             &opts)
+          != 0)
+        throw Error ("bmtobmp: BM index outside of the palette");
+      co_await detail::transfer_all (io, true, out_fd, pixels.get (),
+                                     out_row_len * n,
+                                     prefix_len + done * out_row_len);
+      if (opts.checksum != nullptr)
+        crc = BMtoBMP_crc32c (crc, pixels.get (), out_row_len * n);
+    }
+  if (opts.checksum != nullptr)
+    *opts.checksum = crc;
+}
+
+} // namespace bmtobmp
+
+#endif /* _BM_TO_BMP_ASYNC_HPP_ */
@@ -0,0 +1,1011 @@
+//  Copyright (C) 2024  IcePanorama
+//
+//  This file is part of BMtoBMP.
+//
+//  BMtoBMP is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by the
+//  Free Software Foundation, either version 3 of the License, or (at your
+//  option) any later version.
+//  This program is distributed in the hope that it will be useful, but WITHOUT
+//  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+//  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+//  more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program.  If not, see <https://www.gnu.org/licenses/>.
+/* clang-format off */
+/**
+ *
+ *  BMtoBMP batch conversion - converts every BM file under a directory
+ *  (POSIX only, link with `-pthread`).
+ *
+ *  Converter threads take paths from a queue that `BMtoBMP_batch_add()` and
+ *  `BMtoBMP_batch_walk()` fill, so conversions start as soon as the first
+ *  file is found. A prefetch thread opens the next few queued files and asks
+ *  the kernel to read them ahead, so the disk stays busy while the converter
+ *  threads are. Each BMP is written next to its BM file, `foo.BM` becoming
+ *  `foo.bmp`. Files with the same contents are converted once; the other
+ *  BMPs are reflinked or hard linked to the first.
+ */
+/* clang-format on */
+#ifndef _BM_TO_BMP_BATCH_H_
+#define _BM_TO_BMP_BATCH_H_
+
+#include "bm_to_bmp_converter.h"
+#include "bm_to_bmp_stats.h"
+
+#ifndef BMtoBMP_POSIX
+#error "bm_to_bmp_batch.h needs POSIX threads and directory descriptors"
+#endif /* BMtoBMP_POSIX */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif /* __linux__ */
+
+/* How many queued files the prefetch thread keeps opened and read ahead. */
+#ifndef BMtoBMP_BATCH_PREFETCH_FILES
+#define BMtoBMP_BATCH_PREFETCH_FILES (16)
+#endif /* BMtoBMP_BATCH_PREFETCH_FILES */
+
+/* Buckets in a batch's table of converted contents. */
+#define BMtoBMP_BATCH_CONTENT_BUCKETS (65536)
+
+/* Buffers a thread reuses from one conversion to the next. */
+typedef struct BMtoBMP_ConversionBuffers_s
+{
+  uint8_t *bm;
+  size_t bm_cap;
+  uint8_t *bmp;
+  size_t bmp_cap;
+} BMtoBMP_ConversionBuffers_t;
+
+/* A queued path, relative to the batch directory; `path` points just past
+ * the item in the same allocation. */
+typedef struct BMtoBMP_BatchItem_s
+{
+  struct BMtoBMP_BatchItem_s *next;
+  char *path;
+  int fd;              // opened by the prefetch thread, or -1
+  uint8_t prefetching; // being opened by the prefetch thread
+} BMtoBMP_BatchItem_t;
+
+typedef struct BMtoBMP_BatchSummary_s
+{
+  uint64_t converted;    // including duplicates
+  uint64_t failed;
+  uint64_t deduplicated; // duplicates whose BMP was linked, not converted
+  uint64_t bytes_saved;  // BMP bytes those duplicates didn't write
+} BMtoBMP_BatchSummary_t;
+
+typedef enum BMtoBMP_BatchContentState_e
+{
+  BMtoBMP_BATCH_CONTENT_CONVERTING = 0,
+  BMtoBMP_BATCH_CONTENT_DONE,
+  BMtoBMP_BATCH_CONTENT_FAILED
+} BMtoBMP_BatchContentState_t;
+
+/* Some BM contents and the file whose BMP later copies link to; `bm_path`
+ * points just past the entry in the same allocation. */
+typedef struct BMtoBMP_BatchContent_s
+{
+  struct BMtoBMP_BatchContent_s *next;
+  uint64_t hash;
+  size_t bm_len;
+  size_t bmp_len;
+  BMtoBMP_BatchContentState_t state;
+  char *bm_path;
+} BMtoBMP_BatchContent_t;
+
+typedef struct BMtoBMP_Batch_s
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t *threads;
+  uint32_t num_threads;
+  pthread_t prefetch_thread;
+  pthread_cond_t prefetch_cond;
+  pthread_cond_t content_cond; // an entry of `contents` stopped converting
+  int dir_fd;
+  BMtoBMP_Palette_t pal;
+  BMtoBMP_Options_t opts;
+  BMtoBMP_BatchItem_t *pending; // FIFO, `pending_tail` is the newest
+  BMtoBMP_BatchItem_t *pending_tail;
+  BMtoBMP_BatchItem_t *prefetch_next; // first pending item not prefetched
+  uint32_t num_prefetched;            // pending items opened or opening
+  BMtoBMP_BatchContent_t **contents; // `BMtoBMP_BATCH_CONTENT_BUCKETS` chains
+  uint64_t pal_hash;
+  BMtoBMP_Stats_t *stats; // or NULL
+  BMtoBMP_BatchSummary_t summary;
+  uint8_t closing;
+} BMtoBMP_Batch_t;
+
+/* Shared by the threads of one `BMtoBMP_batch_walk()`. */
+typedef struct BMtoBMP_BatchWalk_s
+{
+  BMtoBMP_Batch_t *batch;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  BMtoBMP_BatchItem_t *dirs; // LIFO, so the walk stays close to depth-first
+  uint32_t busy;             // threads reading a directory
+  int8_t status;
+} BMtoBMP_BatchWalk_t;
+
+/**
+ *  reserve_buffer - grows `*buf` to at least `len` bytes.
+ *
+ *  @param  buf some `malloc()`ed buffer, or NULL.
+ *  @param  cap the buffer's size in bytes.
+ *  @param  len how many bytes are needed.
+ *  @return zero on success, non-zero on failure.
+ */
+static int8_t
+reserve_buffer (uint8_t **buf, size_t *cap, size_t len)
+{
+  if (len <= *cap)
+    return 0;
+
+  uint8_t *grown = (uint8_t *)realloc (*buf, len);
+  if (grown == NULL)
+    return -1;
+  *buf = grown;
+  *cap = len;
+  return 0;
+}
+
+/**
+ *  write_all - writes `len` bytes, retrying short writes.
+ *
+ *  @param  fd  some open file descriptor.
+ *  @param  data  the bytes to write.
+ *  @param  len length of `data`.
+ *  @return zero on success, non-zero on failure.
+ */
+static int8_t
+write_all (int fd, const uint8_t *data, size_t len)
+{
+  while (len > 0)
+    {
+      const ssize_t n = write (fd, data, len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      data += n;
+      len -= (size_t)n;
+    }
+  return 0;
+}
+
+/**
+ *  new_batch_item - allocates a queue item for `name` inside `dir`.
+ *
+ *  @param  dir the parent path, or "" for the batch directory itself.
+ *  @param  name  sz of the entry's name.
+ *  @return the item, or NULL on failure.
+ */
+static BMtoBMP_BatchItem_t *
+new_batch_item (const char *dir, const char *name)
+{
+  const size_t dir_len = strlen (dir);
+  const size_t path_len = dir_len + (dir_len > 0) + strlen (name);
+  BMtoBMP_BatchItem_t *item
+      = (BMtoBMP_BatchItem_t *)malloc (sizeof (*item) + path_len + 1);
+  if (item == NULL)
+    return NULL;
+  item->next = NULL;
+  item->path = (char *)(item + 1);
+  item->fd = -1;
+  item->prefetching = 0;
+  if (dir_len > 0)
+    sprintf (item->path, "%s/%s", dir, name);
+  else
+    strcpy (item->path, name);
+  return item;
+}
+
+/**
+ *  get_output_paths - derives the BMP path for a BM file, and the temporary
+ *  path it is written under first.
+ *
+ *  @param  bm_path sz of the BM file's path, ending in `.BM` or `.bm`.
+ *  @param  out_path  where the BMP path should be stored, `PATH_MAX` bytes.
+ *  @param  tmp_path  where the temporary path should be stored, `PATH_MAX`
+ *  bytes.
+ *  @return zero on success, non-zero on failure.
+ */
+static int8_t
+get_output_paths (const char *bm_path, char *out_path, char *tmp_path)
+{
+  const size_t path_len = strlen (bm_path);
+  const char *slash = strrchr (bm_path, '/');
+  const int dir_len = slash == NULL ? 0 : (int)(slash - bm_path + 1);
+  if (!BMtoBMP_has_bm_extension (bm_path)
+      || snprintf (out_path, PATH_MAX, "%.*s.bmp", (int)(path_len - 3),
+                   bm_path)
+             >= PATH_MAX
+      || snprintf (tmp_path, PATH_MAX, "%.*s.%s.tmp", dir_len, bm_path,
+                   out_path + dir_len)
+             >= PATH_MAX)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] unusable BM path, %s.\n", bm_path);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      return -1;
+    }
+  return 0;
+}
+
+/**
+ *  read_bm_file - reads a whole BM file into `bufs->bm`.
+ *
+ *  @param  bm_fd the BM file, opened for reading; left open.
+ *  @param  bm_path sz of the BM file's path, for error messages.
+ *  @param  bufs  buffers to reuse.
+ *  @param  bm_len  the file's length in bytes (output).
+ *  @return zero on success, non-zero on failure.
+ */
+static int8_t
+read_bm_file (int bm_fd, const char *bm_path,
+              BMtoBMP_ConversionBuffers_t *bufs, size_t *bm_len)
+{
+  struct stat bm_stat;
+  if (fstat (bm_fd, &bm_stat) != 0
+      || reserve_buffer (&bufs->bm, &bufs->bm_cap, (size_t)bm_stat.st_size)
+             != 0
+      || pread (bm_fd, bufs->bm, (size_t)bm_stat.st_size, 0)
+             != (ssize_t)bm_stat.st_size)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] unable to read %s.\n", bm_path);
+#else
+      (void)bm_path;
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      return -1;
+    }
+  *bm_len = (size_t)bm_stat.st_size;
+  return 0;
+}
+
+/**
+ *  write_bmp_file - converts the BM data in `bufs->bm` into a BMP next to
+ *  the BM file, via a temporary file that is renamed into place.
+ *
+ *  @param  dir_fd  directory `bm_path` is relative to.
+ *  @param  bm_path sz of the BM file's path, ending in `.BM` or `.bm`.
+ *  @param  bm_len  length of the BM data in bytes.
+ *  @param  pal some loaded `BMtoBMP_Palette_t`.
+ *  @param  opts  conversion options, or NULL for the defaults.
+ *  @param  bufs  buffers to reuse.
+ *  @return zero on success, non-zero on failure; `BMtoBMP_CANCELLED` or
+ *  `BMtoBMP_DEADLINE_EXCEEDED` if interrupted.
+ */
+static int8_t
+write_bmp_file (int dir_fd, const char *bm_path, size_t bm_len,
+                const BMtoBMP_Palette_t *pal, const BMtoBMP_Options_t *opts,
+                BMtoBMP_ConversionBuffers_t *bufs)
+{
+  char out_path[PATH_MAX];
+  char tmp_path[PATH_MAX];
+  uint32_t width;
+  uint32_t height;
+  if (get_output_paths (bm_path, out_path, tmp_path) != 0
+      || BMtoBMP_parse_bm (bufs->bm, bm_len, &width, &height) != 0)
+    return -1;
+  const size_t bmp_len = BMtoBMP_bmp_size (width, height, opts);
+  if (bmp_len == 0
+      || reserve_buffer (&bufs->bmp, &bufs->bmp_cap, bmp_len) != 0)
+    return -1;
+  const int8_t status
+      = BMtoBMP_encode_bmp (bufs->bm, bm_len, pal, bufs->bmp, bmp_len, opts);
+  if (status != 0)
+    return status;
+
+  const int out_fd = openat (dir_fd, tmp_path,
+                             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out_fd < 0)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] unable to create %s.\n", tmp_path);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      return -1;
+    }
+  BMtoBMP_PROBE3 (write_start, width, height, bmp_len);
+  const int8_t write_status = write_all (out_fd, bufs->bmp, bmp_len);
+  if (close (out_fd) != 0 || write_status != 0
+      || renameat (dir_fd, tmp_path, dir_fd, out_path) != 0)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] unable to write %s.\n", out_path);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      unlinkat (dir_fd, tmp_path, 0);
+      BMtoBMP_PROBE3 (write_done, width, height, -1);
+      return -1;
+    }
+  BMtoBMP_PROBE3 (write_done, width, height, 0);
+  return 0;
+}
+
+/**
+ *  hash_contents - hashes `len` bytes with one lane of xxHash64's round
+ *  function; fast, but not meant to resist deliberate collisions.
+ *
+ *  @param  data  the bytes to hash.
+ *  @param  len length of `data`.
+ *  @param  seed  mixed into the hash.
+ *  @return the hash.
+ */
+static uint64_t
+hash_contents (const uint8_t *data, size_t len, uint64_t seed)
+{
+  const uint64_t prime1 = 0x9E3779B185EBCA87u;
+  const uint64_t prime2 = 0xC2B2AE3D27D4EB4Fu;
+  uint64_t hash = seed ^ (len * prime1);
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8)
+    {
+      uint64_t word;
+      memcpy (&word, data + i, sizeof (word));
+      word *= prime2;
+      word = ((word << 31) | (word >> 33)) * prime1;
+      hash ^= word;
+      hash = ((hash << 27) | (hash >> 37)) * prime1 + 0x85EBCA77C2B2AE63u;
+    }
+  for (; i < len; i++)
+    {
+      hash ^= data[i] * 0x27D4EB2F165667C5u;
+      hash = ((hash << 11) | (hash >> 53)) * prime1;
+    }
+
+  hash ^= hash >> 33;
+  hash *= prime2;
+  hash ^= hash >> 29;
+  hash *= 0x165667B19E3779F9u;
+  return hash ^ (hash >> 32);
+}
+
+/**
+ *  same_contents - checks that a file holds exactly `len` bytes of `data`,
+ *  so a hash match is never trusted on its own.
+ *
+ *  @param  dir_fd  directory `path` is relative to.
+ *  @param  path  sz of the file's path.
+ *  @param  data  the expected contents.
+ *  @param  len length of `data`.
+ *  @return non-zero if it does, zero otherwise.
+ */
+static int8_t
+same_contents (int dir_fd, const char *path, const uint8_t *data, size_t len)
+{
+  const int fd = openat (dir_fd, path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+
+  struct stat st;
+  int8_t same = fstat (fd, &st) == 0 && (size_t)st.st_size == len;
+  uint8_t chunk[65536];
+  for (size_t off = 0; same && off < len; off += sizeof (chunk))
+    {
+      const size_t n = len - off < sizeof (chunk) ? len - off : sizeof (chunk);
+      same = pread (fd, chunk, n, (off_t)off) == (ssize_t)n
+             && memcmp (chunk, data + off, n) == 0;
+    }
+  close (fd);
+  return same;
+}
+
+/**
+ *  link_output - makes the BMP of one BM file a copy of another's, as a
+ *  reflink where the file system supports them and a hard link otherwise.
+ *
+ *  @param  dir_fd  directory both paths are relative to.
+ *  @param  from_bm_path  sz of the BM file whose BMP exists.
+ *  @param  bm_path sz of the BM file that needs a BMP.
+ *  @return zero on success, non-zero on failure.
+ */
+static int8_t
+link_output (int dir_fd, const char *from_bm_path, const char *bm_path)
+{
+  char from_path[PATH_MAX];
+  char out_path[PATH_MAX];
+  char tmp_path[PATH_MAX];
+  if (get_output_paths (from_bm_path, from_path, tmp_path) != 0
+      || get_output_paths (bm_path, out_path, tmp_path) != 0)
+    return -1;
+
+  int8_t status = -1;
+#if defined(FICLONE)
+  /* A reflink shares blocks like a hard link, but stays a separate file if
+   * either BMP is edited later. */
+  const int from_fd = openat (dir_fd, from_path, O_RDONLY | O_CLOEXEC);
+  const int tmp_fd = openat (dir_fd, tmp_path,
+                             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (from_fd >= 0 && tmp_fd >= 0 && ioctl (tmp_fd, FICLONE, from_fd) == 0)
+    status = 0;
+  if (from_fd >= 0)
+    close (from_fd);
+  if (tmp_fd >= 0)
+    close (tmp_fd);
+  if (status != 0)
+    unlinkat (dir_fd, tmp_path, 0);
+#endif /* FICLONE */
+  if (status != 0 && linkat (dir_fd, from_path, dir_fd, tmp_path, 0) == 0)
+    status = 0;
+  if (status == 0 && renameat (dir_fd, tmp_path, dir_fd, out_path) != 0)
+    status = -1;
+
+  /* Renaming onto a hard link of the same file leaves both names behind. */
+  unlinkat (dir_fd, tmp_path, 0);
+  return status;
+}
+
+/**
+ *  BMtoBMP_convert_file_at - converts a BM file into a BMP next to it, via
+ *  a temporary file that is renamed into place, so nobody sees a partial
+ *  BMP.
+ *
+ *  @param  dir_fd  directory `bm_path` is relative to.
+ *  @param  bm_path sz of the BM file's path, ending in `.BM` or `.bm`.
+ *  @param  pal some loaded `BMtoBMP_Palette_t`.
+ *  @param  opts  conversion options, or NULL for the defaults.
+ *  @param  bufs  buffers to reuse, zeroed before first use and freed with
+ *  `BMtoBMP_release_buffers()`.
+ *  @return zero on success, non-zero on failure; `BMtoBMP_CANCELLED` or
+ *  `BMtoBMP_DEADLINE_EXCEEDED` if interrupted.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_convert_file_at (int dir_fd, const char *bm_path,
+                         const BMtoBMP_Palette_t *pal,
+                         const BMtoBMP_Options_t *opts,
+                         BMtoBMP_ConversionBuffers_t *bufs)
+{
+  const int bm_fd = openat (dir_fd, bm_path, O_RDONLY | O_CLOEXEC);
+  if (bm_fd < 0)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] unable to open %s.\n", bm_path);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      return -1;
+    }
+  size_t bm_len;
+  const int8_t status
+      = read_bm_file (bm_fd, bm_path, bufs, &bm_len) != 0
+            ? -1
+            : write_bmp_file (dir_fd, bm_path, bm_len, pal, opts, bufs);
+  close (bm_fd);
+  return status;
+}
+
+/**
+ *  BMtoBMP_release_buffers - frees buffers used by
+ *  `BMtoBMP_convert_file_at()`.
+ *
+ *  @param  bufs  some `BMtoBMP_ConversionBuffers_t`.
+ */
+BMtoBMP_API void
+BMtoBMP_release_buffers (BMtoBMP_ConversionBuffers_t *bufs)
+{
+  free (bufs->bm);
+  free (bufs->bmp);
+  memset (bufs, 0, sizeof (*bufs));
+}
+
+/**
+ *  convert_or_link - converts the BM data in `bufs->bm`, unless the same
+ *  contents were converted earlier in the batch, in which case that BMP is
+ *  linked instead.
+ *
+ *  @param  batch some initialized `BMtoBMP_Batch_t`.
+ *  @param  bm_path sz of the BM file's path.
+ *  @param  bm_len  length of the BM data in bytes.
+ *  @param  bufs  the converter thread's buffers.
+ *  @return zero on success, non-zero on failure.
+ */
+static int8_t
+convert_or_link (BMtoBMP_Batch_t *batch, const char *bm_path, size_t bm_len,
+                 BMtoBMP_ConversionBuffers_t *bufs)
+{
+  const uint64_t hash = hash_contents (bufs->bm, bm_len, batch->pal_hash);
+  BMtoBMP_BatchContent_t **bucket
+      = &batch->contents[hash % BMtoBMP_BATCH_CONTENT_BUCKETS];
+  pthread_mutex_lock (&batch->mutex);
+  BMtoBMP_BatchContent_t *content = *bucket;
+  while (content != NULL
+         && (content->hash != hash || content->bm_len != bm_len))
+    content = content->next;
+
+  if (content == NULL)
+    {
+      /* First of its contents: convert it, then let copies link to it. */
+      uint32_t width;
+      uint32_t height;
+      content = (BMtoBMP_BatchContent_t *)malloc (
+          sizeof (*content) + strlen (bm_path) + 1);
+      if (content != NULL)
+        {
+          content->hash = hash;
+          content->bm_len = bm_len;
+          content->bmp_len
+              = BMtoBMP_parse_bm (bufs->bm, bm_len, &width, &height) == 0
+                    ? BMtoBMP_bmp_size (width, height, &batch->opts)
+                    : 0;
+          content->state = BMtoBMP_BATCH_CONTENT_CONVERTING;
+          content->bm_path = (char *)(content + 1);
+          strcpy (content->bm_path, bm_path);
+          content->next = *bucket;
+          *bucket = content;
+        }
+      pthread_mutex_unlock (&batch->mutex);
+
+      const int8_t status = write_bmp_file (batch->dir_fd, bm_path, bm_len,
+                                            &batch->pal, &batch->opts, bufs);
+      if (content != NULL)
+        {
+          pthread_mutex_lock (&batch->mutex);
+          content->state = status == 0 ? BMtoBMP_BATCH_CONTENT_DONE
+                                       : BMtoBMP_BATCH_CONTENT_FAILED;
+          pthread_cond_broadcast (&batch->content_cond);
+          pthread_mutex_unlock (&batch->mutex);
+        }
+      return status;
+    }
+
+  while (content->state == BMtoBMP_BATCH_CONTENT_CONVERTING)
+    pthread_cond_wait (&batch->content_cond, &batch->mutex);
+  const uint8_t converted = content->state == BMtoBMP_BATCH_CONTENT_DONE;
+  pthread_mutex_unlock (&batch->mutex);
+
+  if (converted
+      && same_contents (batch->dir_fd, content->bm_path, bufs->bm, bm_len)
+      && link_output (batch->dir_fd, content->bm_path, bm_path) == 0)
+    {
+      pthread_mutex_lock (&batch->mutex);
+      batch->summary.deduplicated++;
+      batch->summary.bytes_saved += content->bmp_len;
+      pthread_mutex_unlock (&batch->mutex);
+      return 0;
+    }
+  return write_bmp_file (batch->dir_fd, bm_path, bm_len, &batch->pal,
+                         &batch->opts, bufs);
+}
+
+/**
+ *  run_batch - the converter thread loop; converts queued files until the
+ *  batch is closing and none are left.
+ *
+ *  @param  arg the `BMtoBMP_Batch_t`.
+ *  @return NULL.
+ */
+static void *
+run_batch (void *arg)
+{
+  BMtoBMP_Batch_t *batch = (BMtoBMP_Batch_t *)arg;
+  BMtoBMP_ConversionBuffers_t bufs;
+  memset (&bufs, 0, sizeof (bufs));
+  pthread_mutex_lock (&batch->mutex);
+  for (;;)
+    {
+      while ((batch->pending == NULL && !batch->closing)
+             || (batch->pending != NULL && batch->pending->prefetching))
+        pthread_cond_wait (&batch->cond, &batch->mutex);
+      BMtoBMP_BatchItem_t *item = batch->pending;
+      if (item == NULL)
+        break;
+      batch->pending = item->next;
+      if (batch->pending == NULL)
+        batch->pending_tail = NULL;
+      if (batch->prefetch_next == item)
+        batch->prefetch_next = item->next;
+      if (item->fd >= 0)
+        {
+          batch->num_prefetched--;
+          pthread_cond_signal (&batch->prefetch_cond);
+        }
+      pthread_mutex_unlock (&batch->mutex);
+
+      const uint64_t start_ns = monotonic_ns ();
+      const int fd = item->fd >= 0 ? item->fd
+                                   : openat (batch->dir_fd, item->path,
+                                             O_RDONLY | O_CLOEXEC);
+      int8_t status = -1;
+      size_t bm_len = 0;
+      if (fd >= 0)
+        {
+          if (read_bm_file (fd, item->path, &bufs, &bm_len) == 0)
+            status = convert_or_link (batch, item->path, bm_len, &bufs);
+#ifdef POSIX_FADV_DONTNEED
+          /* Nothing reads it again, so make room for files still to come. */
+          posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif /* POSIX_FADV_DONTNEED */
+          close (fd);
+        }
+      free (item);
+
+      uint32_t width;
+      uint32_t height;
+      if (batch->stats != NULL)
+        {
+          const uint8_t parsed
+              = status == 0
+                && BMtoBMP_parse_bm (bufs.bm, bm_len, &width, &height) == 0;
+          BMtoBMP_stats_record (
+              batch->stats, parsed ? (uint64_t)width * height : 0, bm_len,
+              parsed ? BMtoBMP_bmp_size (width, height, &batch->opts) : 0,
+              monotonic_ns () - start_ns, status);
+        }
+
+      pthread_mutex_lock (&batch->mutex);
+      if (status == 0)
+        batch->summary.converted++;
+      else
+        batch->summary.failed++;
+    }
+  pthread_mutex_unlock (&batch->mutex);
+  BMtoBMP_release_buffers (&bufs);
+  return NULL;
+}
+
+/**
+ *  run_prefetch - the prefetch thread loop; keeps up to
+ *  `BMtoBMP_BATCH_PREFETCH_FILES` of the oldest pending files open and
+ *  being read ahead, until the batch is closing and none are left.
+ *
+ *  @param  arg the `BMtoBMP_Batch_t`.
+ *  @return NULL.
+ */
+static void *
+run_prefetch (void *arg)
+{
+  BMtoBMP_Batch_t *batch = (BMtoBMP_Batch_t *)arg;
+  pthread_mutex_lock (&batch->mutex);
+  for (;;)
+    {
+      while ((batch->prefetch_next == NULL && !batch->closing)
+             || (batch->prefetch_next != NULL
+                 && batch->num_prefetched >= BMtoBMP_BATCH_PREFETCH_FILES))
+        pthread_cond_wait (&batch->prefetch_cond, &batch->mutex);
+      BMtoBMP_BatchItem_t *item = batch->prefetch_next;
+      if (item == NULL)
+        break;
+      batch->prefetch_next = item->next;
+      batch->num_prefetched++;
+      item->prefetching = 1;
+      pthread_mutex_unlock (&batch->mutex);
+
+      const int fd = openat (batch->dir_fd, item->path, O_RDONLY | O_CLOEXEC);
+#ifdef POSIX_FADV_WILLNEED
+      /* Starts reading the whole file into the page cache without waiting
+       * for it, unlike a blocking readahead(2). */
+      if (fd >= 0)
+        posix_fadvise (fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif /* POSIX_FADV_WILLNEED */
+
+      pthread_mutex_lock (&batch->mutex);
+      item->fd = fd;
+      item->prefetching = 0;
+      if (fd < 0)
+        batch->num_prefetched--;
+      pthread_cond_broadcast (&batch->cond);
+    }
+  pthread_mutex_unlock (&batch->mutex);
+  return NULL;
+}
+
+/**
+ *  BMtoBMP_batch_init - starts the converter threads of a batch.
+ *
+ *  @param  batch some uninitialized `BMtoBMP_Batch_t`.
+ *  @param  dir_path  sz of the directory that queued paths are relative to.
+ *  @param  pal some loaded `BMtoBMP_Palette_t`; copied.
+ *  @param  opts  conversion options, or NULL for the defaults; copied, but
+ *  `checksum` is ignored.
+ *  @param  num_threads number of converter threads, at least one.
+ *  @param  stats where each file's conversion is recorded, or NULL.
+ *  @return zero on success, non-zero on failure.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_batch_init (BMtoBMP_Batch_t *batch, const char *dir_path,
+                    const BMtoBMP_Palette_t *pal,
+                    const BMtoBMP_Options_t *opts, uint32_t num_threads,
+                    BMtoBMP_Stats_t *stats)
+{
+  memset (batch, 0, sizeof (*batch));
+  if (num_threads == 0)
+    num_threads = 1;
+  batch->pal = *pal;
+  batch->pal.pairs = NULL;
+  if (opts != NULL)
+    batch->opts = *opts;
+  batch->opts.checksum = NULL; // one pointer can't hold every file's CRC
+  batch->stats = stats;
+  batch->pal_hash = hash_contents ((const uint8_t *)batch->pal.bgr,
+                                    sizeof (batch->pal.bgr), 0);
+  batch->dir_fd = open (dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  batch->threads = (pthread_t *)calloc (num_threads, sizeof (pthread_t));
+  batch->contents = (BMtoBMP_BatchContent_t **)calloc (
+      BMtoBMP_BATCH_CONTENT_BUCKETS, sizeof (BMtoBMP_BatchContent_t *));
+  if (batch->dir_fd < 0 || batch->threads == NULL || batch->contents == NULL)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] failed to set up batch for %s.\n",
+               dir_path);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      if (batch->dir_fd >= 0)
+        close (batch->dir_fd);
+      free (batch->threads);
+      free (batch->contents);
+      return -1;
+    }
+  pthread_mutex_init (&batch->mutex, NULL);
+  pthread_cond_init (&batch->cond, NULL);
+  pthread_cond_init (&batch->prefetch_cond, NULL);
+  pthread_cond_init (&batch->content_cond, NULL);
+
+  /* Build the palette's tables once for every file. */
+  BMtoBMP_palette_cache_tables (&batch->pal);
+
+  for (; batch->num_threads < num_threads; batch->num_threads++)
+    {
+      if (pthread_create (&batch->threads[batch->num_threads], NULL,
+                          run_batch, batch)
+          != 0)
+        break;
+    }
+  if (batch->num_threads == 0
+      || pthread_create (&batch->prefetch_thread, NULL, run_prefetch, batch)
+             != 0)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] failed to start converter threads.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      pthread_mutex_lock (&batch->mutex);
+      batch->closing = 1;
+      pthread_cond_broadcast (&batch->cond);
+      pthread_mutex_unlock (&batch->mutex);
+      for (uint32_t i = 0; i < batch->num_threads; i++)
+        pthread_join (batch->threads[i], NULL);
+      pthread_cond_destroy (&batch->content_cond);
+      pthread_cond_destroy (&batch->prefetch_cond);
+      pthread_cond_destroy (&batch->cond);
+      pthread_mutex_destroy (&batch->mutex);
+      close (batch->dir_fd);
+      free (batch->threads);
+      free (batch->contents);
+      release_palette (&batch->pal);
+      return -1;
+    }
+
+  return 0;
+}
+
+/**
+ *  queue_batch_item - hands a path to the converter threads.
+ *
+ *  @param  batch some initialized `BMtoBMP_Batch_t`.
+ *  @param  item  the path's `BMtoBMP_BatchItem_t`; freed by the batch.
+ */
+static void
+queue_batch_item (BMtoBMP_Batch_t *batch, BMtoBMP_BatchItem_t *item)
+{
+  pthread_mutex_lock (&batch->mutex);
+  if (batch->pending_tail != NULL)
+    batch->pending_tail->next = item;
+  else
+    batch->pending = item;
+  batch->pending_tail = item;
+  if (batch->prefetch_next == NULL)
+    batch->prefetch_next = item;
+  pthread_cond_signal (&batch->cond);
+  pthread_cond_signal (&batch->prefetch_cond);
+  pthread_mutex_unlock (&batch->mutex);
+}
+
+/**
+ *  BMtoBMP_batch_add - queues one BM file for conversion.
+ *
+ *  @param  batch some initialized `BMtoBMP_Batch_t`.
+ *  @param  bm_path sz of the BM file's path, relative to the batch
+ *  directory.
+ *  @return zero on success, non-zero on failure.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_batch_add (BMtoBMP_Batch_t *batch, const char *bm_path)
+{
+  BMtoBMP_BatchItem_t *item = new_batch_item ("", bm_path);
+  if (item == NULL)
+    return -1;
+  queue_batch_item (batch, item);
+  return 0;
+}
+
+/**
+ *  walk_directory - queues the BM files in one directory for conversion,
+ *  and its subdirectories for walking. Symbolic links are not followed.
+ *
+ *  @param  walk  the `BMtoBMP_BatchWalk_t`.
+ *  @param  dir the directory's path relative to the batch directory, or ""
+ *  for the batch directory itself.
+ *  @return zero on success, non-zero on failure.
+ */
+static int8_t
+walk_directory (BMtoBMP_BatchWalk_t *walk, const char *dir)
+{
+  const int fd = openat (walk->batch->dir_fd, dir[0] != '\0' ? dir : ".",
+                         O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  DIR *dirp = fd < 0 ? NULL : fdopendir (fd);
+  if (dirp == NULL)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] unable to read directory, %s.\n", dir);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      if (fd >= 0)
+        close (fd);
+      return -1;
+    }
+
+  int8_t status = 0;
+  const struct dirent *entry;
+  while ((entry = readdir (dirp)) != NULL)
+    {
+      if (strcmp (entry->d_name, ".") == 0
+          || strcmp (entry->d_name, "..") == 0)
+        continue;
+
+      /* Only file systems that leave d_type unset cost a stat. */
+      uint8_t is_dir = entry->d_type == DT_DIR;
+      uint8_t is_file = entry->d_type == DT_REG;
+      struct stat st;
+      if (entry->d_type == DT_UNKNOWN
+          && fstatat (fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+        {
+          is_dir = S_ISDIR (st.st_mode);
+          is_file = S_ISREG (st.st_mode);
+        }
+      if (!is_dir && !(is_file && BMtoBMP_has_bm_extension (entry->d_name)))
+        continue;
+
+      BMtoBMP_BatchItem_t *item = new_batch_item (dir, entry->d_name);
+      if (item == NULL)
+        {
+          status = -1;
+          continue;
+        }
+      if (is_file)
+        {
+          queue_batch_item (walk->batch, item);
+          continue;
+        }
+
+      pthread_mutex_lock (&walk->mutex);
+      item->next = walk->dirs;
+      walk->dirs = item;
+      pthread_cond_signal (&walk->cond);
+      pthread_mutex_unlock (&walk->mutex);
+    }
+
+  closedir (dirp);
+  return status;
+}
+
+/**
+ *  run_walk - the walker thread loop; reads queued directories until none
+ *  are queued or being read.
+ *
+ *  @param  arg the `BMtoBMP_BatchWalk_t`.
+ *  @return NULL.
+ */
+static void *
+run_walk (void *arg)
+{
+  BMtoBMP_BatchWalk_t *walk = (BMtoBMP_BatchWalk_t *)arg;
+  pthread_mutex_lock (&walk->mutex);
+  for (;;)
+    {
+      while (walk->dirs == NULL && walk->busy > 0)
+        pthread_cond_wait (&walk->cond, &walk->mutex);
+      BMtoBMP_BatchItem_t *item = walk->dirs;
+      if (item == NULL)
+        break;
+      walk->dirs = item->next;
+      walk->busy++;
+      pthread_mutex_unlock (&walk->mutex);
+
+      const int8_t status = walk_directory (walk, item->path);
+      free (item);
+
+      pthread_mutex_lock (&walk->mutex);
+      if (status != 0)
+        walk->status = -1;
+      if (--walk->busy == 0 && walk->dirs == NULL)
+        pthread_cond_broadcast (&walk->cond);
+    }
+  pthread_mutex_unlock (&walk->mutex);
+  return NULL;
+}
+
+/**
+ *  BMtoBMP_batch_walk - finds every BM file under the batch directory with
+ *  `num_threads` threads, queueing each for conversion as soon as it is
+ *  found. Returns once the walk is done; conversions may still be running.
+ *
+ *  @param  batch some initialized `BMtoBMP_Batch_t`.
+ *  @param  num_threads number of walker threads, at least one.
+ *  @return zero on success, non-zero if any directory could not be read.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_batch_walk (BMtoBMP_Batch_t *batch, uint32_t num_threads)
+{
+  BMtoBMP_BatchWalk_t walk;
+  memset (&walk, 0, sizeof (walk));
+  walk.batch = batch;
+  walk.dirs = new_batch_item ("", "");
+  if (walk.dirs == NULL)
+    return -1;
+  pthread_mutex_init (&walk.mutex, NULL);
+  pthread_cond_init (&walk.cond, NULL);
+
+  if (num_threads == 0)
+    num_threads = 1;
+  pthread_t *threads
+      = (pthread_t *)calloc (num_threads - 1, sizeof (*threads));
+  uint32_t started = 0;
+  while (threads != NULL && started < num_threads - 1
+         && pthread_create (&threads[started], NULL, run_walk, &walk) == 0)
+    started++;
+  run_walk (&walk);
+  for (uint32_t i = 0; i < started; i++)
+    pthread_join (threads[i], NULL);
+
+  free (threads);
+  pthread_cond_destroy (&walk.cond);
+  pthread_mutex_destroy (&walk.mutex);
+  return walk.status;
+}
+
+/**
+ *  BMtoBMP_batch_finish - converts every queued file, then stops the
+ *  converter threads and frees the batch.
+ *
+ *  @param  batch some initialized `BMtoBMP_Batch_t`.
+ *  @param  summary where the number of converted and failed files should be
+ *  stored, or NULL.
+ */
+BMtoBMP_API void
+BMtoBMP_batch_finish (BMtoBMP_Batch_t *batch, BMtoBMP_BatchSummary_t *summary)
+{
+  pthread_mutex_lock (&batch->mutex);
+  batch->closing = 1;
+  pthread_cond_broadcast (&batch->cond);
+  pthread_cond_signal (&batch->prefetch_cond);
+  pthread_mutex_unlock (&batch->mutex);
+  pthread_join (batch->prefetch_thread, NULL);
+  for (uint32_t i = 0; i < batch->num_threads; i++)
+    pthread_join (batch->threads[i], NULL);
+
+  if (summary != NULL)
+    *summary = batch->summary;
+  pthread_cond_destroy (&batch->content_cond);
+  pthread_cond_destroy (&batch->prefetch_cond);
+  pthread_cond_destroy (&batch->cond);
+  pthread_mutex_destroy (&batch->mutex);
+  close (batch->dir_fd);
+  free (batch->threads);
+  for (size_t i = 0; i < BMtoBMP_BATCH_CONTENT_BUCKETS; i++)
+    {
+      while (batch->contents[i] != NULL)
+        {
+          BMtoBMP_BatchContent_t *content = batch->contents[i];
+          batch->contents[i] = content->next;
+          free (content);
+        }
+    }
+  free (batch->contents);
+  release_palette (&batch->pal);
+}
+
+#endif /* _BM_TO_BMP_BATCH_H_ */
@@ -20,11 +20,30 @@
  *  Debug error output messages can be enabled by compiling with the
  *  `-DBMtoBMP_DEBUG_OUTPUT` flag.
  *
+ *  USDT probes for bpftrace, perf and SystemTap can be enabled by compiling
+ *  with the `-DBMtoBMP_USDT_PROBES` flag (needs `<sys/sdt.h>`). Provider
+ *  `bmtobmp` then has `parse_start(bytes)`, `parse_done`, `alloc_start`,
+ *  `alloc_done`, `expand_start`, `expand_done`, `write_start` and
+ *  `write_done`; `*_start` probes carry (width, height, bytes) and `*_done`
+ *  probes (width, height, status). Bytes are 0 where unknown.
+ *
+ *  On Linux, this header defines `_GNU_SOURCE` for `copy_file_range(2)`, so it
+ *  should be included before any system headers (or compile with
+ *  `-D_GNU_SOURCE`).
+ *
  *  Overview:
  *  This library provides functionality to convert BM image files to standard
  *  24-bit BMP images, using an accompanying PAL file to map pixel values to
- *  RGB colors. This library only exposes one public function for use:
- *  `BMtoBMP_convert_image()`.
+ *  RGB colors. This library exposes two public functions for converting
+ *  images, `BMtoBMP_convert_image()` and `BMtoBMP_convert_image_ex()`, plus
+ *  `BMtoBMP_calibrate()`, `BMtoBMP_load_calibration()`,
+ *  `BMtoBMP_kernel_name()` and `BMtoBMP_kernel_from_name()` for kernel
+ *  selection, and an in-memory API (`BMtoBMP_parse_bm()`,
+ *  `BMtoBMP_palette_from_buffer()`, `BMtoBMP_expand_indices()`,
+ *  `BMtoBMP_bmp_size()` and `BMtoBMP_encode_bmp()`) that never touches files.
+ *  `bm_to_bmp.hpp` wraps the latter in a C++20 API. `BMtoBMP_verify_bmp()`
+ *  checks an existing BMP file against its inputs, and `BMtoBMP_crc32c()`
+ *  computes the checksums returned through `BMtoBMP_Options_t`.
  *
  *  Function:
  *  `BMtoBMP_convert_image(FILE *bm_file, FILE *pal_file, const char *output_filename)`
@@ -44,6 +63,45 @@
  *    Returns:
  *      A zero on success, non-zero on failure.
  *
+ *  `BMtoBMP_convert_image_ex(FILE *bm_file, FILE *pal_file, const char *output_filename, const BMtoBMP_Options_t *opts)`
+ *    Same as `BMtoBMP_convert_image()`, but takes a set of options. `opts` may
+ *    be NULL, and a zero-initialized `BMtoBMP_Options_t` selects the defaults.
+ *
+ *    Options:
+ *    `format`: `BMtoBMP_FORMAT_24BPP` (default) writes a bottom-up 24-bit BMP.
+ *              `BMtoBMP_FORMAT_8BPP_INDEXED` writes a top-down 8-bit BMP that
+ *              stores the PAL file as its color table. When the image width is
+ *              a multiple of four, the pixel array is copied from the BM file
+ *              by the kernel (`copy_file_range(2)`/`sendfile(2)`) on Linux.
+ *              `BMtoBMP_FORMAT_32BPP` writes a 32-bit BGRX BMP.
+ *    `top_down`: non-zero stores 24/32-bit rows top-down (negative height).
+ *    `scale`:  nearest-neighbor upscaling factor for 24/32-bit output, 0 or 1
+ *              (none), 2 or 4. Each combination of depth, row order, scale
+ *              and row padding has its own compile-time specialized kernel.
+ *    `cancel`: a `BMtoBMP_CancelToken_t`; once `BMtoBMP_cancel()` is called
+ *              on it, the conversion stops within a few rows and returns
+ *              `BMtoBMP_CANCELLED`.
+ *    `deadline_ns`: a deadline from `BMtoBMP_deadline_after_ms()`; past it,
+ *              the conversion stops and returns `BMtoBMP_DEADLINE_EXCEEDED`.
+ *              Either way buffers are freed and no partial output is left.
+ *    `checksum`: if not NULL, receives the CRC-32C of the whole BMP file,
+ *              computed while it is written (see `BMtoBMP_crc32c()`).
+ *    `kernel`: the palette expansion kernel for 24-bit output.
+ *              `BMtoBMP_KERNEL_AUTO` (default) picks one by image size and
+ *              CPU; `BMtoBMP_KERNEL_STREAM` uses SSE2 non-temporal stores and
+ *              is picked automatically once the output outgrows the
+ *              last-level cache (override with `-DBMtoBMP_STREAM_MIN_BYTES`).
+ *              `BMtoBMP_KERNEL_PAIR_LUT` looks up two pixels at a time in a
+ *              65536-entry table built per conversion, and is picked for
+ *              images of at least `BMtoBMP_PAIR_LUT_MIN_PIXELS` pixels.
+ *              `BMtoBMP_KERNEL_VBMI` looks up 64 pixels per channel with
+ *              AVX-512 VBMI byte permutes, and is preferred whenever the CPU
+ *              supports it.
+ *              With `BMtoBMP_KERNEL_AUTO`, the `BMTOBMP_KERNEL` environment
+ *              variable (e.g. "scalar") forces a kernel, and otherwise the
+ *              crossover points measured by `BMtoBMP_calibrate()` or read by
+ *              `BMtoBMP_load_calibration()` are consulted.
+ *
  *  Responsibility:
  *  - The caller is responsible for opening and closing both input files
  *    (`bm_file` and `pal_file`).
@@ -54,14 +112,158 @@
 #ifndef _BM_TO_BITMAP_CONVERTER_H_
 #define _BM_TO_BITMAP_CONVERTER_H_
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif /* __linux__ */
+
+#include <inttypes.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define BMtoBMP_POSIX
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif /* __unix__ || __APPLE__ */
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif /* __linux__ */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define BMtoBMP_HAVE_STREAM_KERNEL
+#endif /* __SSE2__ */
+
+/* Built with function-level target attributes and picked at run time. MinGW
+ * does not align the stack for spilled zmm registers, so Windows is left
+ * out. */
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(_WIN32)
+#include <immintrin.h>
+#define BMtoBMP_HAVE_VBMI_KERNEL
+#endif /* __GNUC__ && __x86_64__ && !_WIN32 */
+
+/* CRC-32C instructions: SSE4.2 is picked at run time, ARMv8 CRC only when the
+ * whole build targets it. */
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define BMtoBMP_HAVE_SSE42_CRC32C
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif /* __GNUC__ && __x86_64__ */
+
+/* Tracing probes, see the top of this file. Without
+ * `-DBMtoBMP_USDT_PROBES` they expand to nothing, and their arguments are
+ * never evaluated. */
+#if defined(BMtoBMP_USDT_PROBES)
+#include <sys/sdt.h>
+#define BMtoBMP_PROBE1(NAME, A) DTRACE_PROBE1 (bmtobmp, NAME, A)
+#define BMtoBMP_PROBE3(NAME, A, B, C) DTRACE_PROBE3 (bmtobmp, NAME, A, B, C)
+#else
+#define BMtoBMP_PROBE1(NAME, A) ((void)0)
+#define BMtoBMP_PROBE3(NAME, A, B, C) ((void)0)
+#endif /* BMtoBMP_USDT_PROBES */
+
+/* C99 `[static 1]` array parameters, which C++ lacks. */
+#ifdef __cplusplus
+#define BMtoBMP_STATIC_1
+#else
+#define BMtoBMP_STATIC_1 static 1
+#endif /* __cplusplus */
+
+/* Public functions are defined in the headers. C programs include them from
+ * one translation unit; in C++ they get internal linkage, so the wrappers can
+ * be included from as many as need them. */
+#ifdef __cplusplus
+#define BMtoBMP_API static inline
+#else
+#define BMtoBMP_API
+#endif /* __cplusplus */
+
 #define BMtoBMP_BYTES_PER_PIXEL (3) // 24-bits-per-pixel
 #define BMtoBMP_OUTPUT_FILENAME_MAX_LEN (256)
+#define BMtoBMP_BM_PIXEL_DATA_OFFSET (0x0C)
+#define BMtoBMP_PALETTE_NUM_COLORS (256)
+#define BMtoBMP_BMP_HEADER_SIZE (54)
+
+/* Return values of interrupted conversions, besides the usual -1. */
+#define BMtoBMP_CANCELLED (-2)
+#define BMtoBMP_DEADLINE_EXCEEDED (-3)
+
+typedef enum BMtoBMP_OutputFormat_e
+{
+  BMtoBMP_FORMAT_24BPP = 0,    // BGR
+  BMtoBMP_FORMAT_8BPP_INDEXED, // top-down, PAL file as the color table
+  BMtoBMP_FORMAT_32BPP,        // BGRX
+} BMtoBMP_OutputFormat_t;
+
+/* Palette expansion kernels; unavailable kernels fall back to `AUTO`. */
+typedef enum BMtoBMP_Kernel_e
+{
+  BMtoBMP_KERNEL_AUTO = 0, // picked by image size and CPU
+  BMtoBMP_KERNEL_SCALAR,   // one 32-bit table lookup per pixel
+  BMtoBMP_KERNEL_STREAM,   // SSE2 non-temporal stores, for huge images
+  BMtoBMP_KERNEL_PAIR_LUT, // one 6-byte table copy per two pixels
+  BMtoBMP_KERNEL_VBMI,     // AVX-512 VBMI byte permutes, 64 pixels at a time
+  BMtoBMP_KERNEL_COUNT
+} BMtoBMP_Kernel_t;
+
+/* Set by `BMtoBMP_cancel()`, from any thread. */
+typedef struct BMtoBMP_CancelToken_s
+{
+  volatile int cancelled;
+} BMtoBMP_CancelToken_t;
+
+typedef struct BMtoBMP_Options_s
+{
+  BMtoBMP_OutputFormat_t format;
+  BMtoBMP_Kernel_t kernel;
+  uint8_t top_down; // non-zero stores rows top-down, ignored when indexed
+  uint8_t scale;    // nearest-neighbor upscaling factor: 0 or 1 (none), 2, 4
+  BMtoBMP_CancelToken_t *cancel; // NULL if the conversion can't be cancelled
+  uint64_t deadline_ns; // see `BMtoBMP_deadline_after_ms()`, zero for none
+  uint32_t *checksum;   // if not NULL, receives the BMP's CRC-32C
+} BMtoBMP_Options_t;
+
+typedef struct BMtoBMP_Palette_s
+{
+  uint32_t bgr[BMtoBMP_PALETTE_NUM_COLORS]; // B | G << 8 | R << 16
+  uint16_t num_colors;
+  uint8_t planar[BMtoBMP_BYTES_PER_PIXEL][BMtoBMP_PALETTE_NUM_COLORS]; // B, G, R
+  uint8_t *pairs; // BGRBGR per index pair, see `build_pair_table()`
+} BMtoBMP_Palette_t;
+
+/**
+ *  BMtoBMP_RowKernel_t - expands `n` palette indices into `n` BGR pixels.
+ *
+ *  @param  dst output row of `n * BMtoBMP_BYTES_PER_PIXEL` bytes.
+ *  @param  indices `n` palette indices.
+ *  @param  n number of pixels.
+ *  @param  pal palette to look the indices up in.
+ */
+typedef void (*BMtoBMP_RowKernel_t) (uint8_t *dst, const uint8_t *indices,
+                                     uint32_t n, const BMtoBMP_Palette_t *pal);
+
+/* Crossover points measured by `BMtoBMP_calibrate()`: `kernel[i]` is the
+ * fastest kernel for images of at least `min_pixels[i]` pixels. */
+#define BMtoBMP_CALIBRATION_MAX_ENTRIES (16)
+typedef struct BMtoBMP_Calibration_s
+{
+  uint32_t count;
+  uint64_t min_pixels[BMtoBMP_CALIBRATION_MAX_ENTRIES];
+  BMtoBMP_Kernel_t kernel[BMtoBMP_CALIBRATION_MAX_ENTRIES];
+} BMtoBMP_Calibration_t;
+
+/* Set once, see `install_calibration()`. */
+static BMtoBMP_Calibration_t BMtoBMP_calibration;
+static int BMtoBMP_calibration_state; // 0 unset, 1 being set, 2 set
 
 typedef struct BMtoBMP_BitmapImage_s
 {
@@ -85,15 +287,129 @@ destroy_img_data (BMtoBMP_BitmapImage_t *img)
 
   if (img->data != NULL)
     {
-      for (uint32_t i = 0; i < img->height; i++)
-        {
-          free (img->data[i]);
-        }
+      /* Rows are slices of the single pixel buffer starting at `data[0]`. */
+      if (img->height > 0)
+        free (img->data[0]);
       free (img->data);
       img->data = NULL;
     }
 }
 
+/**
+ *  monotonic_ns - reads a monotonic clock, or processor time where POSIX
+ *  clocks are unavailable.
+ *
+ *  @return the time in nanoseconds.
+ */
+static uint64_t
+monotonic_ns (void)
+{
+#ifdef BMtoBMP_POSIX
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#else
+  return (uint64_t)clock () * (1000000000u / CLOCKS_PER_SEC);
+#endif /* BMtoBMP_POSIX */
+}
+
+/**
+ *  BMtoBMP_cancel - cancels every conversion using `token`; they stop at
+ *  their next check and return `BMtoBMP_CANCELLED`.
+ *
+ *  @param  token some `BMtoBMP_CancelToken_t`.
+ */
+BMtoBMP_API void
+BMtoBMP_cancel (BMtoBMP_CancelToken_t *token)
+{
+#if defined(__GNUC__)
+  __atomic_store_n (&token->cancelled, 1, __ATOMIC_RELEASE);
+#else
+  token->cancelled = 1;
+#endif /* __GNUC__ */
+}
+
+/**
+ *  BMtoBMP_deadline_after_ms - returns a `deadline_ns` option value for
+ *  `ms` milliseconds from now.
+ *
+ *  @param  ms  milliseconds.
+ *  @return the deadline.
+ */
+BMtoBMP_API uint64_t
+BMtoBMP_deadline_after_ms (uint64_t ms)
+{
+  return monotonic_ns () + ms * 1000000u;
+}
+
+/**
+ *  check_interrupt - checks whether a conversion was cancelled or ran past
+ *  its deadline.
+ *
+ *  @param  opts  conversion options, or NULL for the defaults.
+ *  @return zero to carry on, `BMtoBMP_CANCELLED` or
+ *  `BMtoBMP_DEADLINE_EXCEEDED` to stop.
+ */
+static int8_t
+check_interrupt (const BMtoBMP_Options_t *opts)
+{
+  if (opts == NULL)
+    return 0;
+#if defined(__GNUC__)
+  if (opts->cancel != NULL
+      && __atomic_load_n (&opts->cancel->cancelled, __ATOMIC_ACQUIRE))
+#else
+  if (opts->cancel != NULL && opts->cancel->cancelled)
+#endif /* __GNUC__ */
+    {
+      return BMtoBMP_CANCELLED;
+    }
+  if (opts->deadline_ns != 0 && monotonic_ns () >= opts->deadline_ns)
+    return BMtoBMP_DEADLINE_EXCEEDED;
+  return 0;
+}
+
+/**
+ *  interrupt_interval - returns how many rows of `width` pixels to convert
+ *  between `check_interrupt()` calls, about 16K pixels' worth.
+ *
+ *  @param  width image width in pixels.
+ *  @return the number of rows, at least one.
+ */
+static uint32_t
+interrupt_interval (uint32_t width)
+{
+  return 1 + ((uint32_t)1 << 14) / (width + 1);
+}
+
+/**
+ *  load_le32 - loads a little endian uint32 from memory.
+ *
+ *  @param  src the 4 bytes to load.
+ *  @return the `uint32_t`.
+ */
+static uint32_t
+load_le32 (const uint8_t *src)
+{
+  return ((uint32_t)src[3] << 24) | ((uint32_t)src[2] << 16)
+         | ((uint32_t)src[1] << 8) | (uint32_t)src[0];
+}
+
+/**
+ *  store_le32 - stores a little endian (u)int32 in memory.
+ *
+ *  @param  dst where the 4 bytes should be stored.
+ *  @param  x some `uint32_t` or `int32_t`.
+ */
+static void
+store_le32 (uint8_t *dst, uint32_t x)
+{
+  dst[0] = (uint8_t)(x & 0xFF);
+  dst[1] = (uint8_t)((x & 0xFF00) >> 8);
+  dst[2] = (uint8_t)((x & 0xFF0000) >> 16);
+  dst[3] = (uint8_t)((x & 0xFF000000) >> 24);
+}
+
 /**
  *  read_uint32_from_file - reads a little endian uint32 from the given file.
  *
@@ -115,361 +431,2550 @@ read_uint32_from_file (FILE *fptr, uint32_t *output)
       return -1;
     }
 
-  *output = ((uint32_t)bytes[3] << 24) | ((uint32_t)bytes[2] << 16)
-            | ((uint32_t)bytes[1] << 8) | (uint32_t)bytes[0];
+  *output = load_le32 (bytes);
 
   return 0;
 }
 
 /**
- *  write_le_int32_to_file - writes a little endian (u)int32 to the given file.
+ *  write_string_to_file - writes a given string to the given file.
  *
- *  @param  fptr  file ptr (`FILE *`) where the int32 should be written.
- *  @param  x some `uint32_t` or `int32_t`.
+ *  @param  fptr  file ptr (`FILE *`) where the str should be written.
+ *  @param  s a null-terminated c string.
+ *  @param  s_len `size_t` of the `s`'s length
  *  @return zero on success, non-zero on failure.
  */
 static int8_t
-write_le_int32_to_file (FILE *fptr, uint32_t x)
+write_string_to_file (FILE *fptr, const char *s, size_t s_len)
 {
-  /* clang-format off */
-  uint8_t bytes[4] = {
-    (uint8_t)(x & 0xFF),
-    (uint8_t)((x & 0xFF00) >> 8),
-    (uint8_t)((x & 0xFF0000) >> 16),
-    (uint8_t)((x & 0xFF000000) >> 24)
-  };
-  /* clang-format on */
-
-  if (fwrite (&bytes, sizeof (uint8_t), sizeof (bytes), fptr)
-      != sizeof (bytes))
+  if (fwrite (s, sizeof (char), s_len, fptr) != s_len)
     {
 #ifdef BMtoBMP_DEBUG_OUTPUT
       fprintf (stderr,
-               "[BMtoBMP] fwrite error: failed to write le int32 to file.\n");
+               "[BMtoBMP] fwrite error: failed to write string to file.\n");
 #endif /* BMtoBMP_DEBUG_OUTPUT */
       return -1;
     }
-
   return 0;
 }
 
+/* clang-format off */
+#define BMtoBMP_LE16_BYTES(x) (uint8_t)((x) & 0xFF), (uint8_t)(((x) >> 8) & 0xFF)
+#define BMtoBMP_LE32_BYTES(x)                                                \
+  BMtoBMP_LE16_BYTES ((x) & 0xFFFF), BMtoBMP_LE16_BYTES ((x) >> 16)
+
 /**
- *  write_le_int16_to_file - writes a little endian (u)int16 to the given file.
+ *  BMtoBMP_BMP_HEADER_TEMPLATE - a BMP file header and BITMAPINFOHEADER
+ *  with every field that does not depend on the image size filled in.
  *
- *  @param  fptr  file ptr (`FILE *`) where the int16 should be written.
- *  @param  x some `uint16_t` or `int16_t`.
- *  @return zero on success, non-zero on failure.
+ *  @param  BPP bits per pixel.
+ *  @param  NUM_COLORS  number of entries in the color table following the
+ *  header.
  */
-static int8_t
-write_le_int16_to_file (FILE *fptr, uint16_t x)
+#define BMtoBMP_BMP_HEADER_TEMPLATE(BPP, NUM_COLORS)                         \
+  {                                                                          \
+    'B', 'M',                   /* file signature */                         \
+    BMtoBMP_LE32_BYTES (0),     /* 0x02: file size, patched */               \
+    BMtoBMP_LE32_BYTES (0),     /* reserved */                               \
+    BMtoBMP_LE32_BYTES (BMtoBMP_BMP_HEADER_SIZE + (NUM_COLORS) * 4),         \
+    BMtoBMP_LE32_BYTES (0x28),  /* DIB header size */                        \
+    BMtoBMP_LE32_BYTES (0),     /* 0x12: width, patched */                   \
+    BMtoBMP_LE32_BYTES (0),     /* 0x16: height, patched */                  \
+    BMtoBMP_LE16_BYTES (1),     /* num color planes */                       \
+    BMtoBMP_LE16_BYTES (BPP),                                                \
+    BMtoBMP_LE32_BYTES (0),     /* no compression */                         \
+    BMtoBMP_LE32_BYTES (0),     /* 0x22: pixel data size, patched */         \
+    BMtoBMP_LE32_BYTES (0x0B13), /* horizontal pixels per meter */           \
+    BMtoBMP_LE32_BYTES (0x0B13), /* vertical pixels per meter */             \
+    BMtoBMP_LE32_BYTES (NUM_COLORS), /* colors in palette */                 \
+    BMtoBMP_LE32_BYTES (0),     /* num important colors */                   \
+  }
+
+/* Indexed by `BMtoBMP_OutputFormat_t`. */
+static const uint8_t BMtoBMP_bmp_header_templates[][BMtoBMP_BMP_HEADER_SIZE]
+    = {
+        BMtoBMP_BMP_HEADER_TEMPLATE (24, 0),
+        BMtoBMP_BMP_HEADER_TEMPLATE (8, BMtoBMP_PALETTE_NUM_COLORS),
+        BMtoBMP_BMP_HEADER_TEMPLATE (32, 0),
+      };
+/* clang-format on */
+
+/**
+ *  encode_bmp_header - encodes a BMP file header and BITMAPINFOHEADER by
+ *  copying the format's template and filling in the size fields.
+ *
+ *  @param  dst where the `BMtoBMP_BMP_HEADER_SIZE` bytes should be stored.
+ *  @param  format  the `BMtoBMP_OutputFormat_t` of the pixel data.
+ *  @param  width image width in pixels.
+ *  @param  height  image height in pixels, negative for top-down images.
+ */
+static void
+encode_bmp_header (uint8_t *dst, BMtoBMP_OutputFormat_t format,
+                   uint32_t width, int32_t height)
 {
-  /* clang-format off */
-  uint8_t bytes[2] = {
-    (uint8_t)(x & 0xFF),
-    (uint8_t)((x & 0xFF00) >> 8),
-  };
-  /* clang-format on */
+  const uint8_t *header = BMtoBMP_bmp_header_templates[format];
+  const uint32_t abs_height
+      = height < 0 ? (uint32_t)(-(int64_t)height) : (uint32_t)height;
+  const uint32_t stride = ((width * header[0x1C] + 31) / 32) * 4;
+  const uint32_t pixel_data_size = stride * abs_height;
+
+  memcpy (dst, header, BMtoBMP_BMP_HEADER_SIZE);
+  store_le32 (dst + 0x02, load_le32 (header + 0x0A) + pixel_data_size);
+  store_le32 (dst + 0x12, width);
+  store_le32 (dst + 0x16, (uint32_t)height);
+  store_le32 (dst + 0x22, pixel_data_size);
+}
+
+/* CRC-32C (Castagnoli) of each byte, reflected polynomial 0x82F63B78. */
+static const uint32_t BMtoBMP_crc32c_table[256] = {
+  0x00000000, 0xF26B8303, 0xE13B70F7, 0x1350F3F4, 0xC79A971F, 0x35F1141C,
+  0x26A1E7E8, 0xD4CA64EB, 0x8AD958CF, 0x78B2DBCC, 0x6BE22838, 0x9989AB3B,
+  0x4D43CFD0, 0xBF284CD3, 0xAC78BF27, 0x5E133C24, 0x105EC76F, 0xE235446C,
+  0xF165B798, 0x030E349B, 0xD7C45070, 0x25AFD373, 0x36FF2087, 0xC494A384,
+  0x9A879FA0, 0x68EC1CA3, 0x7BBCEF57, 0x89D76C54, 0x5D1D08BF, 0xAF768BBC,
+  0xBC267848, 0x4E4DFB4B, 0x20BD8EDE, 0xD2D60DDD, 0xC186FE29, 0x33ED7D2A,
+  0xE72719C1, 0x154C9AC2, 0x061C6936, 0xF477EA35, 0xAA64D611, 0x580F5512,
+  0x4B5FA6E6, 0xB93425E5, 0x6DFE410E, 0x9F95C20D, 0x8CC531F9, 0x7EAEB2FA,
+  0x30E349B1, 0xC288CAB2, 0xD1D83946, 0x23B3BA45, 0xF779DEAE, 0x05125DAD,
+  0x1642AE59, 0xE4292D5A, 0xBA3A117E, 0x4851927D, 0x5B016189, 0xA96AE28A,
+  0x7DA08661, 0x8FCB0562, 0x9C9BF696, 0x6EF07595, 0x417B1DBC, 0xB3109EBF,
+  0xA0406D4B, 0x522BEE48, 0x86E18AA3, 0x748A09A0, 0x67DAFA54, 0x95B17957,
+  0xCBA24573, 0x39C9C670, 0x2A993584, 0xD8F2B687, 0x0C38D26C, 0xFE53516F,
+  0xED03A29B, 0x1F682198, 0x5125DAD3, 0xA34E59D0, 0xB01EAA24, 0x42752927,
+  0x96BF4DCC, 0x64D4CECF, 0x77843D3B, 0x85EFBE38, 0xDBFC821C, 0x2997011F,
+  0x3AC7F2EB, 0xC8AC71E8, 0x1C661503, 0xEE0D9600, 0xFD5D65F4, 0x0F36E6F7,
+  0x61C69362, 0x93AD1061, 0x80FDE395, 0x72966096, 0xA65C047D, 0x5437877E,
+  0x4767748A, 0xB50CF789, 0xEB1FCBAD, 0x197448AE, 0x0A24BB5A, 0xF84F3859,
+  0x2C855CB2, 0xDEEEDFB1, 0xCDBE2C45, 0x3FD5AF46, 0x7198540D, 0x83F3D70E,
+  0x90A324FA, 0x62C8A7F9, 0xB602C312, 0x44694011, 0x5739B3E5, 0xA55230E6,
+  0xFB410CC2, 0x092A8FC1, 0x1A7A7C35, 0xE811FF36, 0x3CDB9BDD, 0xCEB018DE,
+  0xDDE0EB2A, 0x2F8B6829, 0x82F63B78, 0x709DB87B, 0x63CD4B8F, 0x91A6C88C,
+  0x456CAC67, 0xB7072F64, 0xA457DC90, 0x563C5F93, 0x082F63B7, 0xFA44E0B4,
+  0xE9141340, 0x1B7F9043, 0xCFB5F4A8, 0x3DDE77AB, 0x2E8E845F, 0xDCE5075C,
+  0x92A8FC17, 0x60C37F14, 0x73938CE0, 0x81F80FE3, 0x55326B08, 0xA759E80B,
+  0xB4091BFF, 0x466298FC, 0x1871A4D8, 0xEA1A27DB, 0xF94AD42F, 0x0B21572C,
+  0xDFEB33C7, 0x2D80B0C4, 0x3ED04330, 0xCCBBC033, 0xA24BB5A6, 0x502036A5,
+  0x4370C551, 0xB11B4652, 0x65D122B9, 0x97BAA1BA, 0x84EA524E, 0x7681D14D,
+  0x2892ED69, 0xDAF96E6A, 0xC9A99D9E, 0x3BC21E9D, 0xEF087A76, 0x1D63F975,
+  0x0E330A81, 0xFC588982, 0xB21572C9, 0x407EF1CA, 0x532E023E, 0xA145813D,
+  0x758FE5D6, 0x87E466D5, 0x94B49521, 0x66DF1622, 0x38CC2A06, 0xCAA7A905,
+  0xD9F75AF1, 0x2B9CD9F2, 0xFF56BD19, 0x0D3D3E1A, 0x1E6DCDEE, 0xEC064EED,
+  0xC38D26C4, 0x31E6A5C7, 0x22B65633, 0xD0DDD530, 0x0417B1DB, 0xF67C32D8,
+  0xE52CC12C, 0x1747422F, 0x49547E0B, 0xBB3FFD08, 0xA86F0EFC, 0x5A048DFF,
+  0x8ECEE914, 0x7CA56A17, 0x6FF599E3, 0x9D9E1AE0, 0xD3D3E1AB, 0x21B862A8,
+  0x32E8915C, 0xC083125F, 0x144976B4, 0xE622F5B7, 0xF5720643, 0x07198540,
+  0x590AB964, 0xAB613A67, 0xB831C993, 0x4A5A4A90, 0x9E902E7B, 0x6CFBAD78,
+  0x7FAB5E8C, 0x8DC0DD8F, 0xE330A81A, 0x115B2B19, 0x020BD8ED, 0xF0605BEE,
+  0x24AA3F05, 0xD6C1BC06, 0xC5914FF2, 0x37FACCF1, 0x69E9F0D5, 0x9B8273D6,
+  0x88D28022, 0x7AB90321, 0xAE7367CA, 0x5C18E4C9, 0x4F48173D, 0xBD23943E,
+  0xF36E6F75, 0x0105EC76, 0x12551F82, 0xE03E9C81, 0x34F4F86A, 0xC69F7B69,
+  0xD5CF889D, 0x27A40B9E, 0x79B737BA, 0x8BDCB4B9, 0x988C474D, 0x6AE7C44E,
+  0xBE2DA0A5, 0x4C4623A6, 0x5F16D052, 0xAD7D5351,
+};
 
-  if (fwrite (&bytes, sizeof (uint8_t), sizeof (bytes), fptr)
-      != sizeof (bytes))
+#if defined(BMtoBMP_HAVE_SSE42_CRC32C)
+/**
+ *  crc32c_sse42 - extends a (pre-inverted) CRC-32C with the SSE4.2 `crc32`
+ *  instruction, 8 bytes at a time.
+ *
+ *  @param  crc the CRC so far.
+ *  @param  data  the bytes to add.
+ *  @param  len length of `data`.
+ *  @return the new CRC.
+ */
+__attribute__ ((target ("sse4.2"))) static uint32_t
+crc32c_sse42 (uint32_t crc, const uint8_t *data, size_t len)
+{
+  uint64_t crc64 = crc;
+  for (; len >= 8; data += 8, len -= 8)
     {
-#ifdef BMtoBMP_DEBUG_OUTPUT
-      fprintf (stderr,
-               "[BMtoBMP] fwrite error: failed to write le uint16 to file.\n");
-#endif /* BMtoBMP_DEBUG_OUTPUT */
-      return -1;
+      uint64_t word;
+      memcpy (&word, data, sizeof (word));
+      crc64 = _mm_crc32_u64 (crc64, word);
+    }
+  crc = (uint32_t)crc64;
+  for (; len > 0; data++, len--)
+    crc = _mm_crc32_u8 (crc, *data);
+  return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+/**
+ *  crc32c_armv8 - extends a (pre-inverted) CRC-32C with the ARMv8 CRC
+ *  instructions, 8 bytes at a time.
+ *
+ *  @param  crc the CRC so far.
+ *  @param  data  the bytes to add.
+ *  @param  len length of `data`.
+ *  @return the new CRC.
+ */
+static uint32_t
+crc32c_armv8 (uint32_t crc, const uint8_t *data, size_t len)
+{
+  for (; len >= 8; data += 8, len -= 8)
+    {
+      uint64_t word;
+      memcpy (&word, data, sizeof (word));
+      crc = __crc32cd (crc, word);
     }
+  for (; len > 0; data++, len--)
+    crc = __crc32cb (crc, *data);
+  return crc;
+}
+#endif /* BMtoBMP_HAVE_SSE42_CRC32C */
 
-  return 0;
+/**
+ *  BMtoBMP_crc32c - extends the CRC-32C of some data with `len` more bytes,
+ *  using the SSE4.2 or ARMv8 CRC instructions where the CPU has them.
+ *
+ *  @param  crc the CRC-32C of the data so far, zero to start.
+ *  @param  data  the bytes to add.
+ *  @param  len length of `data`.
+ *  @return the CRC-32C of the data followed by `data`.
+ */
+BMtoBMP_API uint32_t
+BMtoBMP_crc32c (uint32_t crc, const uint8_t *data, size_t len)
+{
+  crc = ~crc;
+#if defined(BMtoBMP_HAVE_SSE42_CRC32C)
+  /* Threads that check the CPU at once all store the same answer. */
+  static int8_t supported = -1;
+  int8_t has_sse42 = __atomic_load_n (&supported, __ATOMIC_RELAXED);
+  if (has_sse42 < 0)
+    {
+      __builtin_cpu_init ();
+      has_sse42 = __builtin_cpu_supports ("sse4.2") != 0;
+      __atomic_store_n (&supported, has_sse42, __ATOMIC_RELAXED);
+    }
+  if (has_sse42)
+    return ~crc32c_sse42 (crc, data, len);
+#elif defined(__ARM_FEATURE_CRC32)
+  return ~crc32c_armv8 (crc, data, len);
+#endif /* BMtoBMP_HAVE_SSE42_CRC32C */
+  for (size_t i = 0; i < len; i++)
+    crc = BMtoBMP_crc32c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
 }
 
 /**
- *  write_byte_to_file - writes a given (u)int8 to the given file.
+ *  write_bmp_header - writes a BMP file header and BITMAPINFOHEADER.
  *
- *  @param  fptr  file ptr (`FILE *`) where the int8 should be written.
- *  @param  x some `uint8_t` or `int8_t`.
+ *  @param  fptr  file ptr (`FILE *`) where the header should be written.
+ *  @param  format  the `BMtoBMP_OutputFormat_t` of the pixel data.
+ *  @param  width image width in pixels.
+ *  @param  height  image height in pixels, negative for top-down images.
+ *  @param  crc if not NULL, a CRC-32C to extend with the header.
  *  @return zero on success, non-zero on failure.
  */
 static int8_t
-write_byte_to_file (FILE *fptr, uint8_t x)
+write_bmp_header (FILE *fptr, BMtoBMP_OutputFormat_t format, uint32_t width,
+                  int32_t height, uint32_t *crc)
+{
+  uint8_t header[BMtoBMP_BMP_HEADER_SIZE];
+  encode_bmp_header (header, format, width, height);
+  if (crc != NULL)
+    *crc = BMtoBMP_crc32c (*crc, header, sizeof (header));
+  return write_string_to_file (fptr, (const char *)header, sizeof (header));
+}
+
+/**
+ *  BMtoBMP_palette_from_buffer - fills in `pal` from the RGB entries of PAL
+ *  file data. PAL data with fewer than 256 entries is accepted;
+ *  `pal->num_colors` records how many there were so that out-of-range
+ *  indices can be rejected.
+ *
+ *  @param  pal_data  PAL file data.
+ *  @param  pal_len length of `pal_data` in bytes.
+ *  @param  pal the `BMtoBMP_Palette_t` to fill in.
+ *  @return zero on success, non-zero on failure.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_palette_from_buffer (const uint8_t *pal_data, size_t pal_len,
+                             BMtoBMP_Palette_t *pal)
 {
-  if (fwrite (&x, sizeof (uint8_t), sizeof (x), fptr) != sizeof (x))
+  uint8_t rgb[BMtoBMP_PALETTE_NUM_COLORS * 3] = { 0 };
+  const size_t num_colors = pal_len / 3 < BMtoBMP_PALETTE_NUM_COLORS
+                                ? pal_len / 3
+                                : BMtoBMP_PALETTE_NUM_COLORS;
+  if (num_colors > 0)
+    memcpy (rgb, pal_data, num_colors * 3);
+  pal->pairs = NULL;
+  pal->num_colors = (uint16_t)num_colors;
+
+  /* Data must be in LE order so it actually goes BGR, not RGB. */
+  for (uint32_t i = 0; i < BMtoBMP_PALETTE_NUM_COLORS; i++)
     {
-#ifdef BMtoBMP_DEBUG_OUTPUT
-      fprintf (stderr,
-               "[BMtoBMP] fwrite error: failed to write le uint16 to file.\n");
-#endif /* BMtoBMP_DEBUG_OUTPUT */
-      return -1;
+      pal->bgr[i] = ((uint32_t)rgb[i * 3] << 16)
+                    | ((uint32_t)rgb[i * 3 + 1] << 8) | rgb[i * 3 + 2];
+      pal->planar[0][i] = rgb[i * 3 + 2];
+      pal->planar[1][i] = rgb[i * 3 + 1];
+      pal->planar[2][i] = rgb[i * 3];
     }
 
   return 0;
 }
 
 /**
- *  write_string_to_file - writes a given string to the given file.
+ *  load_palette - reads the RGB entries of `pal_file` into `pal`, see
+ *  `BMtoBMP_palette_from_buffer()`.
  *
- *  @param  fptr  file ptr (`FILE *`) where the str should be written.
- *  @param  s a null-terminated c string.
- *  @param  s_len `size_t` of the `s`'s length
+ *  @param  pal_file  file ptr (`FILE *`) to some open pal_file.
+ *  @param  pal the `BMtoBMP_Palette_t` to fill in.
  *  @return zero on success, non-zero on failure.
  */
 static int8_t
-write_string_to_file (FILE *fptr, const char *s, size_t s_len)
+load_palette (FILE *pal_file, BMtoBMP_Palette_t *pal)
 {
-  if (fwrite (s, sizeof (char), s_len, fptr) != s_len)
+  uint8_t rgb[BMtoBMP_PALETTE_NUM_COLORS * 3];
+  fseek (pal_file, 0x0, SEEK_SET);
+  const size_t pal_len = fread (rgb, sizeof (uint8_t), sizeof (rgb), pal_file);
+  if (ferror (pal_file))
     {
 #ifdef BMtoBMP_DEBUG_OUTPUT
       fprintf (stderr,
-               "[BMtoBMP] fwrite error: failed to write string to file.\n");
+               "[BMtoBMP] fread error: error reading data from PAL file.\n");
 #endif /* BMtoBMP_DEBUG_OUTPUT */
       return -1;
     }
-  return 0;
+
+  return BMtoBMP_palette_from_buffer (rgb, pal_len, pal);
 }
 
 /**
- *  output_image_to_file - writes bitmap file to output file specified by the
- *  given `BMtoBMP_BitmapImage_t`'s `filename` data field.
+ *  build_pair_table - builds `pal`'s pair table, which holds the six BGR
+ *  bytes of every pair of indices, keyed by `first | second << 8`. At 384 KiB
+ *  it takes about as long to build as expanding 128K pixels one at a time.
  *
- *  @param  img the `BMtoBMP_BitmapImage_t` to be written.
+ *  @param  pal some loaded `BMtoBMP_Palette_t`.
  *  @return zero on success, non-zero on failure.
  */
 static int8_t
-output_image_to_file (BMtoBMP_BitmapImage_t *img)
+build_pair_table (BMtoBMP_Palette_t *pal)
 {
-  FILE *output = fopen (img->filename, "wb");
-  if (output == NULL)
+  const size_t pair_len = 2 * BMtoBMP_BYTES_PER_PIXEL;
+  pal->pairs = (uint8_t *)malloc (pair_len * BMtoBMP_PALETTE_NUM_COLORS
+                                  * BMtoBMP_PALETTE_NUM_COLORS);
+  if (pal->pairs == NULL)
     {
 #ifdef BMtoBMP_DEBUG_OUTPUT
-      fprintf (stderr, "[BMtoBMP] fopen error: could not create file, %s.\n",
-               img->filename);
+      fprintf (stderr, "[BMtoBMP] malloc error: unable to allocate palette "
+                       "pair table.\n");
 #endif /* BMtoBMP_DEBUG_OUTPUT */
       return -1;
     }
 
-  /* Make sure we're at the beginning of the file. */
-  fseek (output, 0x0, SEEK_SET);
-
-  const uint32_t pixel_data_size
-      = (img->width * img->height * BMtoBMP_BYTES_PER_PIXEL);
-  const uint32_t output_file_size = 54 + pixel_data_size;
-  const int32_t ppm_resolution = 0x0B13; // pixel per meter
-
-  /* Populate bitmap file header. (BITMAPINFOHEADER) */
-  if (write_string_to_file (output, "BM", 2) != 0 // file signature
-      || write_le_int32_to_file (output, output_file_size) != 0
-      || write_le_int32_to_file (output, 0x0) != 0  // Reserved
-      || write_le_int32_to_file (output, 0x36) != 0 // pixel array offset
-      || write_le_int32_to_file (output, 0x28) != 0 // DIB header size
-      || write_le_int32_to_file (output, img->width) != 0
-      || write_le_int32_to_file (output, img->height) != 0
-      || write_le_int16_to_file (output, 0x1) != 0 // num color planes
-      || write_le_int16_to_file (output, BMtoBMP_BYTES_PER_PIXEL * 8) != 0
-      || write_le_int32_to_file (output, 0x0) != 0 // no compression
-      || write_le_int32_to_file (output, 0x0) != 0
-      || write_le_int32_to_file (output, ppm_resolution) // horizontal
-      || write_le_int32_to_file (output, ppm_resolution) // vertical
-      || write_le_int32_to_file (output, 0x0) // num colors in palette
-      || write_le_int32_to_file (output, 0x0) // num important colors
-  )
-    {
-      goto clean_up;
-    }
-
-  /* Output image data to file. */
-  const uint32_t pad = (4 - (img->width * BMtoBMP_BYTES_PER_PIXEL) % 4) % 4;
-  for (uint32_t i = 0; i < img->height; i++)
+  uint8_t *entry = pal->pairs;
+  for (uint32_t second = 0; second < BMtoBMP_PALETTE_NUM_COLORS; second++)
     {
-      for (uint32_t j = 0; j < img->width; j++)
-        {
-          for (uint32_t k = 0; k < BMtoBMP_BYTES_PER_PIXEL; k++)
-            {
-              if (write_byte_to_file (output, img->data[i][j * 3 + k]) != 0)
-                {
-                  goto clean_up;
-                }
-            }
-        }
-      for (uint32_t p = 0; p < pad; p++)
+      const uint32_t c1 = pal->bgr[second];
+      for (uint32_t first = 0; first < BMtoBMP_PALETTE_NUM_COLORS; first++)
         {
-          write_byte_to_file (output, 0x0);
+          const uint32_t c0 = pal->bgr[first];
+          entry[0] = (uint8_t)c0;
+          entry[1] = (uint8_t)(c0 >> 8);
+          entry[2] = (uint8_t)(c0 >> 16);
+          entry[3] = (uint8_t)c1;
+          entry[4] = (uint8_t)(c1 >> 8);
+          entry[5] = (uint8_t)(c1 >> 16);
+          entry += pair_len;
         }
     }
 
-  /* Update file size in header. */
-  size_t size = ftell (output);
-  fseek (output, 0x22, SEEK_SET);
-  write_le_int32_to_file (output, size - 54);
-
-  fclose (output);
   return 0;
-clean_up:
-  fclose (output);
-  return -1;
 }
 
 /**
- *  process_image - reads in palette indexes from `bm_file` and converts them
- *  to rgb values, storing the output in `img`'s `data` data field.
+ *  release_palette - frees any tables built for `pal`.
  *
- *  @param  bm_file  file ptr (`FILE *`)to some open bm_file.
- *  @param  pal_file  file ptr (`FILE *`) to some open pal_file.
- *  @param  img some `BMtoBMP_BitmapImage_t` for writing the data into.
- *  @return zero on success, non-zero on failure.
+ *  @param  pal some loaded `BMtoBMP_Palette_t`.
+ */
+static void
+release_palette (BMtoBMP_Palette_t *pal)
+{
+  free (pal->pairs);
+  pal->pairs = NULL;
+}
+
+/**
+ *  indices_in_palette - checks that every index refers to a palette entry.
+ *
+ *  @param  indices palette indices.
+ *  @param  n number of indices.
+ *  @param  pal the `BMtoBMP_Palette_t` they index into.
+ *  @return zero if they all do, non-zero otherwise.
  */
 static int8_t
-process_image (FILE *bm_file, FILE *pal_file, BMtoBMP_BitmapImage_t *img)
+indices_in_palette (const uint8_t *indices, uint32_t n,
+                    const BMtoBMP_Palette_t *pal)
 {
-  fseek (bm_file, 0x0C, SEEK_SET);
+  if (pal->num_colors >= BMtoBMP_PALETTE_NUM_COLORS)
+    return 0;
 
-  // for (uint32_t i = 0; i < img->height; i++)
-  for (int32_t i = img->height - 1; i >= 0; i--)
+  for (uint32_t i = 0; i < n; i++)
     {
-      for (uint32_t j = 0; j < img->width; j++)
+      if (indices[i] >= pal->num_colors)
         {
-          /* Get PAL offset from BM file. */
-          uint8_t offset;
-          size_t bytes_read = fread (&offset, sizeof (uint8_t), 1, bm_file);
-          if (bytes_read != 1)
-            {
 #ifdef BMtoBMP_DEBUG_OUTPUT
-              fprintf (
-                  stderr,
-                  "[BMtoBMP] fread error: error reading data from BM file.\n");
+          fprintf (stderr,
+                   "[BMtoBMP] fread error: error reading data from PAL "
+                   "file, index %d is past its %d colors.\n",
+                   indices[i], pal->num_colors);
 #endif /* BMtoBMP_DEBUG_OUTPUT */
-              return -1;
-            }
-
-          /* Read color data from PAL file using offset. */
-          fseek (pal_file, offset * 0x3, SEEK_SET);
-          uint8_t color_data[3] = { 0 };
-          for (uint8_t k = 0; k < 3; k++)
-            {
-              bytes_read
-                  = fread (&color_data[k], sizeof (uint8_t), 1, pal_file);
-              if (bytes_read != 1)
-                {
-#ifdef BMtoBMP_DEBUG_OUTPUT
-                  fprintf (stderr, "[BMtoBMP] fread error: error reading data "
-                                   "from PAL file.\n");
-#endif /* BMtoBMP_DEBUG_OUTPUT */
-                  return -1;
-                }
-            }
-
-          /* Data must be in LE order so it actually goes BGR, not RGB. */
-          img->data[i][j * 3] = color_data[2];
-          img->data[i][j * 3 + 1] = color_data[1];
-          img->data[i][j * 3 + 2] = color_data[0];
+          return -1;
         }
     }
 
   return 0;
 }
 
-/**
- *  allocate_img_data - allocs memory for a `BMtoBMP_BitmapImage_t`'s `data`
- *  field.
- *
- *  @param  img some `BMtoBMP_BitmapImage_t`.
- *  @return zero on success, non-zero on failure.
- */
+/* See `BMtoBMP_RowKernel_t`. */
 static void
-allocate_img_data (BMtoBMP_BitmapImage_t *img)
+expand_row_scalar (uint8_t *dst, const uint8_t *indices, uint32_t n,
+                   const BMtoBMP_Palette_t *pal)
 {
-  img->data = (uint8_t **)calloc (img->height, sizeof (uint8_t *));
-  if (img->data == NULL)
-    {
-#ifdef BMtoBMP_DEBUG_OUTPUT
-      fprintf (stderr,
-               "[BMtoBMP] calloc error: unable to allocate image buffer of "
-               "size, %dx%dx%d.\n",
-               img->height, img->width, BMtoBMP_BYTES_PER_PIXEL * 8);
-#endif /* BMtoBMP_DEBUG_OUTPUT */
-      return;
-    }
-
-  for (uint32_t i = 0; i < img->height; i++)
+  for (uint32_t i = 0; i < n; i++)
     {
-      img->data[i] = (uint8_t *)calloc (img->width * BMtoBMP_BYTES_PER_PIXEL,
-                                        sizeof (uint8_t));
-      if (img->data[i] == NULL)
-        {
-          for (uint32_t j = 0; j < i; j++)
-            {
-              free (img->data[j]);
-            }
-          free (img->data);
-          img->data = NULL;
-          return;
-        }
+      const uint32_t color = pal->bgr[indices[i]];
+      dst[0] = (uint8_t)color;
+      dst[1] = (uint8_t)(color >> 8);
+      dst[2] = (uint8_t)(color >> 16);
+      dst += BMtoBMP_BYTES_PER_PIXEL;
     }
 }
 
 /**
- *  create_image - uses image height and width data to create and init a
- *  `BMtoBMP_BitmapImage_t`.
+ *  expand_row_pair_lut - like `expand_row_scalar()`, but copies two pixels
+ *  at a time out of the palette's pair table, halving the number of lookups.
+ *  Needs no SIMD, so it suits the i686 and SIMD-less builds.
  *
- *  @param  bm_file  file ptr (`FILE *`)to some open bm_file.
- *  @param  img some uninitialized `BMtoBMP_BitmapImage_t`.
- *  @return zero on success, non-zero on failure.
+ *  See `BMtoBMP_RowKernel_t`.
  */
-static int8_t
-create_image (FILE *bm_file, BMtoBMP_BitmapImage_t *img)
+static void
+expand_row_pair_lut (uint8_t *dst, const uint8_t *indices, uint32_t n,
+                     const BMtoBMP_Palette_t *pal)
 {
-  if (read_uint32_from_file (bm_file, &img->width) != 0
-      || read_uint32_from_file (bm_file, &img->height) != 0)
+  const size_t pair_len = 2 * BMtoBMP_BYTES_PER_PIXEL;
+  for (; n >= 2; n -= 2, indices += 2, dst += pair_len)
     {
-      return -1;
+      const uint32_t pair = indices[0] | ((uint32_t)indices[1] << 8);
+      memcpy (dst, pal->pairs + pair * pair_len, pair_len);
     }
 
-  allocate_img_data (img);
-  if (img->data == NULL)
-    return -1;
-
-  return 0;
+  expand_row_scalar (dst, indices, n, pal);
 }
 
+#ifdef BMtoBMP_HAVE_STREAM_KERNEL
 /**
- *  BMtoBMP_convert_image - The primary function for converting a BM image file
- *  to BMP format.
+ *  expand_row_stream - like `expand_row_scalar()`, but writes the row with
+ *  non-temporal stores, so filling a buffer larger than the last-level cache
+ *  does not evict the palette and indices. Every four pixels are packed into
+ *  three 32-bit words. Callers must `_mm_sfence()` once all rows are done.
  *
- *  @param  bm_file  file ptr (`FILE *`)to some open bm_file.
- *  @param  pal_file  file ptr (`FILE *`) to some open pal_file.
- *  @param  output_filename sz of the desired output filename, max len = 250.
- *  @return zero on success, non-zero on failure.
+ *  See `BMtoBMP_RowKernel_t`.
  */
-int8_t
-BMtoBMP_convert_image (FILE *bm_file, FILE *pal_file,
-                       char const output_filename[static 1])
+static void
+expand_row_stream (uint8_t *dst, const uint8_t *indices, uint32_t n,
+                   const BMtoBMP_Palette_t *pal)
 {
-  /* len(".BMP\0") = 5 */
-  if (strlen (output_filename) + 5 > BMtoBMP_OUTPUT_FILENAME_MAX_LEN)
+  /* 3 is its own inverse mod 4, so (3 * misalignment) % 4 pixels realign. */
+  const uint32_t misalignment = (uint32_t)(-(uintptr_t)dst & 3);
+  uint32_t head = (3 * misalignment) % 4;
+  if (head > n)
+    head = n;
+  expand_row_scalar (dst, indices, head, pal);
+  dst += head * BMtoBMP_BYTES_PER_PIXEL;
+  indices += head;
+  n -= head;
+
+  int *out = (int *)(void *)dst;
+  for (; n >= 4; n -= 4, indices += 4, out += 3)
     {
-#ifdef BMtoBMP_DEBUG_OUTPUT
-      fprintf (stderr, "[BMtoBMP] output filename is too long.\n");
+      const uint32_t c0 = pal->bgr[indices[0]];
+      const uint32_t c1 = pal->bgr[indices[1]];
+      const uint32_t c2 = pal->bgr[indices[2]];
+      const uint32_t c3 = pal->bgr[indices[3]];
+      _mm_stream_si32 (out, (int)(c0 | (c1 << 24)));
+      _mm_stream_si32 (out + 1, (int)((c1 >> 8) | (c2 << 16)));
+      _mm_stream_si32 (out + 2, (int)((c2 >> 16) | (c3 << 8)));
+    }
+
+  expand_row_scalar ((uint8_t *)out, indices, n, pal);
+}
+#endif /* BMtoBMP_HAVE_STREAM_KERNEL */
+
+#ifdef BMtoBMP_HAVE_VBMI_KERNEL
+/* `vpermi2b` indices that interleave 64 B and 64 G bytes into each third of
+ * 64 BGR pixels, leaving the R slots for `BMtoBMP_vbmi_r_index`. */
+/* clang-format off */
+static const uint8_t BMtoBMP_vbmi_bg_index[3][64] = {
+    {
+      0, 64, 0, 1, 65, 0, 2, 66, 0, 3, 67, 0, 4, 68, 0, 5,
+      69, 0, 6, 70, 0, 7, 71, 0, 8, 72, 0, 9, 73, 0, 10, 74,
+      0, 11, 75, 0, 12, 76, 0, 13, 77, 0, 14, 78, 0, 15, 79, 0,
+      16, 80, 0, 17, 81, 0, 18, 82, 0, 19, 83, 0, 20, 84, 0, 21,
+    },
+    {
+      85, 0, 22, 86, 0, 23, 87, 0, 24, 88, 0, 25, 89, 0, 26, 90,
+      0, 27, 91, 0, 28, 92, 0, 29, 93, 0, 30, 94, 0, 31, 95, 0,
+      32, 96, 0, 33, 97, 0, 34, 98, 0, 35, 99, 0, 36, 100, 0, 37,
+      101, 0, 38, 102, 0, 39, 103, 0, 40, 104, 0, 41, 105, 0, 42, 106,
+    },
+    {
+      0, 43, 107, 0, 44, 108, 0, 45, 109, 0, 46, 110, 0, 47, 111, 0,
+      48, 112, 0, 49, 113, 0, 50, 114, 0, 51, 115, 0, 52, 116, 0, 53,
+      117, 0, 54, 118, 0, 55, 119, 0, 56, 120, 0, 57, 121, 0, 58, 122,
+      0, 59, 123, 0, 60, 124, 0, 61, 125, 0, 62, 126, 0, 63, 127, 0,
+    },
+};
+
+/* `vpermb` indices of the R byte for each R slot in each third. */
+static const uint8_t BMtoBMP_vbmi_r_index[3][64] = {
+    {
+      0, 0, 0, 0, 0, 1, 0, 0, 2, 0, 0, 3, 0, 0, 4, 0,
+      0, 5, 0, 0, 6, 0, 0, 7, 0, 0, 8, 0, 0, 9, 0, 0,
+      10, 0, 0, 11, 0, 0, 12, 0, 0, 13, 0, 0, 14, 0, 0, 15,
+      0, 0, 16, 0, 0, 17, 0, 0, 18, 0, 0, 19, 0, 0, 20, 0,
+    },
+    {
+      0, 21, 0, 0, 22, 0, 0, 23, 0, 0, 24, 0, 0, 25, 0, 0,
+      26, 0, 0, 27, 0, 0, 28, 0, 0, 29, 0, 0, 30, 0, 0, 31,
+      0, 0, 32, 0, 0, 33, 0, 0, 34, 0, 0, 35, 0, 0, 36, 0,
+      0, 37, 0, 0, 38, 0, 0, 39, 0, 0, 40, 0, 0, 41, 0, 0,
+    },
+    {
+      42, 0, 0, 43, 0, 0, 44, 0, 0, 45, 0, 0, 46, 0, 0, 47,
+      0, 0, 48, 0, 0, 49, 0, 0, 50, 0, 0, 51, 0, 0, 52, 0,
+      0, 53, 0, 0, 54, 0, 0, 55, 0, 0, 56, 0, 0, 57, 0, 0,
+      58, 0, 0, 59, 0, 0, 60, 0, 0, 61, 0, 0, 62, 0, 0, 63,
+    },
+};
+
+/* Which bytes of each third are R slots. */
+static const uint64_t BMtoBMP_vbmi_r_mask[3] = {
+  0x4924924924924924ULL, 0x2492492492492492ULL, 0x9249249249249249ULL
+};
+/* clang-format on */
+
+/**
+ *  lookup_channel_vbmi - looks up 64 indices in one 256-byte planar channel.
+ *  `vpermi2b` covers 128 entries per instruction, so both halves are looked
+ *  up and blended on each index's top bit.
+ *
+ *  @param  channel 256-byte planar palette channel.
+ *  @param  idx 64 palette indices.
+ *  @return the 64 channel values.
+ */
+__attribute__ ((target ("avx512f,avx512bw,avx512vbmi"))) static inline __m512i
+lookup_channel_vbmi (const uint8_t *channel, __m512i idx)
+{
+  const __m512i lo = _mm512_permutex2var_epi8 (
+      _mm512_loadu_si512 ((const void *)channel), idx,
+      _mm512_loadu_si512 ((const void *)(channel + 64)));
+  const __m512i hi = _mm512_permutex2var_epi8 (
+      _mm512_loadu_si512 ((const void *)(channel + 128)), idx,
+      _mm512_loadu_si512 ((const void *)(channel + 192)));
+  return _mm512_mask_blend_epi8 (_mm512_movepi8_mask (idx), lo, hi);
+}
+
+/**
+ *  expand_row_vbmi - like `expand_row_scalar()`, but looks up 64 pixels at a
+ *  time against the palette's planar B, G and R channels with byte permutes,
+ *  then interleaves the channels into 192 bytes of BGR.
+ *
+ *  See `BMtoBMP_RowKernel_t`.
+ */
+__attribute__ ((target ("avx512f,avx512bw,avx512vbmi"))) static void
+expand_row_vbmi (uint8_t *dst, const uint8_t *indices, uint32_t n,
+                 const BMtoBMP_Palette_t *pal)
+{
+  for (; n >= 64; n -= 64, indices += 64, dst += 64 * BMtoBMP_BYTES_PER_PIXEL)
+    {
+      const __m512i idx = _mm512_loadu_si512 ((const void *)indices);
+      const __m512i b = lookup_channel_vbmi (pal->planar[0], idx);
+      const __m512i g = lookup_channel_vbmi (pal->planar[1], idx);
+      const __m512i r = lookup_channel_vbmi (pal->planar[2], idx);
+      for (uint32_t k = 0; k < BMtoBMP_BYTES_PER_PIXEL; k++)
+        {
+          __m512i out = _mm512_permutex2var_epi8 (
+              b,
+              _mm512_loadu_si512 ((const void *)BMtoBMP_vbmi_bg_index[k]),
+              g);
+          out = _mm512_mask_permutexvar_epi8 (
+              out, BMtoBMP_vbmi_r_mask[k],
+              _mm512_loadu_si512 ((const void *)BMtoBMP_vbmi_r_index[k]), r);
+          _mm512_storeu_si512 ((void *)(dst + k * 64), out);
+        }
+    }
+
+  expand_row_scalar (dst, indices, n, pal);
+}
+#endif /* BMtoBMP_HAVE_VBMI_KERNEL */
+
+/**
+ *  stream_kernel_threshold - returns the output size above which the
+ *  streaming kernel is picked automatically: `BMtoBMP_STREAM_MIN_BYTES` if
+ *  defined at compile time, else the last-level cache size where the C
+ *  library reports it, else 8 MiB.
+ *
+ *  @return a size in bytes.
+ */
+static size_t
+stream_kernel_threshold (void)
+{
+#if defined(BMtoBMP_STREAM_MIN_BYTES)
+  return BMtoBMP_STREAM_MIN_BYTES;
+#elif defined(_SC_LEVEL3_CACHE_SIZE) && defined(__GNUC__)
+  /* Relaxed atomics suffice: every caller computes the same size. */
+  static size_t threshold = 0;
+  size_t llc_size = __atomic_load_n (&threshold, __ATOMIC_RELAXED);
+  if (llc_size == 0)
+    {
+      const long llc = sysconf (_SC_LEVEL3_CACHE_SIZE);
+      llc_size = llc > 0 ? (size_t)llc : ((size_t)8 << 20);
+      __atomic_store_n (&threshold, llc_size, __ATOMIC_RELAXED);
+    }
+  return llc_size;
+#elif defined(_SC_LEVEL3_CACHE_SIZE)
+  const long llc = sysconf (_SC_LEVEL3_CACHE_SIZE);
+  return llc > 0 ? (size_t)llc : ((size_t)8 << 20);
+#else
+  return (size_t)8 << 20;
+#endif /* BMtoBMP_STREAM_MIN_BYTES */
+}
+
+/**
+ *  kernel_is_available - checks whether `kernel` can run on this build and
+ *  CPU.
+ *
+ *  @param  kernel  some `BMtoBMP_Kernel_t`.
+ *  @return non-zero if it is, zero otherwise.
+ */
+static int8_t
+kernel_is_available (BMtoBMP_Kernel_t kernel)
+{
+  switch (kernel)
+    {
+    case BMtoBMP_KERNEL_SCALAR:
+    case BMtoBMP_KERNEL_PAIR_LUT:
+      return 1;
+#ifdef BMtoBMP_HAVE_STREAM_KERNEL
+    case BMtoBMP_KERNEL_STREAM:
+      return 1;
+#endif /* BMtoBMP_HAVE_STREAM_KERNEL */
+#ifdef BMtoBMP_HAVE_VBMI_KERNEL
+    case BMtoBMP_KERNEL_VBMI:
+      {
+        static int8_t supported = -1;
+        int8_t has_vbmi = __atomic_load_n (&supported, __ATOMIC_RELAXED);
+        if (has_vbmi < 0)
+          {
+            __builtin_cpu_init ();
+            has_vbmi = __builtin_cpu_supports ("avx512bw")
+                       && __builtin_cpu_supports ("avx512vbmi");
+            __atomic_store_n (&supported, has_vbmi, __ATOMIC_RELAXED);
+          }
+        return has_vbmi;
+      }
+#endif /* BMtoBMP_HAVE_VBMI_KERNEL */
+    default:
+      return 0;
+    }
+}
+
+/* Kernel names, as used by `BMTOBMP_KERNEL` and calibration files. */
+static const char *const BMtoBMP_kernel_names[BMtoBMP_KERNEL_COUNT]
+    = { "auto", "scalar", "stream", "pair", "vbmi" };
+
+/**
+ *  BMtoBMP_kernel_name - returns the name of a `BMtoBMP_Kernel_t`.
+ *
+ *  @param  kernel  some `BMtoBMP_Kernel_t`.
+ *  @return a null-terminated C string, "auto" for unknown kernels.
+ */
+BMtoBMP_API const char *
+BMtoBMP_kernel_name (BMtoBMP_Kernel_t kernel)
+{
+  if ((unsigned)kernel >= BMtoBMP_KERNEL_COUNT)
+    return BMtoBMP_kernel_names[BMtoBMP_KERNEL_AUTO];
+  return BMtoBMP_kernel_names[kernel];
+}
+
+/**
+ *  BMtoBMP_kernel_from_name - looks a `BMtoBMP_Kernel_t` up by name.
+ *
+ *  @param  name  a kernel name, e.g. "scalar".
+ *  @return the kernel, `BMtoBMP_KERNEL_COUNT` if the name is unknown.
+ */
+BMtoBMP_API BMtoBMP_Kernel_t
+BMtoBMP_kernel_from_name (const char *name)
+{
+  for (int k = 0; k < BMtoBMP_KERNEL_COUNT; k++)
+    {
+      if (strcmp (name, BMtoBMP_kernel_names[k]) == 0)
+        return (BMtoBMP_Kernel_t)k;
+    }
+  return BMtoBMP_KERNEL_COUNT;
+}
+
+/**
+ *  install_calibration - makes `calibration` the crossover points that
+ *  automatic kernel selection consults. Only the first call has any effect,
+ *  so conversions running on other threads never see them change.
+ *
+ *  @param  calibration the crossover points.
+ *  @return zero if they were installed, non-zero if others already were.
+ */
+static int8_t
+install_calibration (const BMtoBMP_Calibration_t *calibration)
+{
+#if defined(__GNUC__)
+  int unset = 0;
+  if (!__atomic_compare_exchange_n (&BMtoBMP_calibration_state, &unset, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return -1;
+  BMtoBMP_calibration = *calibration;
+  __atomic_store_n (&BMtoBMP_calibration_state, 2, __ATOMIC_RELEASE);
+#else
+  if (BMtoBMP_calibration_state != 0)
+    return -1;
+  BMtoBMP_calibration = *calibration;
+  BMtoBMP_calibration_state = 2;
+#endif /* __GNUC__ */
+  return 0;
+}
+
+/**
+ *  installed_calibration - returns the crossover points from
+ *  `install_calibration()`.
+ *
+ *  @return the crossover points, or NULL if none are installed yet.
+ */
+static const BMtoBMP_Calibration_t *
+installed_calibration (void)
+{
+#if defined(__GNUC__)
+  const int state
+      = __atomic_load_n (&BMtoBMP_calibration_state, __ATOMIC_ACQUIRE);
+#else
+  const int state = BMtoBMP_calibration_state;
+#endif /* __GNUC__ */
+  return state == 2 ? &BMtoBMP_calibration : NULL;
+}
+
+/**
+ *  select_kernel - resolves `requested` to a kernel that is available. For
+ *  `BMtoBMP_KERNEL_AUTO` (or an unavailable kernel), the `BMTOBMP_KERNEL`
+ *  environment variable wins, then the loaded calibration, and finally the
+ *  built-in size heuristics.
+ *
+ *  @param  requested some `BMtoBMP_Kernel_t`.
+ *  @param  width image width in pixels.
+ *  @param  height  image height in pixels.
+ *  @return an available `BMtoBMP_Kernel_t`.
+ */
+static BMtoBMP_Kernel_t
+select_kernel (BMtoBMP_Kernel_t requested, uint32_t width, uint32_t height)
+{
+  if (requested != BMtoBMP_KERNEL_AUTO && kernel_is_available (requested))
+    return requested;
+
+  const char *forced = getenv ("BMTOBMP_KERNEL");
+  if (forced != NULL)
+    {
+      const BMtoBMP_Kernel_t kernel = BMtoBMP_kernel_from_name (forced);
+      if (kernel_is_available (kernel))
+        return kernel;
+    }
+
+  const uint64_t num_pixels = (uint64_t)width * height;
+  const BMtoBMP_Calibration_t *calibration = installed_calibration ();
+  for (uint32_t i = calibration != NULL ? calibration->count : 0; i > 0; i--)
+    {
+      if (num_pixels >= calibration->min_pixels[i - 1]
+          && kernel_is_available (calibration->kernel[i - 1]))
+        {
+          return calibration->kernel[i - 1];
+        }
+    }
+
+  /* From the widest ISA down to the portable kernels. */
+  if (kernel_is_available (BMtoBMP_KERNEL_VBMI))
+    return BMtoBMP_KERNEL_VBMI;
+
+  const size_t output_size
+      = (size_t)width * height * BMtoBMP_BYTES_PER_PIXEL;
+  if (kernel_is_available (BMtoBMP_KERNEL_STREAM)
+      && output_size > stream_kernel_threshold ())
+    {
+      return BMtoBMP_KERNEL_STREAM;
+    }
+
+  /* Small images don't make up for the cost of building the pair table. */
+#ifndef BMtoBMP_PAIR_LUT_MIN_PIXELS
+#define BMtoBMP_PAIR_LUT_MIN_PIXELS ((size_t)1 << 19)
+#endif /* BMtoBMP_PAIR_LUT_MIN_PIXELS */
+  if ((size_t)width * height >= BMtoBMP_PAIR_LUT_MIN_PIXELS)
+    return BMtoBMP_KERNEL_PAIR_LUT;
+
+  return BMtoBMP_KERNEL_SCALAR;
+}
+
+/**
+ *  get_row_kernel - maps an available `BMtoBMP_Kernel_t` to its function.
+ *
+ *  @param  kernel  some available `BMtoBMP_Kernel_t`.
+ *  @return the kernel's `BMtoBMP_RowKernel_t`.
+ */
+static BMtoBMP_RowKernel_t
+get_row_kernel (BMtoBMP_Kernel_t kernel)
+{
+  switch (kernel)
+    {
+    case BMtoBMP_KERNEL_PAIR_LUT:
+      return expand_row_pair_lut;
+#ifdef BMtoBMP_HAVE_VBMI_KERNEL
+    case BMtoBMP_KERNEL_VBMI:
+      return expand_row_vbmi;
+#endif /* BMtoBMP_HAVE_VBMI_KERNEL */
+#ifdef BMtoBMP_HAVE_STREAM_KERNEL
+    case BMtoBMP_KERNEL_STREAM:
+      return expand_row_stream;
+#endif /* BMtoBMP_HAVE_STREAM_KERNEL */
+    default:
+      return expand_row_scalar;
+    }
+}
+
+/**
+ *  prepare_kernel - selects a kernel like `select_kernel()` and builds any
+ *  tables it needs for `pal`, falling back to the scalar kernel if that
+ *  fails. Tables built here are freed by `release_palette()`.
+ *
+ *  @param  requested some `BMtoBMP_Kernel_t`.
+ *  @param  width image width in pixels.
+ *  @param  height  image height in pixels.
+ *  @param  pal some loaded `BMtoBMP_Palette_t`.
+ *  @return an available `BMtoBMP_Kernel_t`, ready to run.
+ */
+static BMtoBMP_Kernel_t
+prepare_kernel (BMtoBMP_Kernel_t requested, uint32_t width, uint32_t height,
+                BMtoBMP_Palette_t *pal)
+{
+  const BMtoBMP_Kernel_t kernel = select_kernel (requested, width, height);
+  if (kernel == BMtoBMP_KERNEL_PAIR_LUT && pal->pairs == NULL
+      && build_pair_table (pal) != 0)
+    {
+      return BMtoBMP_KERNEL_SCALAR;
+    }
+
+  return kernel;
+}
+
+/**
+ *  BMtoBMP_palette_cache_tables - builds the tables any kernel may need for
+ *  `pal` up front, so that every conversion using `pal` shares them instead
+ *  of building its own. Do this before sharing `pal` between threads, and
+ *  again for a reloaded palette. Conversions that force a kernel whose
+ *  tables were not needed automatically still build them.
+ *
+ *  @param  pal some loaded `BMtoBMP_Palette_t`.
+ *  @return zero on success, non-zero on failure, in which case conversions
+ *  build their own tables as before.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_palette_cache_tables (BMtoBMP_Palette_t *pal)
+{
+  /* Unless forced, the pair kernel loses to VBMI wherever that runs. */
+  if (pal->pairs != NULL
+      || (kernel_is_available (BMtoBMP_KERNEL_VBMI)
+          && installed_calibration () == NULL
+          && getenv ("BMTOBMP_KERNEL") == NULL))
+    return 0;
+  return build_pair_table (pal);
+}
+
+/**
+ *  BMtoBMP_palette_free_tables - frees the tables cached by
+ *  `BMtoBMP_palette_cache_tables()`, once no conversion is using `pal`.
+ *
+ *  @param  pal some loaded `BMtoBMP_Palette_t`.
+ */
+BMtoBMP_API void
+BMtoBMP_palette_free_tables (BMtoBMP_Palette_t *pal)
+{
+  release_palette (pal);
+}
+
+/**
+ *  finish_kernel - makes the output of `kernel` globally visible.
+ *
+ *  @param  kernel  the `BMtoBMP_Kernel_t` that filled the image.
+ */
+static void
+finish_kernel (BMtoBMP_Kernel_t kernel)
+{
+#ifdef BMtoBMP_HAVE_STREAM_KERNEL
+  if (kernel == BMtoBMP_KERNEL_STREAM)
+    _mm_sfence ();
+#else
+  (void)kernel;
+#endif /* BMtoBMP_HAVE_STREAM_KERNEL */
+}
+
+/* Shared source of row padding, which is at most three bytes per row. */
+static const uint8_t BMtoBMP_zero_pad[4] = { 0 };
+
+#ifdef BMtoBMP_POSIX
+/* Max iovecs per `writev(2)` call; POSIX guarantees at least 16. */
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define BMtoBMP_IOV_BATCH (IOV_MAX)
+#elif defined(IOV_MAX)
+#define BMtoBMP_IOV_BATCH (1024)
+#else
+#define BMtoBMP_IOV_BATCH (16)
+#endif /* IOV_MAX */
+
+/* Max bytes per `writev(2)` call, well below `SSIZE_MAX` on 32-bit systems. */
+#define BMtoBMP_WRITEV_MAX_BYTES ((size_t)1 << 30)
+
+/* Max bytes per `writev(2)` call for conversions that can be interrupted. */
+#define BMtoBMP_INTERRUPTIBLE_WRITEV_MAX_BYTES ((size_t)4 << 20)
+
+/**
+ *  writev_all - writes every iovec in `iov` to `fd`, resubmitting the
+ *  remainder after short writes.
+ *
+ *  @param  fd  file descriptor to write to.
+ *  @param  iov array of iovecs, which is modified in place.
+ *  @param  iovcnt  number of iovecs in `iov`.
+ *  @return zero on success, non-zero on failure.
+ */
+static int8_t
+writev_all (int fd, struct iovec *iov, int iovcnt)
+{
+  while (iovcnt > 0)
+    {
+      ssize_t n = writev (fd, iov, iovcnt);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+          fprintf (stderr, "[BMtoBMP] writev error: failed to write image "
+                           "data to file.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+          return -1;
+        }
+
+      size_t written = (size_t)n;
+      while (iovcnt > 0 && written >= iov->iov_len)
+        {
+          written -= iov->iov_len;
+          iov++;
+          iovcnt--;
+        }
+      if (iovcnt > 0)
+        {
+          iov->iov_base = (uint8_t *)iov->iov_base + written;
+          iov->iov_len -= written;
+        }
+    }
+
+  return 0;
+}
+
+/**
+ *  write_rows_gathered - writes image rows and their padding to `fd` with
+ *  `writev(2)`, without staging a padded copy of the image. Padding iovecs
+ *  point into `BMtoBMP_zero_pad`, and rows that are adjacent in memory are
+ *  merged into a single iovec.
+ *
+ *  @param  fd  file descriptor to write to.
+ *  @param  rows  rows to write, in order; slices of one contiguous buffer.
+ *  @param  num_rows  number of rows.
+ *  @param  row_len length of each row in bytes, excluding padding.
+ *  @param  pad number of padding bytes after each row.
+ *  @param  opts  conversion options, checked for interrupts between
+ *  batches.
+ *  @param  crc if not NULL, a CRC-32C to extend with the rows and padding.
+ *  @return zero on success, `check_interrupt()`'s result if interrupted,
+ *  non-zero on failure.
+ */
+static int8_t
+write_rows_gathered (int fd, uint8_t *const *rows, uint32_t num_rows,
+                     size_t row_len, uint32_t pad,
+                     const BMtoBMP_Options_t *opts, uint32_t *crc)
+{
+  struct iovec iov[BMtoBMP_IOV_BATCH];
+  int iovcnt = 0;
+  size_t batch_len = 0;
+  const size_t max_batch_len
+      = (opts != NULL && (opts->cancel != NULL || opts->deadline_ns != 0))
+            ? BMtoBMP_INTERRUPTIBLE_WRITEV_MAX_BYTES
+            : BMtoBMP_WRITEV_MAX_BYTES;
+  for (uint32_t i = 0; i < num_rows; i++)
+    {
+      if (iovcnt + 2 > BMtoBMP_IOV_BATCH
+          || (iovcnt > 0 && batch_len + row_len + pad > max_batch_len))
+        {
+          if (writev_all (fd, iov, iovcnt) != 0)
+            return -1;
+          const int8_t interrupted = check_interrupt (opts);
+          if (interrupted != 0)
+            return interrupted;
+          iovcnt = 0;
+          batch_len = 0;
+        }
+
+      if (pad == 0 && iovcnt > 0
+          && (uint8_t *)iov[iovcnt - 1].iov_base + iov[iovcnt - 1].iov_len
+                 == rows[i])
+        {
+          iov[iovcnt - 1].iov_len += row_len;
+        }
+      else
+        {
+          iov[iovcnt].iov_base = rows[i];
+          iov[iovcnt].iov_len = row_len;
+          iovcnt++;
+        }
+
+      if (pad > 0)
+        {
+          iov[iovcnt].iov_base = (void *)BMtoBMP_zero_pad;
+          iov[iovcnt].iov_len = pad;
+          iovcnt++;
+        }
+      batch_len += row_len + pad;
+
+      /* The row is still in cache from being expanded. */
+      if (crc != NULL)
+        {
+          *crc = BMtoBMP_crc32c (*crc, rows[i], row_len);
+          *crc = BMtoBMP_crc32c (*crc, BMtoBMP_zero_pad, pad);
+        }
+    }
+
+  return writev_all (fd, iov, iovcnt);
+}
+#endif /* BMtoBMP_POSIX */
+
+/**
+ *  output_image_to_file - writes bitmap file to output file specified by the
+ *  given `BMtoBMP_BitmapImage_t`'s `filename` data field.
+ *
+ *  @param  img the `BMtoBMP_BitmapImage_t` to be written.
+ *  @param  opts  conversion options, or NULL for the defaults.
+ *  @return zero on success, non-zero on failure; see `check_interrupt()`.
+ */
+static int8_t
+output_image_to_file (BMtoBMP_BitmapImage_t *img,
+                      const BMtoBMP_Options_t *opts)
+{
+  FILE *output = fopen (img->filename, "wb");
+  if (output == NULL)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] fopen error: could not create file, %s.\n",
+               img->filename);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      return -1;
+    }
+
+  const size_t row_len = (size_t)img->width * BMtoBMP_BYTES_PER_PIXEL;
+  const uint32_t pad = (4 - row_len % 4) % 4;
+  int8_t status = -1;
+  uint32_t crc = 0;
+  uint32_t *const crc_ptr
+      = (opts != NULL && opts->checksum != NULL) ? &crc : NULL;
+
+  /* Make sure we're at the beginning of the file. */
+  fseek (output, 0x0, SEEK_SET);
+
+  /* The header carries the padded sizes, so it never needs patching. */
+  if (write_bmp_header (output, BMtoBMP_FORMAT_24BPP, img->width,
+                        (int32_t)img->height, crc_ptr)
+      != 0)
+    {
+      goto clean_up;
+    }
+
+  /* Output image data to file. */
+#ifdef BMtoBMP_POSIX
+  if (fflush (output) != 0)
+    goto clean_up;
+  status = write_rows_gathered (fileno (output), img->data, img->height,
+                                row_len, pad, opts, crc_ptr);
+  if (status != 0)
+    goto clean_up;
+#else
+  for (uint32_t i = 0; i < img->height; i++)
+    {
+      if (i % interrupt_interval (img->width) == 0)
+        {
+          status = check_interrupt (opts);
+          if (status != 0)
+            goto clean_up;
+          status = -1;
+        }
+      if (write_string_to_file (output, (const char *)img->data[i], row_len)
+              != 0
+          || write_string_to_file (output, (const char *)BMtoBMP_zero_pad,
+                                   pad)
+                 != 0)
+        {
+          goto clean_up;
+        }
+      if (crc_ptr != NULL)
+        {
+          crc = BMtoBMP_crc32c (crc, img->data[i], row_len);
+          crc = BMtoBMP_crc32c (crc, BMtoBMP_zero_pad, pad);
+        }
+    }
+#endif /* BMtoBMP_POSIX */
+
+  if (fclose (output) != 0)
+    return -1;
+  if (crc_ptr != NULL)
+    *opts->checksum = crc;
+  return 0;
+clean_up:
+  fclose (output);
+  /* Don't leave a truncated BMP behind once interrupted. */
+  if (status != -1)
+    remove (img->filename);
+  return status;
+}
+
+/* Max bytes to copy between `check_interrupt()` calls for conversions that
+ * can be interrupted. */
+#define BMtoBMP_INTERRUPTIBLE_COPY_MAX_BYTES ((size_t)4 << 20)
+
+#if defined(__linux__)
+/**
+ *  copy_pixels_in_kernel - copies bytes from `in_fd` to the current offset of
+ *  `out_fd` without moving them through user space, using
+ *  `copy_file_range(2)` and falling back to `sendfile(2)` where the former is
+ *  unsupported (e.g., across filesystems on older kernels).
+ *
+ *  @param  out_fd  file descriptor of the output file.
+ *  @param  in_fd file descriptor of the input file.
+ *  @param  in_offset offset in `in_fd` to start copying from.
+ *  @param  len number of bytes to copy.
+ *  @return the number of bytes copied, which is less than `len` if the
+ *  kernel could not copy the rest.
+ */
+static size_t
+copy_pixels_in_kernel (int out_fd, int in_fd, off_t in_offset, size_t len)
+{
+  size_t copied = 0;
+  int8_t use_sendfile = 0;
+  while (copied < len)
+    {
+      ssize_t n = -1;
+      if (!use_sendfile)
+        {
+          n = copy_file_range (in_fd, &in_offset, out_fd, NULL, len - copied,
+                               0);
+          if (n < 0
+              && (errno == ENOSYS || errno == EXDEV || errno == EINVAL
+                  || errno == EOPNOTSUPP))
+            {
+              use_sendfile = 1;
+              continue;
+            }
+        }
+      else
+        {
+          n = sendfile (out_fd, in_fd, &in_offset, len - copied);
+        }
+
+      if (n <= 0)
+        break;
+      copied += (size_t)n;
+    }
+
+  return copied;
+}
+#endif /* __linux__ */
+
+/**
+ *  copy_bytes_between_files - copies `len` bytes from the current position
+ *  of `src` to the current position of `dst` through a small stack buffer.
+ *
+ *  @param  dst file ptr (`FILE *`) to write to.
+ *  @param  src file ptr (`FILE *`) to read from.
+ *  @param  len number of bytes to copy.
+ *  @param  crc if not NULL, a CRC-32C to extend with the copied bytes.
+ *  @return zero on success, non-zero on failure.
+ */
+static int8_t
+copy_bytes_between_files (FILE *dst, FILE *src, size_t len, uint32_t *crc)
+{
+  uint8_t buffer[4096];
+  while (len > 0)
+    {
+      const size_t chunk = len < sizeof (buffer) ? len : sizeof (buffer);
+      if (fread (buffer, sizeof (uint8_t), chunk, src) != chunk)
+        {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+          fprintf (stderr,
+                   "[BMtoBMP] fread error: error reading data from BM file.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+          return -1;
+        }
+      if (write_string_to_file (dst, (const char *)buffer, chunk) != 0)
+        return -1;
+      if (crc != NULL)
+        *crc = BMtoBMP_crc32c (*crc, buffer, chunk);
+      len -= chunk;
+    }
+
+  return 0;
+}
+
+/**
+ *  encode_color_table - encodes `pal` as a BMP color table, whose entries are
+ *  the palette's colors as LE BGR0.
+ *
+ *  @param  dst where the `BMtoBMP_PALETTE_NUM_COLORS * 4` bytes should be
+ *  stored.
+ *  @param  pal some loaded `BMtoBMP_Palette_t`.
+ */
+static void
+encode_color_table (uint8_t *dst, const BMtoBMP_Palette_t *pal)
+{
+  for (uint32_t i = 0; i < BMtoBMP_PALETTE_NUM_COLORS; i++)
+    {
+      store_le32 (dst + i * 4, pal->bgr[i]);
+    }
+}
+
+/**
+ *  output_indexed_image_to_file - writes a top-down 8-bit indexed bitmap to
+ *  the file specified by `img`'s `filename` data field. The PAL file becomes
+ *  the bitmap's color table and the BM file's indices its pixel array, so no
+ *  palette lookups are performed at all.
+ *
+ *  When no row padding is needed, the pixel array is a byte-identical copy of
+ *  the BM file from `BMtoBMP_BM_PIXEL_DATA_OFFSET` onwards, and on Linux it
+ *  is copied by the kernel, unless a checksum was asked for. Conversions
+ *  that can be interrupted copy it in chunks, checking for interrupts in
+ *  between.
+ *
+ *  @param  bm_file  file ptr (`FILE *`) to some open bm_file.
+ *  @param  pal_file  file ptr (`FILE *`) to some open pal_file.
+ *  @param  img the `BMtoBMP_BitmapImage_t` to be written; `data` is unused.
+ *  @param  opts  conversion options, or NULL for the defaults.
+ *  @return zero on success, non-zero on failure; see `check_interrupt()`.
+ */
+static int8_t
+output_indexed_image_to_file (FILE *bm_file, FILE *pal_file,
+                              BMtoBMP_BitmapImage_t *img,
+                              const BMtoBMP_Options_t *opts)
+{
+  BMtoBMP_Palette_t pal;
+  if (load_palette (pal_file, &pal) != 0)
+    return -1;
+  uint8_t color_table[BMtoBMP_PALETTE_NUM_COLORS * 4];
+  encode_color_table (color_table, &pal);
+
+  FILE *output = fopen (img->filename, "wb");
+  if (output == NULL)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] fopen error: could not create file, %s.\n",
+               img->filename);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      return -1;
+    }
+
+  uint32_t crc = 0;
+  uint32_t *const crc_ptr
+      = (opts != NULL && opts->checksum != NULL) ? &crc : NULL;
+  if (write_bmp_header (output, BMtoBMP_FORMAT_8BPP_INDEXED, img->width,
+                        -(int32_t)img->height, crc_ptr)
+          != 0
+      || write_string_to_file (output, (const char *)color_table,
+                               sizeof (color_table))
+             != 0)
+    {
+      fclose (output);
+      return -1;
+    }
+  if (crc_ptr != NULL)
+    crc = BMtoBMP_crc32c (crc, color_table, sizeof (color_table));
+
+  const uint32_t pad = (4 - img->width % 4) % 4;
+  const size_t pixel_data_len = (size_t)img->width * img->height;
+  fseek (bm_file, BMtoBMP_BM_PIXEL_DATA_OFFSET, SEEK_SET);
+  if (pad == 0)
+    {
+      const size_t max_chunk
+          = (opts != NULL && (opts->cancel != NULL || opts->deadline_ns != 0))
+                ? BMtoBMP_INTERRUPTIBLE_COPY_MAX_BYTES
+                : pixel_data_len;
+#if defined(__linux__)
+      /* Bytes the kernel copies never pass through here to be checksummed. */
+      int8_t in_kernel = crc_ptr == NULL && fflush (output) == 0;
+#endif /* __linux__ */
+      for (size_t done = 0; done < pixel_data_len;)
+        {
+          const int8_t interrupted = check_interrupt (opts);
+          if (interrupted != 0)
+            {
+              fclose (output);
+              remove (img->filename);
+              return interrupted;
+            }
+
+          const size_t chunk = pixel_data_len - done < max_chunk
+                                   ? pixel_data_len - done
+                                   : max_chunk;
+          size_t copied = 0;
+#if defined(__linux__)
+          if (in_kernel)
+            {
+              copied = copy_pixels_in_kernel (
+                  fileno (output), fileno (bm_file),
+                  BMtoBMP_BM_PIXEL_DATA_OFFSET + (off_t)done, chunk);
+              /* Copy whatever the kernel didn't through user space. */
+              if (copied < chunk)
+                {
+                  in_kernel = 0;
+                  fseek (output,
+                         (long)(BMtoBMP_BMP_HEADER_SIZE + sizeof (color_table)
+                                + done + copied),
+                         SEEK_SET);
+                  fseek (bm_file,
+                         BMtoBMP_BM_PIXEL_DATA_OFFSET + (long)(done + copied),
+                         SEEK_SET);
+                }
+            }
+#endif /* __linux__ */
+          if (copied < chunk
+              && copy_bytes_between_files (output, bm_file, chunk - copied,
+                                           crc_ptr)
+                     != 0)
+            {
+              fclose (output);
+              return -1;
+            }
+          done += chunk;
+        }
+    }
+  else
+    {
+      const uint8_t zeros[3] = { 0 };
+      const uint32_t interval = interrupt_interval (img->width);
+      for (uint32_t i = 0; i < img->height; i++)
+        {
+          const int8_t interrupted
+              = i % interval == 0 ? check_interrupt (opts) : 0;
+          if (interrupted != 0)
+            {
+              fclose (output);
+              remove (img->filename);
+              return interrupted;
+            }
+          if (copy_bytes_between_files (output, bm_file, img->width, crc_ptr)
+                  != 0
+              || write_string_to_file (output, (const char *)zeros, pad) != 0)
+            {
+              fclose (output);
+              return -1;
+            }
+          if (crc_ptr != NULL)
+            crc = BMtoBMP_crc32c (crc, zeros, pad);
+        }
+    }
+
+  if (fclose (output) != 0)
+    return -1;
+  if (crc_ptr != NULL)
+    *opts->checksum = crc;
+  return 0;
+}
+
+/**
+ *  BMtoBMP_ImageKernel_t - expands a whole image of palette indices into a
+ *  BMP pixel array, including row padding, in file row order.
+ *
+ *  @param  pixel_array where the pixel array should be stored.
+ *  @param  indices `width * height` palette indices, top row first.
+ *  @param  width image width in pixels, before scaling.
+ *  @param  height  image height in pixels, before scaling.
+ *  @param  pal palette to look the indices up in.
+ */
+typedef void (*BMtoBMP_ImageKernel_t) (uint8_t *pixel_array,
+                                       const uint8_t *indices, uint32_t width,
+                                       uint32_t height,
+                                       const BMtoBMP_Palette_t *pal);
+
+/**
+ *  BMtoBMP_DEFINE_IMAGE_KERNEL - defines a `BMtoBMP_ImageKernel_t`
+ *  specialized for one output layout. Every parameter is a compile-time
+ *  constant, so the inner loop has no branches and the fixed-size pixel
+ *  writes unroll completely.
+ *
+ *  @param  NAME  function name.
+ *  @param  BPP output bits per pixel, 24 or 32.
+ *  @param  TOP_DOWN  non-zero to store rows top-down.
+ *  @param  SCALE nearest-neighbor upscaling factor.
+ *  @param  PADDED  non-zero if rows need padding to 4 bytes.
+ */
+/* clang-format off */
+#define BMtoBMP_DEFINE_IMAGE_KERNEL(NAME, BPP, TOP_DOWN, SCALE, PADDED)      \
+  static void                                                                \
+  NAME (uint8_t *pixel_array, const uint8_t *indices, uint32_t width,        \
+        uint32_t height, const BMtoBMP_Palette_t *pal)                       \
+  {                                                                          \
+    const size_t row_len = (size_t)width * (SCALE) * ((BPP) / 8);            \
+    const size_t stride = (PADDED) ? ((row_len + 3) & ~(size_t)3) : row_len; \
+    for (uint32_t y = 0; y < height; y++)                                    \
+      {                                                                      \
+        const uint32_t block = (TOP_DOWN) ? y : height - 1 - y;              \
+        uint8_t *row = pixel_array + (size_t)block * (SCALE) * stride;       \
+        uint8_t *dst = row;                                                  \
+        const uint8_t *src = indices + (size_t)y * width;                    \
+        for (uint32_t x = 0; x < width; x++)                                 \
+          {                                                                  \
+            const uint32_t color = pal->bgr[src[x]];                         \
+            for (uint32_t s = 0; s < (SCALE); s++, dst += (BPP) / 8)         \
+              {                                                              \
+                dst[0] = (uint8_t)color;                                     \
+                dst[1] = (uint8_t)(color >> 8);                              \
+                dst[2] = (uint8_t)(color >> 16);                             \
+                if ((BPP) == 32)                                             \
+                  dst[3] = 0;                                                \
+              }                                                              \
+          }                                                                  \
+        if (PADDED)                                                          \
+          memset (dst, 0, stride - row_len);                                 \
+        for (uint32_t s = 1; s < (SCALE); s++)                               \
+          memcpy (row + s * stride, row, stride);                            \
+      }                                                                      \
+  }
+
+/* 32-bit rows and 4x 24-bit rows are always 4-byte aligned. */
+BMtoBMP_DEFINE_IMAGE_KERNEL (expand_image_24_bu_x1, 24, 0, 1, 0)
+BMtoBMP_DEFINE_IMAGE_KERNEL (expand_image_24_bu_x1_pad, 24, 0, 1, 1)
+BMtoBMP_DEFINE_IMAGE_KERNEL (expand_image_24_bu_x2, 24, 0, 2, 0)
+BMtoBMP_DEFINE_IMAGE_KERNEL (expand_image_24_bu_x2_pad, 24, 0, 2, 1)
+BMtoBMP_DEFINE_IMAGE_KERNEL (expand_image_24_bu_x4, 24, 0, 4, 0)
+BMtoBMP_DEFINE_IMAGE_KERNEL (expand_image_24_td_x1, 24, 1, 1, 0)
+BMtoBMP_DEFINE_IMAGE_KERNEL (expand_image_24_td_x1_pad, 24, 1, 1, 1)
+BMtoBMP_DEFINE_IMAGE_KERNEL (expand_image_24_td_x2, 24, 1, 2, 0)
+BMtoBMP_DEFINE_IMAGE_KERNEL (expand_image_24_td_x2_pad, 24, 1, 2, 1)
+BMtoBMP_DEFINE_IMAGE_KERNEL (expand_image_24_td_x4, 24, 1, 4, 0)
+BMtoBMP_DEFINE_IMAGE_KERNEL (expand_image_32_bu_x1, 32, 0, 1, 0)
+BMtoBMP_DEFINE_IMAGE_KERNEL (expand_image_32_bu_x2, 32, 0, 2, 0)
+BMtoBMP_DEFINE_IMAGE_KERNEL (expand_image_32_bu_x4, 32, 0, 4, 0)
+BMtoBMP_DEFINE_IMAGE_KERNEL (expand_image_32_td_x1, 32, 1, 1, 0)
+BMtoBMP_DEFINE_IMAGE_KERNEL (expand_image_32_td_x2, 32, 1, 2, 0)
+BMtoBMP_DEFINE_IMAGE_KERNEL (expand_image_32_td_x4, 32, 1, 4, 0)
+
+/* Indexed by [32-bit][top-down][log2 (scale)][padded]. */
+static const BMtoBMP_ImageKernel_t BMtoBMP_image_kernels[2][2][3][2] = {
+  { { { expand_image_24_bu_x1, expand_image_24_bu_x1_pad },
+      { expand_image_24_bu_x2, expand_image_24_bu_x2_pad },
+      { expand_image_24_bu_x4, NULL } },
+    { { expand_image_24_td_x1, expand_image_24_td_x1_pad },
+      { expand_image_24_td_x2, expand_image_24_td_x2_pad },
+      { expand_image_24_td_x4, NULL } } },
+  { { { expand_image_32_bu_x1, NULL },
+      { expand_image_32_bu_x2, NULL },
+      { expand_image_32_bu_x4, NULL } },
+    { { expand_image_32_td_x1, NULL },
+      { expand_image_32_td_x2, NULL },
+      { expand_image_32_td_x4, NULL } } },
+};
+/* clang-format on */
+
+/**
+ *  output_bpp - returns the bits per pixel of `opts`'s output format.
+ *
+ *  @param  opts  conversion options, or NULL for the defaults.
+ *  @return 8, 24 or 32.
+ */
+static uint16_t
+output_bpp (const BMtoBMP_Options_t *opts)
+{
+  if (opts == NULL || opts->format == BMtoBMP_FORMAT_24BPP)
+    return 24;
+  return opts->format == BMtoBMP_FORMAT_32BPP ? 32 : 8;
+}
+
+/**
+ *  output_scale - returns `opts`'s upscaling factor.
+ *
+ *  @param  opts  conversion options, or NULL for the defaults.
+ *  @return 1, 2 or 4, or 0 if the factor is unsupported.
+ */
+static uint32_t
+output_scale (const BMtoBMP_Options_t *opts)
+{
+  if (opts == NULL || opts->scale <= 1)
+    return 1;
+  if ((opts->scale == 2 || opts->scale == 4)
+      && opts->format != BMtoBMP_FORMAT_8BPP_INDEXED)
+    {
+      return opts->scale;
+    }
+
+#ifdef BMtoBMP_DEBUG_OUTPUT
+  fprintf (stderr, "[BMtoBMP] unsupported scale factor, %d.\n", opts->scale);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+  return 0;
+}
+
+/**
+ *  get_image_kernel - returns the specialized `BMtoBMP_ImageKernel_t` for an
+ *  output layout.
+ *
+ *  @param  bpp output bits per pixel, 24 or 32.
+ *  @param  top_down  non-zero if rows are stored top-down.
+ *  @param  scale upscaling factor, 1, 2 or 4.
+ *  @param  width image width in pixels, before scaling.
+ *  @return the kernel.
+ */
+static BMtoBMP_ImageKernel_t
+get_image_kernel (uint16_t bpp, uint8_t top_down, uint32_t scale,
+                  uint32_t width)
+{
+  const size_t row_len = (size_t)width * scale * (bpp / 8);
+  return BMtoBMP_image_kernels[bpp == 32][top_down != 0][scale / 2]
+                              [row_len % 4 != 0];
+}
+
+/**
+ *  process_image - reads in palette indexes from `bm_file` and converts them
+ *  to rgb values, storing the output in `img`'s `data` data field.
+ *
+ *  @param  bm_file  file ptr (`FILE *`)to some open bm_file.
+ *  @param  pal_file  file ptr (`FILE *`) to some open pal_file.
+ *  @param  img some `BMtoBMP_BitmapImage_t` for writing the data into.
+ *  @param  opts  conversion options, or NULL for the defaults.
+ *  @return zero on success, non-zero on failure; see `check_interrupt()`.
+ */
+static int8_t
+process_image (FILE *bm_file, FILE *pal_file, BMtoBMP_BitmapImage_t *img,
+               const BMtoBMP_Options_t *opts)
+{
+  BMtoBMP_Palette_t pal;
+  if (load_palette (pal_file, &pal) != 0)
+    return -1;
+
+  /* One spare byte keeps zero-width images from failing to allocate. */
+  uint8_t *indices = (uint8_t *)malloc ((size_t)img->width + 1);
+  if (indices == NULL)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] malloc error: unable to allocate row "
+                       "buffer.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      return -1;
+    }
+
+  const BMtoBMP_Kernel_t kernel = prepare_kernel (
+      opts != NULL ? opts->kernel : BMtoBMP_KERNEL_AUTO, img->width,
+      img->height, &pal);
+  const BMtoBMP_RowKernel_t expand_row = get_row_kernel (kernel);
+  const uint32_t interval = interrupt_interval (img->width);
+
+  fseek (bm_file, BMtoBMP_BM_PIXEL_DATA_OFFSET, SEEK_SET);
+
+  BMtoBMP_PROBE3 (expand_start, img->width, img->height,
+                  (size_t)img->width * img->height * BMtoBMP_BYTES_PER_PIXEL);
+  /* BM rows are top-down, while BMP rows are bottom-up. */
+  int8_t result = 0;
+  for (int32_t i = img->height - 1; i >= 0; i--)
+    {
+      if ((img->height - 1 - i) % interval == 0)
+        {
+          result = check_interrupt (opts);
+          if (result != 0)
+            break;
+        }
+
+      if (fread (indices, sizeof (uint8_t), img->width, bm_file)
+          != img->width)
+        {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+          fprintf (stderr,
+                   "[BMtoBMP] fread error: error reading data from BM file.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+          result = -1;
+          break;
+        }
+
+      if (indices_in_palette (indices, img->width, &pal) != 0)
+        {
+          result = -1;
+          break;
+        }
+
+      expand_row (img->data[i], indices, img->width, &pal);
+    }
+
+  finish_kernel (kernel);
+  BMtoBMP_PROBE3 (expand_done, img->width, img->height, result);
+  release_palette (&pal);
+  free (indices);
+  return result;
+}
+
+/**
+ *  allocate_img_data - allocs memory for a `BMtoBMP_BitmapImage_t`'s `data`
+ *  field.
+ *
+ *  @param  img some `BMtoBMP_BitmapImage_t`.
+ *  @return zero on success, non-zero on failure.
+ */
+static void
+allocate_img_data (BMtoBMP_BitmapImage_t *img)
+{
+  const size_t row_len = (size_t)img->width * BMtoBMP_BYTES_PER_PIXEL;
+  BMtoBMP_PROBE3 (alloc_start, img->width, img->height,
+                  img->height * (row_len + sizeof (uint8_t *)));
+  img->data = (uint8_t **)calloc (img->height, sizeof (uint8_t *));
+  /* One spare byte keeps zero-width images from failing to allocate. */
+  uint8_t *pixels
+      = (img->height > 0)
+            ? (uint8_t *)calloc ((size_t)img->height * row_len + 1,
+                                 sizeof (uint8_t))
+            : NULL;
+  if (img->data == NULL || (img->height > 0 && pixels == NULL))
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr,
+               "[BMtoBMP] calloc error: unable to allocate image buffer of "
+               "size, %dx%dx%d.\n",
+               img->height, img->width, BMtoBMP_BYTES_PER_PIXEL * 8);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      free (pixels);
+      free (img->data);
+      img->data = NULL;
+      BMtoBMP_PROBE3 (alloc_done, img->width, img->height, -1);
+      return;
+    }
+
+  /* Rows are contiguous so that they can be written out in large runs.
+   * `data[0]` owns them, which `-fanalyzer` only sees outside the loop. */
+  if (img->height > 0)
+    img->data[0] = pixels;
+  for (uint32_t i = 1; i < img->height; i++)
+    {
+      img->data[i] = pixels + (size_t)i * row_len;
+    }
+  BMtoBMP_PROBE3 (alloc_done, img->width, img->height, 0);
+}
+
+/**
+ *  read_image_dimensions - reads the image width and height from the start of
+ *  `bm_file` into `img`.
+ *
+ *  @param  bm_file  file ptr (`FILE *`)to some open bm_file.
+ *  @param  img some uninitialized `BMtoBMP_BitmapImage_t`.
+ *  @return zero on success, non-zero on failure.
+ */
+static int8_t
+read_image_dimensions (FILE *bm_file, BMtoBMP_BitmapImage_t *img)
+{
+  img->data = NULL;
+  img->width = 0;
+  img->height = 0;
+  BMtoBMP_PROBE1 (parse_start, 0);
+  fseek (bm_file, 0x0, SEEK_SET);
+  if (read_uint32_from_file (bm_file, &img->width) != 0
+      || read_uint32_from_file (bm_file, &img->height) != 0)
+    {
+      BMtoBMP_PROBE3 (parse_done, img->width, img->height, -1);
+      return -1;
+    }
+
+  BMtoBMP_PROBE3 (parse_done, img->width, img->height, 0);
+  return 0;
+}
+
+/**
+ *  create_image - uses image height and width data to create and init a
+ *  `BMtoBMP_BitmapImage_t`.
+ *
+ *  @param  bm_file  file ptr (`FILE *`)to some open bm_file.
+ *  @param  img some uninitialized `BMtoBMP_BitmapImage_t`.
+ *  @return zero on success, non-zero on failure.
+ */
+static int8_t
+create_image (FILE *bm_file, BMtoBMP_BitmapImage_t *img)
+{
+  if (read_image_dimensions (bm_file, img) != 0)
+    return -1;
+
+  allocate_img_data (img);
+  if (img->data == NULL)
+    return -1;
+
+  return 0;
+}
+
+/**
+ *  BMtoBMP_parse_bm - reads the dimensions of in-memory BM file data and
+ *  checks that it holds every pixel.
+ *
+ *  @param  bm  BM file data.
+ *  @param  bm_len  length of `bm` in bytes.
+ *  @param  width the image width in pixels (output).
+ *  @param  height  the image height in pixels (output).
+ *  @return zero on success, non-zero on failure.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_parse_bm (const uint8_t *bm, size_t bm_len, uint32_t *width,
+                  uint32_t *height)
+{
+  BMtoBMP_PROBE1 (parse_start, bm_len);
+  if (bm_len < BMtoBMP_BM_PIXEL_DATA_OFFSET)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] BM error: data is too short for a BM "
+                       "header.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      BMtoBMP_PROBE3 (parse_done, 0, 0, -1);
+      return -1;
+    }
+
+  *width = load_le32 (bm);
+  *height = load_le32 (bm + 4);
+  if ((uint64_t)*width * *height > bm_len - BMtoBMP_BM_PIXEL_DATA_OFFSET)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] BM error: pixel data is truncated.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      BMtoBMP_PROBE3 (parse_done, *width, *height, -1);
+      return -1;
+    }
+
+  BMtoBMP_PROBE3 (parse_done, *width, *height, 0);
+  return 0;
+}
+
+/**
+ *  BMtoBMP_has_bm_extension - checks whether a filename ends in `.BM` or
+ *  `.bm`.
+ *
+ *  @param  filename  sz of the filename.
+ *  @return non-zero if it does, zero otherwise.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_has_bm_extension (const char *filename)
+{
+  const size_t len = strlen (filename);
+  return len > 3
+         && (strcmp (filename + (len - 3), ".BM") == 0
+             || strcmp (filename + (len - 3), ".bm") == 0);
+}
+
+/**
+ *  BMtoBMP_expand_indices - expands rows of palette indices into BGR pixels.
+ *  The caller's palette is left untouched; tables a kernel needs are built
+ *  for the call unless `pal` already has them.
+ *
+ *  @param  indices `width * height` palette indices, top row first.
+ *  @param  width image width in pixels.
+ *  @param  height  image height in pixels.
+ *  @param  pal some loaded `BMtoBMP_Palette_t`.
+ *  @param  first_row where the first row of pixels should be stored.
+ *  @param  stride  distance in bytes from each row to the next, negative to
+ *  store the rows bottom-up.
+ *  @param  kernel  the `BMtoBMP_Kernel_t` to expand rows with.
+ *  @return zero on success, non-zero on failure.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_expand_indices (const uint8_t *indices, uint32_t width,
+                        uint32_t height, const BMtoBMP_Palette_t *pal,
+                        uint8_t *first_row, ptrdiff_t stride,
+                        BMtoBMP_Kernel_t kernel)
+{
+  BMtoBMP_Palette_t prepared = *pal;
+  kernel = prepare_kernel (kernel, width, height, &prepared);
+  const BMtoBMP_RowKernel_t expand_row = get_row_kernel (kernel);
+
+  int8_t result = 0;
+  uint8_t *row = first_row;
+  for (uint32_t i = 0; i < height; i++, row += stride)
+    {
+      const uint8_t *row_indices = indices + (size_t)i * width;
+      if (indices_in_palette (row_indices, width, &prepared) != 0)
+        {
+          result = -1;
+          break;
+        }
+      expand_row (row, row_indices, width, &prepared);
+    }
+
+  finish_kernel (kernel);
+  if (prepared.pairs != pal->pairs)
+    release_palette (&prepared);
+  return result;
+}
+
+/**
+ *  BMtoBMP_bmp_size - returns the size of the BMP file that
+ *  `BMtoBMP_encode_bmp()` produces for an image.
+ *
+ *  @param  width image width in pixels.
+ *  @param  height  image height in pixels.
+ *  @param  opts  conversion options, or NULL for the defaults.
+ *  @return the size in bytes, zero if `opts` are unsupported.
+ */
+BMtoBMP_API size_t
+BMtoBMP_bmp_size (uint32_t width, uint32_t height,
+                  const BMtoBMP_Options_t *opts)
+{
+  const uint16_t bpp = output_bpp (opts);
+  const uint32_t scale = output_scale (opts);
+  if (scale == 0)
+    return 0;
+
+  const size_t row_len = (size_t)width * scale * (bpp / 8);
+  const size_t header_len = BMtoBMP_BMP_HEADER_SIZE
+                            + (bpp == 8 ? BMtoBMP_PALETTE_NUM_COLORS * 4 : 0);
+  return header_len + ((row_len + 3) & ~(size_t)3) * height * scale;
+}
+
+/**
+ *  encode_bmp_prefix - encodes everything in a BMP file that precedes the
+ *  pixel array, i.e., the headers and, for indexed output, the color table.
+ *
+ *  @param  dst where the prefix should be stored.
+ *  @param  width image width in pixels, before scaling.
+ *  @param  height  image height in pixels, before scaling.
+ *  @param  pal some loaded `BMtoBMP_Palette_t`.
+ *  @param  opts  conversion options, or NULL for the defaults; the scale
+ *  factor must be supported.
+ *  @return the length of the prefix in bytes.
+ */
+static size_t
+encode_bmp_prefix (uint8_t *dst, uint32_t width, uint32_t height,
+                   const BMtoBMP_Palette_t *pal, const BMtoBMP_Options_t *opts)
+{
+  if (output_bpp (opts) == 8)
+    {
+      encode_bmp_header (dst, BMtoBMP_FORMAT_8BPP_INDEXED, width,
+                         -(int32_t)height);
+      encode_color_table (dst + BMtoBMP_BMP_HEADER_SIZE, pal);
+      return BMtoBMP_BMP_HEADER_SIZE + BMtoBMP_PALETTE_NUM_COLORS * 4;
+    }
+
+  const uint32_t scale = output_scale (opts);
+  const int32_t sign = (opts != NULL && opts->top_down) ? -1 : 1;
+  encode_bmp_header (dst, opts != NULL ? opts->format : BMtoBMP_FORMAT_24BPP,
+                     width * scale, sign * (int32_t)(height * scale));
+  return BMtoBMP_BMP_HEADER_SIZE;
+}
+
+/**
+ *  encode_pixel_rows - encodes a band of consecutive image rows into the
+ *  part of a BMP pixel array that holds them. For bottom-up output, the
+ *  band's last row comes first.
+ *
+ *  @param  pixels  where the band's pixel rows should be stored.
+ *  @param  indices `width * num_rows` palette indices, top row first.
+ *  @param  width image width in pixels, before scaling.
+ *  @param  num_rows  number of rows in the band, before scaling.
+ *  @param  pal some loaded `BMtoBMP_Palette_t`.
+ *  @param  opts  conversion options, or NULL for the defaults; the scale
+ *  factor must be supported.
+ *  @return zero on success, non-zero on failure.
+ */
+static int8_t
+encode_pixel_rows (uint8_t *pixels, const uint8_t *indices, uint32_t width,
+                   uint32_t num_rows, const BMtoBMP_Palette_t *pal,
+                   const BMtoBMP_Options_t *opts)
+{
+  const uint16_t bpp = output_bpp (opts);
+  if (bpp == 8)
+    {
+      const size_t stride = (width + 3) & ~3u;
+      for (uint32_t i = 0; i < num_rows; i++, pixels += stride)
+        {
+          memcpy (pixels, indices + (size_t)i * width, width);
+          memset (pixels + width, 0, stride - width);
+        }
+      return 0;
+    }
+
+  for (uint32_t i = 0; i < num_rows; i++)
+    {
+      if (indices_in_palette (indices + (size_t)i * width, width, pal) != 0)
+        return -1;
+    }
+
+  const uint8_t top_down = opts != NULL && opts->top_down;
+  const uint32_t scale = output_scale (opts);
+  const BMtoBMP_Kernel_t kernel
+      = opts != NULL ? opts->kernel : BMtoBMP_KERNEL_AUTO;
+
+  /* Unscaled 24-bit rows can go through the SIMD row kernels. */
+  if (bpp == 24 && scale == 1 && num_rows > 0
+      && select_kernel (kernel, width, num_rows) != BMtoBMP_KERNEL_SCALAR)
+    {
+      const size_t row_len = (size_t)width * BMtoBMP_BYTES_PER_PIXEL;
+      const size_t stride = (row_len + 3) & ~(size_t)3;
+      for (uint32_t i = 0; i < num_rows; i++)
+        {
+          memset (pixels + i * stride + row_len, 0, stride - row_len);
+        }
+      return BMtoBMP_expand_indices (
+          indices, width, num_rows, pal,
+          top_down ? pixels : pixels + (num_rows - 1) * stride,
+          top_down ? (ptrdiff_t)stride : -(ptrdiff_t)stride, kernel);
+    }
+
+  get_image_kernel (bpp, top_down, scale, width) (pixels, indices, width,
+                                                  num_rows, pal);
+  return 0;
+}
+
+/**
+ *  BMtoBMP_encode_bmp - converts in-memory BM file data to a BMP file in
+ *  memory, expanding pixels straight into `out` without staging buffers.
+ *
+ *  @param  bm  BM file data.
+ *  @param  bm_len  length of `bm` in bytes.
+ *  @param  pal some loaded `BMtoBMP_Palette_t`.
+ *  @param  out where the BMP file should be stored.
+ *  @param  out_len length of `out`, at least `BMtoBMP_bmp_size()` bytes.
+ *  @param  opts  conversion options, or NULL for the defaults.
+ *  @return zero on success, non-zero on failure; `BMtoBMP_CANCELLED` or
+ *  `BMtoBMP_DEADLINE_EXCEEDED` if interrupted.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_encode_bmp (const uint8_t *bm, size_t bm_len,
+                    const BMtoBMP_Palette_t *pal, uint8_t *out,
+                    size_t out_len, const BMtoBMP_Options_t *opts)
+{
+  uint32_t width;
+  uint32_t height;
+  if (BMtoBMP_parse_bm (bm, bm_len, &width, &height) != 0)
+    return -1;
+  const size_t size = BMtoBMP_bmp_size (width, height, opts);
+  if (size == 0)
+    return -1;
+  if (out_len < size)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] output buffer is too small.\n");
 #endif /* BMtoBMP_DEBUG_OUTPUT */
       return -1;
     }
 
-  BMtoBMP_BitmapImage_t img;
-  if (create_image (bm_file, &img) != 0)
+  const size_t prefix_len = encode_bmp_prefix (out, width, height, pal, opts);
+  const uint8_t want_crc = opts != NULL && opts->checksum != NULL;
+  uint32_t crc = want_crc ? BMtoBMP_crc32c (0, out, prefix_len) : 0;
+  if (height == 0)
+    {
+      if (want_crc)
+        *opts->checksum = crc;
+      return 0;
+    }
+  BMtoBMP_PROBE3 (expand_start, width, height, size - prefix_len);
+
+  /* Convert in bands so interrupts are noticed, picking the kernel and
+   * building its tables once for the whole image. */
+  BMtoBMP_Options_t band_opts;
+  memset (&band_opts, 0, sizeof (band_opts));
+  if (opts != NULL)
+    band_opts = *opts;
+  BMtoBMP_Palette_t band_pal = *pal;
+  if (output_bpp (opts) != 8)
+    band_opts.kernel
+        = prepare_kernel (band_opts.kernel, width, height, &band_pal);
+
+  const uint8_t bottom_up = output_bpp (opts) != 8 && !band_opts.top_down;
+  const size_t out_row_len = (size - prefix_len) / height;
+  const uint32_t interval = interrupt_interval (width);
+  int8_t status = 0;
+  for (uint32_t y = 0; y < height && status == 0; y += interval)
+    {
+      const uint32_t n = height - y < interval ? height - y : interval;
+      const size_t first_row = bottom_up ? height - y - n : y;
+      uint8_t *const band = out + prefix_len + first_row * out_row_len;
+      status = check_interrupt (opts);
+      if (status == 0)
+        status = encode_pixel_rows (
+            band, bm + BMtoBMP_BM_PIXEL_DATA_OFFSET + (size_t)y * width,
+            width, n, &band_pal, &band_opts);
+      if (status == 0 && want_crc && !bottom_up)
+        crc = BMtoBMP_crc32c (crc, band, n * out_row_len);
+    }
+
+  if (band_pal.pairs != pal->pairs)
+    release_palette (&band_pal);
+  /* Bottom-up bands are encoded back to front, so they can only be
+   * checksummed once all of them are in place. */
+  if (status == 0 && want_crc)
+    {
+      if (bottom_up)
+        crc = BMtoBMP_crc32c (crc, out + prefix_len, size - prefix_len);
+      *opts->checksum = crc;
+    }
+  BMtoBMP_PROBE3 (expand_done, width, height, status);
+  return status;
+}
+
+/* Bytes of expected pixel rows that `BMtoBMP_verify_bmp()` holds at a time,
+ * few enough to stay in L2. */
+#define BMtoBMP_VERIFY_BAND_BYTES ((size_t)256 << 10)
+
+/**
+ *  first_difference - finds the first byte at which two buffers differ,
+ *  comparing 64 bytes per step with SSE2 where available.
+ *
+ *  @param  a some buffer.
+ *  @param  b another buffer.
+ *  @param  len length of both buffers in bytes.
+ *  @return the offset of the first differing byte, `len` if there is none.
+ */
+static size_t
+first_difference (const uint8_t *a, const uint8_t *b, size_t len)
+{
+  size_t i = 0;
+#ifdef BMtoBMP_HAVE_STREAM_KERNEL
+  for (; i + 64 <= len; i += 64)
+    {
+      __m128i equal = _mm_set1_epi8 (-1);
+      for (size_t j = 0; j < 64; j += 16)
+        {
+          const __m128i x
+              = _mm_loadu_si128 ((const __m128i *)(const void *)(a + i + j));
+          const __m128i y
+              = _mm_loadu_si128 ((const __m128i *)(const void *)(b + i + j));
+          equal = _mm_and_si128 (equal, _mm_cmpeq_epi8 (x, y));
+        }
+      if (_mm_movemask_epi8 (equal) != 0xFFFF)
+        break;
+    }
+#endif /* BMtoBMP_HAVE_STREAM_KERNEL */
+
+  /* The tail, or the 64 bytes holding the difference. */
+  for (; i < len; i++)
+    {
+      if (a[i] != b[i])
+        return i;
+    }
+  return len;
+}
+
+/**
+ *  BMtoBMP_verify_bmp - checks that `bmp` is exactly the BMP file that
+ *  `BMtoBMP_encode_bmp()` makes of `bm` and `pal`, without writing anything.
+ *  The format, row order and scale factor are taken from `bmp`'s header;
+ *  expected pixels are expanded a band at a time into a buffer that stays in
+ *  cache, so `bmp` and `bm` are each read once.
+ *
+ *  @param  bm  BM file data.
+ *  @param  bm_len  length of `bm` in bytes.
+ *  @param  pal some loaded `BMtoBMP_Palette_t`.
+ *  @param  bmp BMP file data to check.
+ *  @param  bmp_len length of `bmp` in bytes.
+ *  @param  opts  conversion options, or NULL for the defaults; only `kernel`,
+ *  `cancel` and `deadline_ns` are used.
+ *  @param  mismatch  if not NULL, receives the offset of a byte at which
+ *  `bmp` differs (or ends early, or should have ended), or `SIZE_MAX` if
+ *  the expected BMP could not be made.
+ *  @return zero if `bmp` matches, non-zero otherwise; `BMtoBMP_CANCELLED` or
+ *  `BMtoBMP_DEADLINE_EXCEEDED` if interrupted.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_verify_bmp (const uint8_t *bm, size_t bm_len,
+                    const BMtoBMP_Palette_t *pal, const uint8_t *bmp,
+                    size_t bmp_len, const BMtoBMP_Options_t *opts,
+                    size_t *mismatch)
+{
+  size_t where = SIZE_MAX;
+  if (mismatch != NULL)
+    *mismatch = where;
+  uint32_t width;
+  uint32_t height;
+  if (BMtoBMP_parse_bm (bm, bm_len, &width, &height) != 0)
     return -1;
 
-  if (process_image (bm_file, pal_file, &img) != 0)
-    goto clean_up;
+  /* Expect what the header claims, so that anything else in it that is off
+   * shows up as a difference in the prefix. */
+  BMtoBMP_Options_t expected;
+  memset (&expected, 0, sizeof (expected));
+  if (opts != NULL)
+    expected.kernel = opts->kernel;
+  if (bmp_len >= BMtoBMP_BMP_HEADER_SIZE)
+    {
+      const uint8_t bpp = bmp[0x1C];
+      const uint32_t bmp_width = load_le32 (bmp + 0x12);
+      expected.format = bpp == 8    ? BMtoBMP_FORMAT_8BPP_INDEXED
+                        : bpp == 32 ? BMtoBMP_FORMAT_32BPP
+                                    : BMtoBMP_FORMAT_24BPP;
+      expected.top_down = (int32_t)load_le32 (bmp + 0x16) < 0;
+      if (bpp != 8 && width > 0 && bmp_width % width == 0
+          && (bmp_width / width == 2 || bmp_width / width == 4))
+        expected.scale = (uint8_t)(bmp_width / width);
+    }
+
+  uint8_t prefix[BMtoBMP_BMP_HEADER_SIZE + BMtoBMP_PALETTE_NUM_COLORS * 4];
+  const size_t size = BMtoBMP_bmp_size (width, height, &expected);
+  const size_t prefix_len
+      = encode_bmp_prefix (prefix, width, height, pal, &expected);
+  const size_t checked = bmp_len < prefix_len ? bmp_len : prefix_len;
+  const size_t offset = first_difference (bmp, prefix, checked);
+  if (offset < checked || bmp_len != size)
+    {
+      if (mismatch != NULL)
+        *mismatch = offset < checked ? offset
+                                     : (bmp_len < size ? bmp_len : size);
+      return -1;
+    }
+  if (size == prefix_len)
+    return 0;
+
+  /* Picked for a band rather than the whole image, so never a kernel that
+   * streams its output past the cache. */
+  const size_t out_row_len = (size - prefix_len) / height;
+  const uint32_t band_rows
+      = out_row_len < BMtoBMP_VERIFY_BAND_BYTES
+            ? (uint32_t)(BMtoBMP_VERIFY_BAND_BYTES / out_row_len)
+            : 1;
+  BMtoBMP_Palette_t band_pal = *pal;
+  if (output_bpp (&expected) != 8)
+    expected.kernel
+        = prepare_kernel (expected.kernel, width, band_rows, &band_pal);
+  const uint8_t bottom_up = output_bpp (&expected) != 8 && !expected.top_down;
+
+  uint8_t *band = (uint8_t *)malloc ((size_t)band_rows * out_row_len);
+  int8_t status = band != NULL ? 0 : -1;
+  for (uint32_t y = 0; y < height && status == 0; y += band_rows)
+    {
+      const uint32_t n = height - y < band_rows ? height - y : band_rows;
+      const size_t first_row = bottom_up ? height - y - n : y;
+      const size_t band_len = n * out_row_len;
+      status = check_interrupt (opts);
+      if (status == 0)
+        status = encode_pixel_rows (
+            band, bm + BMtoBMP_BM_PIXEL_DATA_OFFSET + (size_t)y * width,
+            width, n, &band_pal, &expected);
+      if (status != 0)
+        break;
+
+      const size_t band_offset = prefix_len + first_row * out_row_len;
+      const size_t diff = first_difference (bmp + band_offset, band, band_len);
+      if (diff < band_len)
+        {
+          where = band_offset + diff;
+          status = -1;
+        }
+    }
+
+  free (band);
+  if (band_pal.pairs != pal->pairs)
+    release_palette (&band_pal);
+  if (mismatch != NULL)
+    *mismatch = where;
+  return status;
+}
+
+/**
+ *  time_kernel - times `kernel` expanding `rows` rows of `width` indices,
+ *  including any per-conversion setup, such as building the pair table.
+ *
+ *  @param  kernel  some available `BMtoBMP_Kernel_t`.
+ *  @param  pal a loaded `BMtoBMP_Palette_t`.
+ *  @param  indices `width * rows` palette indices.
+ *  @param  out output buffer of `width * rows * 3` bytes.
+ *  @param  width row width in pixels.
+ *  @param  rows  number of rows.
+ *  @return the elapsed time in nanoseconds, `UINT64_MAX` on failure.
+ */
+static uint64_t
+time_kernel (BMtoBMP_Kernel_t kernel, BMtoBMP_Palette_t *pal,
+             const uint8_t *indices, uint8_t *out, uint32_t width,
+             uint32_t rows)
+{
+  const BMtoBMP_RowKernel_t expand_row = get_row_kernel (kernel);
+  const size_t row_len = (size_t)width * BMtoBMP_BYTES_PER_PIXEL;
+  const uint64_t start = monotonic_ns ();
+  if (kernel == BMtoBMP_KERNEL_PAIR_LUT && build_pair_table (pal) != 0)
+    return UINT64_MAX;
+
+  for (uint32_t i = 0; i < rows; i++)
+    {
+      expand_row (out + i * row_len, indices + (size_t)i * width, width, pal);
+    }
+  finish_kernel (kernel);
+  release_palette (pal);
+  return monotonic_ns () - start;
+}
+
+/**
+ *  BMtoBMP_load_calibration - loads kernel crossover points written by
+ *  `BMtoBMP_calibrate()`, which automatic kernel selection then consults.
+ *  Crossover points are installed once per process, before conversions
+ *  start on other threads; later calls fail.
+ *
+ *  @param  cache_path  path of the calibration file.
+ *  @return zero on success, non-zero on failure.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_load_calibration (const char *cache_path)
+{
+  FILE *cache = fopen (cache_path, "r");
+  if (cache == NULL)
+    return -1;
+
+  BMtoBMP_Calibration_t calibration;
+  memset (&calibration, 0, sizeof (calibration));
+  uint64_t min_pixels;
+  char name[16];
+  while (calibration.count < BMtoBMP_CALIBRATION_MAX_ENTRIES
+         && fscanf (cache, "%" SCNu64 " %15s", &min_pixels, name) == 2)
+    {
+      const BMtoBMP_Kernel_t kernel = BMtoBMP_kernel_from_name (name);
+      if (kernel == BMtoBMP_KERNEL_AUTO || kernel == BMtoBMP_KERNEL_COUNT)
+        break;
+      calibration.min_pixels[calibration.count] = min_pixels;
+      calibration.kernel[calibration.count] = kernel;
+      calibration.count++;
+    }
+
+  const int8_t complete = feof (cache) && calibration.count > 0;
+  fclose (cache);
+  if (!complete)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] calibration error: %s is malformed.\n",
+               cache_path);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      return -1;
+    }
+
+  return install_calibration (&calibration);
+}
+
+/**
+ *  BMtoBMP_calibrate - times every available kernel on synthetic images from
+ *  1K to 4M pixels, installs the resulting crossover points for automatic
+ *  kernel selection, and saves them to `cache_path`. As with
+ *  `BMtoBMP_load_calibration()`, only the first crossover points are
+ *  installed.
+ *
+ *  @param  cache_path  path to save the calibration to, or NULL.
+ *  @return zero on success, non-zero on failure.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_calibrate (const char *cache_path)
+{
+  const uint32_t width = 1024;
+  const uint32_t max_rows = 4096;
+  const uint64_t min_pixels_per_run = (uint64_t)1 << 20;
+  uint8_t *indices = (uint8_t *)malloc ((size_t)width * max_rows);
+  uint8_t *out = (uint8_t *)malloc ((size_t)width * max_rows
+                                    * BMtoBMP_BYTES_PER_PIXEL);
+  if (indices == NULL || out == NULL)
+    {
+      free (indices);
+      free (out);
+      return -1;
+    }
+
+  /* Noisy indices, so that no kernel benefits from repeated colors. */
+  uint32_t seed = 0x2545F491u;
+  for (size_t i = 0; i < (size_t)width * max_rows; i++)
+    {
+      seed = seed * 1664525u + 1013904223u;
+      indices[i] = (uint8_t)(seed >> 24);
+    }
+  BMtoBMP_Palette_t pal;
+  memset (&pal, 0, sizeof (pal));
+  pal.num_colors = BMtoBMP_PALETTE_NUM_COLORS;
+  for (uint32_t i = 0; i < BMtoBMP_PALETTE_NUM_COLORS; i++)
+    {
+      pal.bgr[i] = i * 0x00010203u;
+      for (uint32_t c = 0; c < BMtoBMP_BYTES_PER_PIXEL; c++)
+        pal.planar[c][i] = (uint8_t)(pal.bgr[i] >> (8 * c));
+    }
+
+  BMtoBMP_Calibration_t calibration;
+  memset (&calibration, 0, sizeof (calibration));
+  for (uint32_t rows = 1; rows <= max_rows; rows *= 4)
+    {
+      const uint64_t num_pixels = (uint64_t)width * rows;
+      const uint64_t runs = (min_pixels_per_run + num_pixels - 1) / num_pixels;
+      BMtoBMP_Kernel_t fastest = BMtoBMP_KERNEL_SCALAR;
+      uint64_t fastest_ns = UINT64_MAX;
+      for (int k = BMtoBMP_KERNEL_AUTO + 1; k < BMtoBMP_KERNEL_COUNT; k++)
+        {
+          const BMtoBMP_Kernel_t kernel = (BMtoBMP_Kernel_t)k;
+          if (!kernel_is_available (kernel))
+            continue;
+
+          /* Best of three, each long enough to swamp timer resolution, and
+           * cut short once it can no longer beat the fastest so far. */
+          for (int attempt = 0; attempt < 3; attempt++)
+            {
+              uint64_t elapsed = 0;
+              for (uint64_t r = 0; r < runs && elapsed < fastest_ns; r++)
+                {
+                  const uint64_t t
+                      = time_kernel (kernel, &pal, indices, out, width, rows);
+                  elapsed = (t == UINT64_MAX) ? t : elapsed + t;
+                }
+              if (elapsed < fastest_ns)
+                {
+                  fastest_ns = elapsed;
+                  fastest = kernel;
+                }
+            }
+        }
+
+      if (calibration.count == 0
+          || calibration.kernel[calibration.count - 1] != fastest)
+        {
+          calibration.min_pixels[calibration.count]
+              = calibration.count == 0 ? 0 : num_pixels;
+          calibration.kernel[calibration.count] = fastest;
+          calibration.count++;
+        }
+    }
+  free (indices);
+  free (out);
+  const int8_t installed = install_calibration (&calibration);
 
-  strcpy (img.filename, output_filename);
-  strcat (img.filename, ".bmp");
+  if (cache_path == NULL)
+    return installed;
+
+  FILE *cache = fopen (cache_path, "w");
+  if (cache == NULL)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] fopen error: could not create file, %s.\n",
+               cache_path);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      return -1;
+    }
+  for (uint32_t i = 0; i < calibration.count; i++)
+    {
+      fprintf (cache, "%" PRIu64 " %s\n", calibration.min_pixels[i],
+               BMtoBMP_kernel_name (calibration.kernel[i]));
+    }
+  return (fclose (cache) == 0 && installed == 0) ? 0 : -1;
+}
+
+/**
+ *  output_encoded_image_to_file - converts a BM image file in memory with
+ *  `BMtoBMP_encode_bmp()` and writes the result out in one go.
+ *
+ *  @param  bm_file  file ptr (`FILE *`)to some open bm_file.
+ *  @param  pal some loaded `BMtoBMP_Palette_t`; only read.
+ *  @param  img the `BMtoBMP_BitmapImage_t` to be written; only `filename` is
+ *  used.
+ *  @param  opts  conversion options.
+ *  @return zero on success, non-zero on failure; see `check_interrupt()`.
+ */
+static int8_t
+output_encoded_image_to_file (FILE *bm_file, const BMtoBMP_Palette_t *pal,
+                              BMtoBMP_BitmapImage_t *img,
+                              const BMtoBMP_Options_t *opts)
+{
+  int8_t status = -1;
+  uint8_t *out = NULL;
+  FILE *output = NULL;
+  size_t out_len = 0;
+  fseek (bm_file, 0x0, SEEK_END);
+  const long bm_len = ftell (bm_file);
+  uint8_t *bm = (uint8_t *)malloc (bm_len > 0 ? (size_t)bm_len : 1);
+  if (bm_len < 0 || bm == NULL)
+    goto clean_up;
+  fseek (bm_file, 0x0, SEEK_SET);
+  if (fread (bm, 1, (size_t)bm_len, bm_file) != (size_t)bm_len)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] failed to read bm file.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      goto clean_up;
+    }
 
-  if (output_image_to_file (&img) != 0)
+  if (BMtoBMP_parse_bm (bm, (size_t)bm_len, &img->width, &img->height) != 0)
+    goto clean_up;
+  out_len = BMtoBMP_bmp_size (img->width, img->height, opts);
+  if (out_len == 0)
     goto clean_up;
+  BMtoBMP_PROBE3 (alloc_start, img->width, img->height, out_len);
+  out = (uint8_t *)malloc (out_len);
+  BMtoBMP_PROBE3 (alloc_done, img->width, img->height, out != NULL ? 0 : -1);
+  if (out == NULL)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] failed to allocate output buffer.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      goto clean_up;
+    }
+  status = BMtoBMP_encode_bmp (bm, (size_t)bm_len, pal, out, out_len, opts);
+  if (status != 0)
+    goto clean_up;
+  status = -1;
+
+  BMtoBMP_PROBE3 (write_start, img->width, img->height, out_len);
+  output = fopen (img->filename, "wb");
+  if (output == NULL)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] failed to open output file, %s.\n",
+               img->filename);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      goto clean_up;
+    }
+  if (fwrite (out, 1, out_len, output) != out_len)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] failed to write output file, %s.\n",
+               img->filename);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      goto clean_up;
+    }
+  status = 0;
 
-  destroy_img_data (&img);
-  return 0;
 clean_up:
+  if (output != NULL && fclose (output) != 0)
+    status = -1;
+  if (output != NULL)
+    BMtoBMP_PROBE3 (write_done, img->width, img->height, status);
+  free (out);
+  free (bm);
+  return status;
+}
+
+/**
+ *  set_output_filename - sets `img`'s filename to `output_filename` plus the
+ *  ".bmp" extension.
+ *
+ *  @param  img some `BMtoBMP_BitmapImage_t`.
+ *  @param  output_filename sz of the desired output filename, max len = 250.
+ *  @return zero on success, non-zero if `output_filename` is too long.
+ */
+static int8_t
+set_output_filename (BMtoBMP_BitmapImage_t *img, const char *output_filename)
+{
+  /* len(".BMP\0") = 5 */
+  if (strlen (output_filename) + 5 > BMtoBMP_OUTPUT_FILENAME_MAX_LEN)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] output filename is too long.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      return -1;
+    }
+
+  strcpy (img->filename, output_filename);
+  strcat (img->filename, ".bmp");
+  return 0;
+}
+
+/**
+ *  BMtoBMP_convert_image_ex - converts a BM image file to BMP format using
+ *  the given options.
+ *
+ *  @param  bm_file  file ptr (`FILE *`)to some open bm_file.
+ *  @param  pal_file  file ptr (`FILE *`) to some open pal_file.
+ *  @param  output_filename sz of the desired output filename, max len = 250.
+ *  @param  opts  conversion options, or NULL for the defaults.
+ *  @return zero on success, `BMtoBMP_CANCELLED` or
+ *  `BMtoBMP_DEADLINE_EXCEEDED` if interrupted, -1 on other failures.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_convert_image_ex (FILE *bm_file, FILE *pal_file,
+                          char const output_filename[BMtoBMP_STATIC_1],
+                          const BMtoBMP_Options_t *opts)
+{
+  BMtoBMP_BitmapImage_t img;
+  if (set_output_filename (&img, output_filename) != 0)
+    return -1;
+
+  if (opts != NULL && opts->format == BMtoBMP_FORMAT_8BPP_INDEXED)
+    {
+      if (output_scale (opts) == 0
+          || read_image_dimensions (bm_file, &img) != 0)
+        return -1;
+      BMtoBMP_PROBE3 (write_start, img.width, img.height,
+                      BMtoBMP_bmp_size (img.width, img.height, opts));
+      const int8_t status
+          = output_indexed_image_to_file (bm_file, pal_file, &img, opts);
+      BMtoBMP_PROBE3 (write_done, img.width, img.height, status);
+      return status;
+    }
+
+  /* Other layouts go through the specialized whole-image kernels. */
+  if (opts != NULL
+      && (opts->format != BMtoBMP_FORMAT_24BPP || opts->top_down
+          || opts->scale > 1))
+    {
+      BMtoBMP_Palette_t pal;
+      if (load_palette (pal_file, &pal) != 0)
+        return -1;
+      img.data = NULL;
+      return output_encoded_image_to_file (bm_file, &pal, &img, opts);
+    }
+
+  if (create_image (bm_file, &img) != 0)
+    return -1;
+
+  int8_t status = process_image (bm_file, pal_file, &img, opts);
+  if (status == 0)
+    {
+      BMtoBMP_PROBE3 (write_start, img.width, img.height,
+                      BMtoBMP_bmp_size (img.width, img.height, opts));
+      status = output_image_to_file (&img, opts);
+      BMtoBMP_PROBE3 (write_done, img.width, img.height, status);
+    }
+
   destroy_img_data (&img);
-  return -1;
+  return status;
+}
+
+/**
+ *  BMtoBMP_convert_image_with_palette - converts a BM image file to BMP
+ *  format like `BMtoBMP_convert_image_ex()`, but with a palette that is
+ *  already loaded, e.g. by `BMtoBMP_palette_from_buffer()`. `pal` is only
+ *  read, so conversions on several threads can share it.
+ *
+ *  @param  bm_file  file ptr (`FILE *`)to some open bm_file.
+ *  @param  pal some loaded `BMtoBMP_Palette_t`.
+ *  @param  output_filename sz of the desired output filename, max len = 250.
+ *  @param  opts  conversion options, or NULL for the defaults.
+ *  @return zero on success, `BMtoBMP_CANCELLED` or
+ *  `BMtoBMP_DEADLINE_EXCEEDED` if interrupted, -1 on other failures.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_convert_image_with_palette (
+    FILE *bm_file, const BMtoBMP_Palette_t *pal,
+    char const output_filename[BMtoBMP_STATIC_1],
+    const BMtoBMP_Options_t *opts)
+{
+  BMtoBMP_BitmapImage_t img;
+  if (set_output_filename (&img, output_filename) != 0)
+    return -1;
+  img.data = NULL;
+  return output_encoded_image_to_file (bm_file, pal, &img, opts);
+}
+
+/**
+ *  BMtoBMP_convert_image - The primary function for converting a BM image file
+ *  to BMP format.
+ *
+ *  @param  bm_file  file ptr (`FILE *`)to some open bm_file.
+ *  @param  pal_file  file ptr (`FILE *`) to some open pal_file.
+ *  @param  output_filename sz of the desired output filename, max len = 250.
+ *  @return zero on success, non-zero on failure.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_convert_image (FILE *bm_file, FILE *pal_file,
+                       char const output_filename[BMtoBMP_STATIC_1])
+{
+  return BMtoBMP_convert_image_ex (bm_file, pal_file, output_filename, NULL);
 }
 
 #endif /* _BM_TO_BITMAP_CONVERTER_H_ */
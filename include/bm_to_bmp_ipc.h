@@ -0,0 +1,680 @@
+//  Copyright (C) 2024  IcePanorama
+//
+//  This file is part of BMtoBMP.
+//
+//  BMtoBMP is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by the
+//  Free Software Foundation, either version 3 of the License, or (at your
+//  option) any later version.
+//  This program is distributed in the hope that it will be useful, but WITHOUT
+//  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+//  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+//  more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program.  If not, see <https://www.gnu.org/licenses/>.
+/* clang-format off */
+/**
+ *
+ *  BMtoBMP IPC - zero-copy conversions between local processes and a
+ *  long-running converter (Linux only, link with `-pthread`).
+ *
+ *  A client passes three file descriptors over a Unix socket (`SCM_RIGHTS`):
+ *  the BM data, the PAL data, and an output file at least
+ *  `BMtoBMP_bmp_size()` bytes long. The converter only maps files that are
+ *  sealed so that the client cannot pull pages out from under it: inputs
+ *  sealed against shrinking and writing (`BMtoBMP_ipc_seal_input()`), and
+ *  outputs sealed against shrinking (every memfd from `BMtoBMP_ipc_memfd()`).
+ *  It then encodes the BMP straight into the client's output mapping, so no
+ *  image bytes cross the socket. Other descriptors, e.g. regular files, are
+ *  copied with pread(2)/pwrite(2) instead.
+ *
+ *  Server: `BMtoBMP_ipc_listen()`, then `BMtoBMP_ipc_serve()`.
+ *  Client: `BMtoBMP_ipc_connect()`, then `BMtoBMP_ipc_convert()` per image.
+ */
+/* clang-format on */
+#ifndef _BM_TO_BMP_IPC_H_
+#define _BM_TO_BMP_IPC_H_
+
+#include "bm_to_bmp_converter.h"
+#include "bm_to_bmp_stats.h"
+
+#ifndef __linux__
+#error "bm_to_bmp_ipc.h needs Linux memfd_create(2)"
+#endif /* __linux__ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define BMtoBMP_IPC_MAGIC (0x50494D42u) // "BMIP"
+#define BMtoBMP_IPC_NUM_FDS (3)         // BM, PAL, output
+
+/* How many clients `BMtoBMP_ipc_serve()` serves at once; more wait to be
+ * accepted. */
+#ifndef BMtoBMP_IPC_MAX_CONNECTIONS
+#define BMtoBMP_IPC_MAX_CONNECTIONS (64)
+#endif /* BMtoBMP_IPC_MAX_CONNECTIONS */
+
+/* Seals a file needs before the converter maps it. Shrinking would make
+ * touching the mapping raise SIGBUS; writing would change inputs while they
+ * are converted. */
+#define BMtoBMP_IPC_INPUT_SEALS (F_SEAL_SHRINK | F_SEAL_WRITE)
+#define BMtoBMP_IPC_OUTPUT_SEALS (F_SEAL_SHRINK)
+
+/* What each of the server's threads needs. */
+typedef struct BMtoBMP_IpcServer_s
+{
+  int listen_sock;
+  BMtoBMP_Stats_t *stats; // or NULL
+} BMtoBMP_IpcServer_t;
+
+/* A client's file, mapped if it is sealed, or copied otherwise. */
+typedef struct BMtoBMP_IpcFile_s
+{
+  uint8_t *data;
+  size_t len;
+  uint8_t mapped;
+} BMtoBMP_IpcFile_t;
+
+typedef struct BMtoBMP_IpcRequest_s
+{
+  uint32_t magic;
+  uint32_t format; // `BMtoBMP_OutputFormat_t`
+  uint32_t kernel; // `BMtoBMP_Kernel_t`
+  uint8_t top_down;
+  uint8_t scale;
+  uint8_t checksum; // non-zero asks for the BMP's CRC-32C in the reply
+  uint8_t reserved;
+  uint64_t bm_len;
+  uint64_t pal_len;
+  uint64_t out_len;
+} BMtoBMP_IpcRequest_t;
+
+typedef struct BMtoBMP_IpcReply_s
+{
+  int32_t status;    // what `BMtoBMP_encode_bmp()` returned
+  uint32_t checksum; // the BMP's CRC-32C, if asked for
+  uint64_t bmp_len;  // bytes of the output file holding the BMP
+} BMtoBMP_IpcReply_t;
+
+/**
+ *  send_with_fds - sends `len` bytes over a Unix socket, along with `num_fds`
+ *  file descriptors.
+ *
+ *  @param  sock  some connected Unix socket.
+ *  @param  data  the bytes to send.
+ *  @param  len length of `data`.
+ *  @param  fds file descriptors to pass, or NULL.
+ *  @param  num_fds number of entries in `fds`.
+ *  @return zero on success, non-zero on failure.
+ */
+static int8_t
+send_with_fds (int sock, const void *data, size_t len, const int *fds,
+               int num_fds)
+{
+  union
+  {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE (sizeof (int) * BMtoBMP_IPC_NUM_FDS)];
+  } control;
+  struct iovec iov = { (void *)data, len };
+  struct msghdr msg;
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (num_fds > 0)
+    {
+      memset (&control, 0, sizeof (control));
+      msg.msg_control = control.buf;
+      msg.msg_controllen = CMSG_SPACE (sizeof (int) * num_fds);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN (sizeof (int) * num_fds);
+      memcpy (CMSG_DATA (cmsg), fds, sizeof (int) * num_fds);
+    }
+
+  ssize_t sent;
+  do
+    sent = sendmsg (sock, &msg, MSG_NOSIGNAL);
+  while (sent < 0 && errno == EINTR);
+  return sent == (ssize_t)len ? 0 : -1;
+}
+
+/**
+ *  recv_with_fds - receives exactly `len` bytes from a Unix socket, along
+ *  with exactly `num_fds` file descriptors. Stray descriptors are closed.
+ *
+ *  @param  sock  some connected Unix socket.
+ *  @param  data  where the bytes should be stored.
+ *  @param  len length of `data`.
+ *  @param  fds where the file descriptors should be stored, or NULL.
+ *  @param  num_fds number of descriptors expected.
+ *  @return zero on success, non-zero on failure or end of stream.
+ */
+static int8_t
+recv_with_fds (int sock, void *data, size_t len, int *fds, int num_fds)
+{
+  union
+  {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE (sizeof (int) * BMtoBMP_IPC_NUM_FDS)];
+  } control;
+  struct iovec iov = { data, len };
+  struct msghdr msg;
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof (control.buf);
+
+  ssize_t received;
+  do
+    received = recvmsg (sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  while (received < 0 && errno == EINTR);
+
+  int num_received = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR (&msg, cmsg))
+    {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+      const int n = (int)((cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int));
+      for (int i = 0; i < n; i++)
+        {
+          int fd;
+          memcpy (&fd, CMSG_DATA (cmsg) + i * sizeof (int), sizeof (int));
+          if (num_received < num_fds)
+            fds[num_received++] = fd;
+          else
+            close (fd);
+        }
+    }
+
+  if (received == (ssize_t)len && num_received == num_fds
+      && !(msg.msg_flags & MSG_CTRUNC))
+    return 0;
+  for (int i = 0; i < num_received; i++)
+    close (fds[i]);
+  return -1;
+}
+
+/**
+ *  transfer_fd - reads or writes all of `len` bytes at the start of `fd`.
+ *
+ *  @param  fd  some open file descriptor.
+ *  @param  data  the bytes to transfer.
+ *  @param  len length of `data`.
+ *  @param  write_out non-zero to write `data`, zero to read into it.
+ *  @return zero on success, non-zero on failure or end of file.
+ */
+static int8_t
+transfer_fd (int fd, uint8_t *data, size_t len, int8_t write_out)
+{
+  for (size_t done = 0; done < len;)
+    {
+      const ssize_t n = write_out
+                            ? pwrite (fd, data + done, len - done, (off_t)done)
+                            : pread (fd, data + done, len - done, (off_t)done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      done += (size_t)n;
+    }
+  return 0;
+}
+
+/**
+ *  open_ipc_file - gets at the first `len` bytes of a client's file, after
+ *  checking the file is that long. Files sealed with `seals` are mapped;
+ *  others are copied into a private buffer, since the client could shrink
+ *  them while they are mapped.
+ *
+ *  @param  file  the `BMtoBMP_IpcFile_t` to fill in.
+ *  @param  fd  some open file descriptor.
+ *  @param  len number of bytes, non-zero.
+ *  @param  seals `BMtoBMP_IPC_INPUT_SEALS` or `BMtoBMP_IPC_OUTPUT_SEALS`.
+ *  @return zero on success, non-zero on failure.
+ */
+static int8_t
+open_ipc_file (BMtoBMP_IpcFile_t *file, int fd, uint64_t len, int seals)
+{
+  file->data = NULL;
+  file->len = 0;
+  file->mapped = 0;
+  struct stat st;
+  if (fstat (fd, &st) != 0 || st.st_size < 0 || (uint64_t)st.st_size < len
+      || len > SIZE_MAX)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] ipc file is shorter than requested.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      return -1;
+    }
+
+  const uint8_t is_output = seals == BMtoBMP_IPC_OUTPUT_SEALS;
+  const int has_seals = fcntl (fd, F_GET_SEALS);
+  if (has_seals >= 0 && (has_seals & seals) == seals)
+    {
+      void *map = mmap (NULL, (size_t)len,
+                        is_output ? PROT_READ | PROT_WRITE : PROT_READ,
+                        MAP_SHARED, fd, 0);
+      if (map == MAP_FAILED)
+        return -1;
+      file->data = (uint8_t *)map;
+      file->mapped = 1;
+    }
+  else
+    {
+      file->data = (uint8_t *)malloc ((size_t)len);
+      if (file->data == NULL
+          || (!is_output && transfer_fd (fd, file->data, (size_t)len, 0) != 0))
+        {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+          fprintf (stderr, "[BMtoBMP] failed to read ipc file.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+          free (file->data);
+          file->data = NULL;
+          return -1;
+        }
+    }
+  file->len = (size_t)len;
+  return 0;
+}
+
+/**
+ *  close_ipc_file - releases what `open_ipc_file()` got, first writing the
+ *  first `write_len` bytes back to `fd` if they were copied.
+ *
+ *  @param  file  some `BMtoBMP_IpcFile_t`.
+ *  @param  fd  the file descriptor it came from.
+ *  @param  write_len number of bytes to write back, or zero.
+ *  @return zero on success, non-zero if writing back failed.
+ */
+static int8_t
+close_ipc_file (BMtoBMP_IpcFile_t *file, int fd, size_t write_len)
+{
+  int8_t status = 0;
+  if (file->data == NULL)
+    return 0;
+  if (file->mapped)
+    munmap (file->data, file->len);
+  else
+    {
+      if (write_len > 0)
+        status = transfer_fd (fd, file->data, write_len, 1);
+      free (file->data);
+    }
+  file->data = NULL;
+  return status;
+}
+
+/* The last palette a connection used, with its tables built, since clients
+ * tend to send the same PAL data with every image. */
+typedef struct BMtoBMP_IpcPaletteCache_s
+{
+  uint8_t rgb[BMtoBMP_PALETTE_NUM_COLORS * 3];
+  size_t len; // zero while empty
+  BMtoBMP_Palette_t pal;
+} BMtoBMP_IpcPaletteCache_t;
+
+/**
+ *  cached_palette - returns the palette for PAL data, reusing the cached one
+ *  if the data is the same.
+ *
+ *  @param  cache the connection's `BMtoBMP_IpcPaletteCache_t`.
+ *  @param  pal_data  PAL file data.
+ *  @param  pal_len length of `pal_data` in bytes, non-zero.
+ *  @return the palette, or NULL on failure.
+ */
+static const BMtoBMP_Palette_t *
+cached_palette (BMtoBMP_IpcPaletteCache_t *cache, const uint8_t *pal_data,
+                size_t pal_len)
+{
+  const size_t len = pal_len < sizeof (cache->rgb) ? pal_len
+                                                   : sizeof (cache->rgb);
+  if (cache->len == len && memcmp (cache->rgb, pal_data, len) == 0)
+    return &cache->pal;
+
+  release_palette (&cache->pal);
+  cache->len = 0;
+  if (BMtoBMP_palette_from_buffer (pal_data, len, &cache->pal) != 0)
+    return NULL;
+  BMtoBMP_palette_cache_tables (&cache->pal);
+  memcpy (cache->rgb, pal_data, len);
+  cache->len = len;
+  return &cache->pal;
+}
+
+/**
+ *  handle_ipc_request - converts one request's BM data into its output file.
+ *
+ *  @param  req the request.
+ *  @param  fds the BM, PAL and output file descriptors.
+ *  @param  cache the connection's `BMtoBMP_IpcPaletteCache_t`.
+ *  @param  reply the reply to fill in.
+ *  @param  pixels  the image's width times height, or zero if unknown
+ *  (output).
+ */
+static void
+handle_ipc_request (const BMtoBMP_IpcRequest_t *req,
+                    const int fds[BMtoBMP_IPC_NUM_FDS],
+                    BMtoBMP_IpcPaletteCache_t *cache,
+                    BMtoBMP_IpcReply_t *reply, uint64_t *pixels)
+{
+  BMtoBMP_Options_t opts;
+  memset (&opts, 0, sizeof (opts));
+  opts.format = (BMtoBMP_OutputFormat_t)req->format;
+  opts.kernel = (BMtoBMP_Kernel_t)req->kernel;
+  opts.top_down = req->top_down;
+  opts.scale = req->scale;
+  if (req->checksum)
+    opts.checksum = &reply->checksum;
+  reply->status = -1;
+  reply->checksum = 0;
+  reply->bmp_len = 0;
+  *pixels = 0;
+  if (req->magic != BMtoBMP_IPC_MAGIC || req->format > BMtoBMP_FORMAT_32BPP
+      || req->kernel >= BMtoBMP_KERNEL_COUNT || req->bm_len == 0
+      || req->pal_len == 0 || req->out_len == 0)
+    {
+      return;
+    }
+
+  BMtoBMP_IpcFile_t bm;
+  BMtoBMP_IpcFile_t pal_data;
+  BMtoBMP_IpcFile_t out;
+  open_ipc_file (&bm, fds[0], req->bm_len, BMtoBMP_IPC_INPUT_SEALS);
+  open_ipc_file (&pal_data, fds[1], req->pal_len, BMtoBMP_IPC_INPUT_SEALS);
+  open_ipc_file (&out, fds[2], req->out_len, BMtoBMP_IPC_OUTPUT_SEALS);
+  const BMtoBMP_Palette_t *pal
+      = pal_data.data != NULL
+            ? cached_palette (cache, pal_data.data, pal_data.len)
+            : NULL;
+  uint32_t width;
+  uint32_t height;
+  if (bm.data != NULL && pal != NULL && out.data != NULL
+      && BMtoBMP_parse_bm (bm.data, bm.len, &width, &height) == 0)
+    {
+      reply->status = BMtoBMP_encode_bmp (bm.data, bm.len, pal, out.data,
+                                          out.len, &opts);
+      if (reply->status == 0)
+        reply->bmp_len = BMtoBMP_bmp_size (width, height, &opts);
+      *pixels = (uint64_t)width * height;
+    }
+
+  close_ipc_file (&bm, fds[0], 0);
+  close_ipc_file (&pal_data, fds[1], 0);
+  if (close_ipc_file (&out, fds[2], (size_t)reply->bmp_len) != 0)
+    {
+      reply->status = -1;
+      reply->bmp_len = 0;
+    }
+}
+
+/**
+ *  serve_ipc_connection - answers one client's requests until it hangs up.
+ *
+ *  @param  sock  the client's socket; closed.
+ *  @param  stats where each request's conversion is recorded, or NULL.
+ */
+static void
+serve_ipc_connection (int sock, BMtoBMP_Stats_t *stats)
+{
+  BMtoBMP_IpcRequest_t req;
+  int fds[BMtoBMP_IPC_NUM_FDS];
+  BMtoBMP_IpcPaletteCache_t cache;
+  memset (&cache, 0, sizeof (cache));
+  while (recv_with_fds (sock, &req, sizeof (req), fds, BMtoBMP_IPC_NUM_FDS)
+         == 0)
+    {
+      BMtoBMP_IpcReply_t reply;
+      uint64_t pixels;
+      const uint64_t start_ns = monotonic_ns ();
+      handle_ipc_request (&req, fds, &cache, &reply, &pixels);
+      if (stats != NULL)
+        BMtoBMP_stats_record (stats, pixels, req.bm_len, reply.bmp_len,
+                              monotonic_ns () - start_ns, reply.status);
+      for (int i = 0; i < BMtoBMP_IPC_NUM_FDS; i++)
+        close (fds[i]);
+      if (send_with_fds (sock, &reply, sizeof (reply), NULL, 0) != 0)
+        break;
+    }
+
+  release_palette (&cache.pal);
+  close (sock);
+}
+
+/**
+ *  accept_ipc_connections - one of the server's threads; accepts clients
+ *  and serves them one at a time until accepting fails.
+ *
+ *  @param  arg the `BMtoBMP_IpcServer_t`.
+ *  @return NULL.
+ */
+static void *
+accept_ipc_connections (void *arg)
+{
+  const BMtoBMP_IpcServer_t *server = (const BMtoBMP_IpcServer_t *)arg;
+  for (;;)
+    {
+      const int sock = accept4 (server->listen_sock, NULL, NULL, SOCK_CLOEXEC);
+      if (sock >= 0)
+        serve_ipc_connection (sock, server->stats);
+      else if (errno != EINTR && errno != ECONNABORTED)
+        break;
+    }
+
+  /* Make the other threads' accept4() fail too. */
+  shutdown (server->listen_sock, SHUT_RDWR);
+  return NULL;
+}
+
+/**
+ *  fill_socket_address - fills in a Unix socket address for `path`.
+ *
+ *  @param  addr  the address to fill in.
+ *  @param  path  filesystem path of the socket.
+ *  @return zero on success, non-zero if `path` is too long.
+ */
+static int8_t
+fill_socket_address (struct sockaddr_un *addr, const char *path)
+{
+  memset (addr, 0, sizeof (*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen (path) >= sizeof (addr->sun_path))
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] socket path is too long, %s.\n", path);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      return -1;
+    }
+  strcpy (addr->sun_path, path);
+  return 0;
+}
+
+/**
+ *  BMtoBMP_ipc_listen - creates the converter's listening socket, replacing
+ *  any stale socket at `path`.
+ *
+ *  @param  path  filesystem path of the socket.
+ *  @return the listening socket, or -1 on failure.
+ */
+BMtoBMP_API int
+BMtoBMP_ipc_listen (const char *path)
+{
+  struct sockaddr_un addr;
+  if (fill_socket_address (&addr, path) != 0)
+    return -1;
+
+  const int sock = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return -1;
+  unlink (path);
+  if (bind (sock, (struct sockaddr *)&addr, sizeof (addr)) != 0
+      || listen (sock, SOMAXCONN) != 0)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] unable to listen on %s.\n", path);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      close (sock);
+      return -1;
+    }
+  return sock;
+}
+
+/**
+ *  BMtoBMP_ipc_serve - accepts clients on `listen_sock` until accepting
+ *  fails, serving up to `BMtoBMP_IPC_MAX_CONNECTIONS` at once, each on one
+ *  of a fixed set of threads.
+ *
+ *  @param  listen_sock some socket from `BMtoBMP_ipc_listen()`.
+ *  @param  stats where each request's conversion is recorded, or NULL.
+ *  @return non-zero once accepting fails.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_ipc_serve (int listen_sock, BMtoBMP_Stats_t *stats)
+{
+  BMtoBMP_IpcServer_t server;
+  server.listen_sock = listen_sock;
+  server.stats = stats;
+  pthread_t threads[BMtoBMP_IPC_MAX_CONNECTIONS - 1];
+  uint32_t num_threads = 0;
+  for (; num_threads < BMtoBMP_IPC_MAX_CONNECTIONS - 1; num_threads++)
+    {
+      if (pthread_create (&threads[num_threads], NULL, accept_ipc_connections,
+                          &server)
+          != 0)
+        break;
+    }
+
+  accept_ipc_connections (&server);
+  for (uint32_t i = 0; i < num_threads; i++)
+    pthread_join (threads[i], NULL);
+  return -1;
+}
+
+/**
+ *  BMtoBMP_ipc_connect - connects to a converter.
+ *
+ *  @param  path  filesystem path of the converter's socket.
+ *  @return the connected socket, or -1 on failure.
+ */
+BMtoBMP_API int
+BMtoBMP_ipc_connect (const char *path)
+{
+  struct sockaddr_un addr;
+  if (fill_socket_address (&addr, path) != 0)
+    return -1;
+
+  const int sock = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return -1;
+  if (connect (sock, (struct sockaddr *)&addr, sizeof (addr)) != 0)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] unable to connect to %s.\n", path);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      close (sock);
+      return -1;
+    }
+  return sock;
+}
+
+/**
+ *  BMtoBMP_ipc_memfd - creates an anonymous shared memory file of `len`
+ *  bytes, sealed against shrinking, for passing to the converter.
+ *
+ *  @param  name  a name for debugging, see `memfd_create(2)`.
+ *  @param  len size of the file in bytes.
+ *  @return the file descriptor, or -1 on failure.
+ */
+BMtoBMP_API int
+BMtoBMP_ipc_memfd (const char *name, size_t len)
+{
+  const int fd = memfd_create (name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return -1;
+  if (ftruncate (fd, (off_t)len) != 0
+      || fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK) != 0)
+    {
+      close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+/**
+ *  BMtoBMP_ipc_seal_input - seals a memfd from `BMtoBMP_ipc_memfd()` against
+ *  writing once the BM or PAL data is in it, so that the converter maps it
+ *  instead of copying it. Unmap any writable mappings of it first.
+ *
+ *  @param  fd  some file descriptor from `BMtoBMP_ipc_memfd()`.
+ *  @return zero on success, non-zero on failure.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_ipc_seal_input (int fd)
+{
+  return fcntl (fd, F_ADD_SEALS, BMtoBMP_IPC_INPUT_SEALS | F_SEAL_GROW) == 0
+             ? 0
+             : -1;
+}
+
+/**
+ *  BMtoBMP_ipc_convert - has the converter encode the BM data in `bm_fd`
+ *  straight into `out_fd`, and waits for it to finish.
+ *
+ *  @param  sock  some socket from `BMtoBMP_ipc_connect()`.
+ *  @param  bm_fd  file descriptor holding `bm_len` bytes of BM data.
+ *  @param  bm_len  length of the BM data.
+ *  @param  pal_fd  file descriptor holding `pal_len` bytes of PAL data.
+ *  @param  pal_len length of the PAL data.
+ *  @param  out_fd  file descriptor of at least `out_len` bytes, opened for
+ *  reading and writing, where the BMP file should be stored.
+ *  @param  out_len length of the output, at least `BMtoBMP_bmp_size()`.
+ *  @param  opts  conversion options, or NULL for the defaults; `cancel` and
+ *  `deadline_ns` are not passed on, and `checksum` comes back in the reply.
+ *  @return what `BMtoBMP_encode_bmp()` returned in the converter, or -1 if
+ *  the converter could not be reached.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_ipc_convert (int sock, int bm_fd, size_t bm_len, int pal_fd,
+                     size_t pal_len, int out_fd, size_t out_len,
+                     const BMtoBMP_Options_t *opts)
+{
+  BMtoBMP_IpcRequest_t req;
+  memset (&req, 0, sizeof (req));
+  req.magic = BMtoBMP_IPC_MAGIC;
+  if (opts != NULL)
+    {
+      req.format = (uint32_t)opts->format;
+      req.kernel = (uint32_t)opts->kernel;
+      req.top_down = opts->top_down;
+      req.scale = opts->scale;
+      req.checksum = opts->checksum != NULL;
+    }
+  req.bm_len = bm_len;
+  req.pal_len = pal_len;
+  req.out_len = out_len;
+
+  const int fds[BMtoBMP_IPC_NUM_FDS] = { bm_fd, pal_fd, out_fd };
+  BMtoBMP_IpcReply_t reply;
+  if (send_with_fds (sock, &req, sizeof (req), fds, BMtoBMP_IPC_NUM_FDS) != 0
+      || recv_with_fds (sock, &reply, sizeof (reply), NULL, 0) != 0)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] lost connection to the converter.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      return -1;
+    }
+  if (reply.status == 0 && opts != NULL && opts->checksum != NULL)
+    *opts->checksum = reply.checksum;
+  return (int8_t)reply.status;
+}
+
+#endif /* _BM_TO_BMP_IPC_H_ */
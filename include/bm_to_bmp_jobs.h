@@ -0,0 +1,404 @@
+//  Copyright (C) 2024  IcePanorama
+//
+//  This file is part of BMtoBMP.
+//
+//  BMtoBMP is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by the
+//  Free Software Foundation, either version 3 of the License, or (at your
+//  option) any later version.
+//  This program is distributed in the hope that it will be useful, but WITHOUT
+//  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+//  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+//  more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program.  If not, see <https://www.gnu.org/licenses/>.
+/* clang-format off */
+/**
+ *
+ *  BMtoBMP jobs - non-blocking conversions on a pool of worker threads, for
+ *  event-loop based C programs (POSIX only, link with `-pthread`).
+ *
+ *  `BMtoBMP_job_submit()` queues a `BMtoBMP_convert_image_with_palette()`
+ *  call and returns at once. When the conversion finishes, the job's
+ *  callback runs on the worker thread; jobs without a callback are queued as
+ *  completed instead, `BMtoBMP_job_pool_fd()` becomes readable (an eventfd
+ *  on Linux, a pipe elsewhere), and `BMtoBMP_job_pool_reap()` collects them
+ *  on the event loop's thread.
+ */
+/* clang-format on */
+#ifndef _BM_TO_BMP_JOBS_H_
+#define _BM_TO_BMP_JOBS_H_
+
+#include "bm_to_bmp_converter.h"
+
+#ifndef BMtoBMP_POSIX
+#error "bm_to_bmp_jobs.h needs POSIX threads"
+#endif /* BMtoBMP_POSIX */
+
+#include <fcntl.h>
+#include <pthread.h>
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif /* __linux__ */
+
+/**
+ *  BMtoBMP_JobCallback_t - reports a finished job, on the worker thread
+ *  that ran it.
+ *
+ *  @param  status  what `BMtoBMP_convert_image_with_palette()` returned.
+ *  @param  user_data the pointer passed to `BMtoBMP_job_submit()`.
+ */
+typedef void (*BMtoBMP_JobCallback_t) (int8_t status, void *user_data);
+
+typedef struct BMtoBMP_Job_s
+{
+  FILE *bm_file;
+  const BMtoBMP_Palette_t *pal;
+  char output_filename[BMtoBMP_OUTPUT_FILENAME_MAX_LEN];
+  BMtoBMP_Options_t opts;
+  BMtoBMP_JobCallback_t callback;
+  void *user_data;
+  int8_t status;
+  struct BMtoBMP_Job_s *next;
+} BMtoBMP_Job_t;
+
+/* A finished job collected by `BMtoBMP_job_pool_reap()`. */
+typedef struct BMtoBMP_JobResult_s
+{
+  int8_t status;
+  void *user_data;
+} BMtoBMP_JobResult_t;
+
+typedef struct BMtoBMP_JobPool_s
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t *threads;
+  uint32_t num_threads;
+  BMtoBMP_Job_t *pending; // FIFO, `pending_tail` is the newest
+  BMtoBMP_Job_t *pending_tail;
+  BMtoBMP_Job_t *running;
+  BMtoBMP_Job_t *completed; // finished jobs without a callback
+  int notify_fds[2];        // the same eventfd twice, or a pipe
+  uint8_t stopping;
+} BMtoBMP_JobPool_t;
+
+/**
+ *  open_notify_fds - opens the non-blocking descriptors that signal
+ *  completed jobs.
+ *
+ *  @param  fds where the read and write ends should be stored.
+ *  @return zero on success, non-zero on failure.
+ */
+static int8_t
+open_notify_fds (int fds[2])
+{
+#if defined(__linux__)
+  fds[0] = fds[1] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return fds[0] < 0 ? -1 : 0;
+#else
+  if (pipe (fds) != 0)
+    return -1;
+  for (int i = 0; i < 2; i++)
+    {
+      fcntl (fds[i], F_SETFL, fcntl (fds[i], F_GETFL) | O_NONBLOCK);
+      fcntl (fds[i], F_SETFD, FD_CLOEXEC);
+    }
+  return 0;
+#endif /* __linux__ */
+}
+
+/**
+ *  close_notify_fds - closes what `open_notify_fds()` opened.
+ *
+ *  @param  fds the read and write ends.
+ */
+static void
+close_notify_fds (int fds[2])
+{
+  close (fds[0]);
+  if (fds[1] != fds[0])
+    close (fds[1]);
+}
+
+/**
+ *  run_jobs - the worker thread loop; runs pending jobs until the pool is
+ *  stopping and none are left.
+ *
+ *  @param  arg the `BMtoBMP_JobPool_t`.
+ *  @return NULL.
+ */
+static void *
+run_jobs (void *arg)
+{
+  BMtoBMP_JobPool_t *pool = (BMtoBMP_JobPool_t *)arg;
+  pthread_mutex_lock (&pool->mutex);
+  for (;;)
+    {
+      while (pool->pending == NULL && !pool->stopping)
+        pthread_cond_wait (&pool->cond, &pool->mutex);
+      BMtoBMP_Job_t *job = pool->pending;
+      if (job == NULL)
+        break;
+      pool->pending = job->next;
+      if (pool->pending == NULL)
+        pool->pending_tail = NULL;
+      job->next = pool->running;
+      pool->running = job;
+      pthread_mutex_unlock (&pool->mutex);
+
+      job->status = BMtoBMP_convert_image_with_palette (
+          job->bm_file, job->pal, job->output_filename, &job->opts);
+
+      pthread_mutex_lock (&pool->mutex);
+      BMtoBMP_Job_t **link = &pool->running;
+      while (*link != job)
+        link = &(*link)->next;
+      *link = job->next;
+      if (job->callback != NULL)
+        {
+          /* `bm_file` is free for the next job from here on. */
+          pthread_mutex_unlock (&pool->mutex);
+          job->callback (job->status, job->user_data);
+          free (job);
+          pthread_mutex_lock (&pool->mutex);
+          continue;
+        }
+
+      job->next = pool->completed;
+      pool->completed = job;
+      const uint64_t one = 1;
+      /* A full pipe or eventfd is already readable, so EAGAIN is fine. */
+      if (write (pool->notify_fds[1], &one,
+                 pool->notify_fds[0] == pool->notify_fds[1] ? sizeof (one) : 1)
+          < 0)
+        {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+          if (errno != EAGAIN)
+            fprintf (stderr, "[BMtoBMP] failed to signal job completion.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+        }
+    }
+  pthread_mutex_unlock (&pool->mutex);
+  return NULL;
+}
+
+/**
+ *  BMtoBMP_job_pool_init - starts a pool of worker threads.
+ *
+ *  @param  pool  some uninitialized `BMtoBMP_JobPool_t`.
+ *  @param  num_threads number of worker threads, at least one.
+ *  @return zero on success, non-zero on failure.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_job_pool_init (BMtoBMP_JobPool_t *pool, uint32_t num_threads)
+{
+  memset (pool, 0, sizeof (*pool));
+  if (num_threads == 0)
+    num_threads = 1;
+  pool->threads = (pthread_t *)calloc (num_threads, sizeof (pthread_t));
+  if (pool->threads == NULL || open_notify_fds (pool->notify_fds) != 0)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] failed to set up job pool.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      free (pool->threads);
+      return -1;
+    }
+  pthread_mutex_init (&pool->mutex, NULL);
+  pthread_cond_init (&pool->cond, NULL);
+
+  for (; pool->num_threads < num_threads; pool->num_threads++)
+    {
+      if (pthread_create (&pool->threads[pool->num_threads], NULL, run_jobs,
+                          pool)
+          != 0)
+        break;
+    }
+  if (pool->num_threads == 0)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] failed to start worker threads.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      pthread_cond_destroy (&pool->cond);
+      pthread_mutex_destroy (&pool->mutex);
+      close_notify_fds (pool->notify_fds);
+      free (pool->threads);
+      return -1;
+    }
+
+  return 0;
+}
+
+/**
+ *  BMtoBMP_job_pool_fd - returns a descriptor that becomes readable when
+ *  jobs without a callback finish, for use with `poll(2)` or `epoll(7)`.
+ *
+ *  @param  pool  some initialized `BMtoBMP_JobPool_t`.
+ *  @return the file descriptor.
+ */
+BMtoBMP_API int
+BMtoBMP_job_pool_fd (const BMtoBMP_JobPool_t *pool)
+{
+  return pool->notify_fds[0];
+}
+
+/**
+ *  job_pool_uses - checks whether a queued or running job reads
+ *  `bm_file`. The caller must hold `pool->mutex`.
+ *
+ *  @param  pool  some initialized `BMtoBMP_JobPool_t`.
+ *  @param  bm_file  file ptr (`FILE *`) to check.
+ *  @return non-zero if some job reads `bm_file`, zero otherwise.
+ */
+static int8_t
+job_pool_uses (const BMtoBMP_JobPool_t *pool, const FILE *bm_file)
+{
+  const BMtoBMP_Job_t *lists[] = { pool->pending, pool->running };
+  for (size_t i = 0; i < sizeof (lists) / sizeof (lists[0]); i++)
+    {
+      for (const BMtoBMP_Job_t *job = lists[i]; job != NULL; job = job->next)
+        {
+          if (job->bm_file == bm_file)
+            return 1;
+        }
+    }
+  return 0;
+}
+
+/**
+ *  BMtoBMP_job_submit - queues a conversion and returns without waiting for
+ *  it. The job seeks and reads `bm_file` on a worker thread, so it owns the
+ *  file until it finishes: submitting a file another unfinished job reads
+ *  fails. `pal` is only read, so one palette, loaded with
+ *  `BMtoBMP_palette_from_buffer()` and ideally prepared with
+ *  `BMtoBMP_palette_cache_tables()`, can serve any number of jobs; it must
+ *  stay valid until they finish.
+ *
+ *  @param  pool  some initialized `BMtoBMP_JobPool_t`.
+ *  @param  bm_file  file ptr (`FILE *`)to some open bm_file.
+ *  @param  pal some loaded `BMtoBMP_Palette_t`.
+ *  @param  output_filename sz of the desired output filename, max len = 250.
+ *  @param  opts  conversion options, or NULL for the defaults; copied.
+ *  @param  callback  called when the job finishes, or NULL to report it
+ *  through `BMtoBMP_job_pool_reap()` instead.
+ *  @param  user_data passed back with the result.
+ *  @return zero on success, non-zero on failure.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_job_submit (BMtoBMP_JobPool_t *pool, FILE *bm_file,
+                    const BMtoBMP_Palette_t *pal,
+                    char const output_filename[BMtoBMP_STATIC_1],
+                    const BMtoBMP_Options_t *opts,
+                    BMtoBMP_JobCallback_t callback, void *user_data)
+{
+  if (strlen (output_filename) >= BMtoBMP_OUTPUT_FILENAME_MAX_LEN)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] output filename is too long.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      return -1;
+    }
+
+  BMtoBMP_Job_t *job = (BMtoBMP_Job_t *)calloc (1, sizeof (BMtoBMP_Job_t));
+  if (job == NULL)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] failed to allocate job.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      return -1;
+    }
+  job->bm_file = bm_file;
+  job->pal = pal;
+  strcpy (job->output_filename, output_filename);
+  if (opts != NULL)
+    job->opts = *opts;
+  job->callback = callback;
+  job->user_data = user_data;
+
+  pthread_mutex_lock (&pool->mutex);
+  if (job_pool_uses (pool, bm_file))
+    {
+      pthread_mutex_unlock (&pool->mutex);
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] bm file is in use by another job.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      free (job);
+      return -1;
+    }
+  if (pool->pending_tail != NULL)
+    pool->pending_tail->next = job;
+  else
+    pool->pending = job;
+  pool->pending_tail = job;
+  pthread_cond_signal (&pool->cond);
+  pthread_mutex_unlock (&pool->mutex);
+  return 0;
+}
+
+/**
+ *  BMtoBMP_job_pool_reap - collects finished jobs that had no callback and
+ *  resets `BMtoBMP_job_pool_fd()` once none are left. Never blocks.
+ *
+ *  @param  pool  some initialized `BMtoBMP_JobPool_t`.
+ *  @param  results where the results should be stored.
+ *  @param  max_results length of `results`.
+ *  @return the number of results stored.
+ */
+BMtoBMP_API size_t
+BMtoBMP_job_pool_reap (BMtoBMP_JobPool_t *pool, BMtoBMP_JobResult_t *results,
+                       size_t max_results)
+{
+  size_t n = 0;
+  pthread_mutex_lock (&pool->mutex);
+  while (n < max_results && pool->completed != NULL)
+    {
+      BMtoBMP_Job_t *job = pool->completed;
+      pool->completed = job->next;
+      results[n].status = job->status;
+      results[n].user_data = job->user_data;
+      n++;
+      free (job);
+    }
+  if (pool->completed == NULL)
+    {
+      uint64_t drain;
+      while (read (pool->notify_fds[0], &drain, sizeof (drain)) > 0)
+        ;
+    }
+  pthread_mutex_unlock (&pool->mutex);
+  return n;
+}
+
+/**
+ *  BMtoBMP_job_pool_destroy - finishes every queued job, stops the worker
+ *  threads, and frees the pool. Unreaped results are dropped.
+ *
+ *  @param  pool  some initialized `BMtoBMP_JobPool_t`.
+ */
+BMtoBMP_API void
+BMtoBMP_job_pool_destroy (BMtoBMP_JobPool_t *pool)
+{
+  pthread_mutex_lock (&pool->mutex);
+  pool->stopping = 1;
+  pthread_cond_broadcast (&pool->cond);
+  pthread_mutex_unlock (&pool->mutex);
+  for (uint32_t i = 0; i < pool->num_threads; i++)
+    pthread_join (pool->threads[i], NULL);
+
+  while (pool->completed != NULL)
+    {
+      BMtoBMP_Job_t *job = pool->completed;
+      pool->completed = job->next;
+      free (job);
+    }
+  pthread_cond_destroy (&pool->cond);
+  pthread_mutex_destroy (&pool->mutex);
+  close_notify_fds (pool->notify_fds);
+  free (pool->threads);
+  pool->threads = NULL;
+}
+
+#endif /* _BM_TO_BMP_JOBS_H_ */
@@ -0,0 +1,350 @@
+//  Copyright (C) 2024  IcePanorama
+//
+//  This file is part of BMtoBMP.
+//
+//  BMtoBMP is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by the
+//  Free Software Foundation, either version 3 of the License, or (at your
+//  option) any later version.
+//  This program is distributed in the hope that it will be useful, but WITHOUT
+//  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+//  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+//  more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program.  If not, see <https://www.gnu.org/licenses/>.
+/* clang-format off */
+/**
+ *
+ *  BMtoBMP palette registry - named palettes that can be replaced while
+ *  conversions are using them (POSIX with GCC-style atomics, link with
+ *  `-pthread`).
+ *
+ *  `BMtoBMP_palette_acquire()` returns the current palette for a name
+ *  without taking any lock, and the palette stays valid and unchanged until
+ *  `BMtoBMP_palette_release()`, however often it is replaced in between.
+ *  `BMtoBMP_palette_publish()` and `BMtoBMP_palette_load()` swap in a new
+ *  palette RCU-style: the old one is freed once its last reader releases it,
+ *  so reloads never wait for in-flight conversions.
+ */
+/* clang-format on */
+#ifndef _BM_TO_BMP_PALETTES_H_
+#define _BM_TO_BMP_PALETTES_H_
+
+#include "bm_to_bmp_converter.h"
+
+#if !defined(BMtoBMP_POSIX) || !defined(__GNUC__)
+#error "bm_to_bmp_palettes.h needs POSIX threads and GCC-style atomics"
+#endif /* !BMtoBMP_POSIX || !__GNUC__ */
+
+#include <pthread.h>
+#include <sched.h>
+
+#define BMtoBMP_REGISTRY_MAX_PALETTES (64)
+#define BMtoBMP_REGISTRY_NAME_MAX_LEN (64)
+
+/* An immutable palette shared by every conversion that acquired it. */
+typedef struct BMtoBMP_SharedPalette_s
+{
+  BMtoBMP_Palette_t pal;
+  uint64_t content_hash; // FNV-1a of the colors it was built from
+  uint32_t refs;         // one for the registry while current, one per reader
+} BMtoBMP_SharedPalette_t;
+
+typedef struct BMtoBMP_RegistryEntry_s
+{
+  uint64_t name_hash;
+  char name[BMtoBMP_REGISTRY_NAME_MAX_LEN];
+  BMtoBMP_SharedPalette_t *current;
+} BMtoBMP_RegistryEntry_t;
+
+typedef struct BMtoBMP_PaletteRegistry_s
+{
+  /* Entries below `count` are never moved or removed, only `current`
+   * changes, so readers can scan them without locking. */
+  BMtoBMP_RegistryEntry_t entries[BMtoBMP_REGISTRY_MAX_PALETTES];
+  uint32_t count;
+  /* Readers between loading `current` and taking their reference, counted
+   * per grace period; see `wait_for_readers()`. */
+  uint32_t active_readers[2];
+  uint32_t grace_period;
+  pthread_mutex_t update_mutex; // serializes writers only
+} BMtoBMP_PaletteRegistry_t;
+
+/**
+ *  fnv1a_hash - hashes `len` bytes with 64-bit FNV-1a.
+ *
+ *  @param  data  the bytes to hash.
+ *  @param  len length of `data`.
+ *  @return the hash.
+ */
+static uint64_t
+fnv1a_hash (const uint8_t *data, size_t len)
+{
+  uint64_t hash = 0xCBF29CE484222325u;
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ data[i]) * 0x100000001B3u;
+  return hash;
+}
+
+/**
+ *  BMtoBMP_palette_registry_init - initializes an empty registry.
+ *
+ *  @param  reg some uninitialized `BMtoBMP_PaletteRegistry_t`.
+ */
+BMtoBMP_API void
+BMtoBMP_palette_registry_init (BMtoBMP_PaletteRegistry_t *reg)
+{
+  memset (reg, 0, sizeof (*reg));
+  pthread_mutex_init (&reg->update_mutex, NULL);
+}
+
+/**
+ *  BMtoBMP_palette_release - drops a reference from
+ *  `BMtoBMP_palette_acquire()`, freeing the palette if it has since been
+ *  replaced and this was the last reference.
+ *
+ *  @param  shared  some acquired `BMtoBMP_SharedPalette_t`, or NULL.
+ */
+BMtoBMP_API void
+BMtoBMP_palette_release (BMtoBMP_SharedPalette_t *shared)
+{
+  if (shared != NULL
+      && __atomic_sub_fetch (&shared->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+      release_palette (&shared->pal);
+      free (shared);
+    }
+}
+
+/**
+ *  find_entry - finds the entry for `name`.
+ *
+ *  @param  reg some initialized `BMtoBMP_PaletteRegistry_t`.
+ *  @param  name  the palette's name.
+ *  @param  name_hash `name`'s `fnv1a_hash()`.
+ *  @return the entry, or NULL if there is none.
+ */
+static BMtoBMP_RegistryEntry_t *
+find_entry (BMtoBMP_PaletteRegistry_t *reg, const char *name,
+            uint64_t name_hash)
+{
+  const uint32_t count = __atomic_load_n (&reg->count, __ATOMIC_ACQUIRE);
+  for (uint32_t i = 0; i < count; i++)
+    {
+      if (reg->entries[i].name_hash == name_hash
+          && strcmp (reg->entries[i].name, name) == 0)
+        return &reg->entries[i];
+    }
+  return NULL;
+}
+
+/**
+ *  BMtoBMP_palette_acquire - returns the current palette for `name`, with a
+ *  reference the caller must drop with `BMtoBMP_palette_release()`. Never
+ *  blocks.
+ *
+ *  @param  reg some initialized `BMtoBMP_PaletteRegistry_t`.
+ *  @param  name  the palette's name.
+ *  @return the palette, or NULL if none was published under `name`.
+ */
+BMtoBMP_API BMtoBMP_SharedPalette_t *
+BMtoBMP_palette_acquire (BMtoBMP_PaletteRegistry_t *reg, const char *name)
+{
+  const uint64_t name_hash
+      = fnv1a_hash ((const uint8_t *)name, strlen (name));
+  BMtoBMP_RegistryEntry_t *entry = find_entry (reg, name, name_hash);
+  if (entry == NULL)
+    return NULL;
+
+  /* Announce this reader so a concurrent update can't free the palette
+   * between loading `current` and taking the reference. If a grace period
+   * ended in between, the writer that ended it may not have seen the
+   * announcement, and the next one waits on the other counter, so announce
+   * again in the new period. */
+  uint32_t grace_period;
+  uint32_t period;
+  for (;;)
+    {
+      grace_period = __atomic_load_n (&reg->grace_period, __ATOMIC_SEQ_CST);
+      period = grace_period & 1;
+      __atomic_add_fetch (&reg->active_readers[period], 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n (&reg->grace_period, __ATOMIC_SEQ_CST)
+          == grace_period)
+        break;
+      __atomic_sub_fetch (&reg->active_readers[period], 1, __ATOMIC_RELEASE);
+    }
+  BMtoBMP_SharedPalette_t *shared
+      = __atomic_load_n (&entry->current, __ATOMIC_SEQ_CST);
+  if (shared != NULL)
+    __atomic_add_fetch (&shared->refs, 1, __ATOMIC_RELAXED);
+  __atomic_sub_fetch (&reg->active_readers[period], 1, __ATOMIC_RELEASE);
+  return shared;
+}
+
+/**
+ *  wait_for_readers - ends the current grace period and waits until every
+ *  reader that may have seen a replaced `current` pointer holds its
+ *  reference. Such readers announced themselves in the period that just
+ *  ended; readers announcing themselves later see the new pointer.
+ *
+ *  @param  reg some initialized `BMtoBMP_PaletteRegistry_t`, with its
+ *  `update_mutex` held.
+ */
+static void
+wait_for_readers (BMtoBMP_PaletteRegistry_t *reg)
+{
+  const uint32_t old_period
+      = __atomic_fetch_add (&reg->grace_period, 1, __ATOMIC_SEQ_CST) & 1;
+  while (__atomic_load_n (&reg->active_readers[old_period], __ATOMIC_SEQ_CST)
+         != 0)
+    sched_yield ();
+}
+
+/**
+ *  is_current_palette - checks whether `entry`'s palette already has the
+ *  colors of `pal`.
+ *
+ *  @param  entry some `BMtoBMP_RegistryEntry_t`, or NULL.
+ *  @param  pal some loaded `BMtoBMP_Palette_t`.
+ *  @param  content_hash  `fnv1a_hash()` of `pal`'s colors.
+ *  @return non-zero if it does, zero otherwise.
+ */
+static int8_t
+is_current_palette (const BMtoBMP_RegistryEntry_t *entry,
+                    const BMtoBMP_Palette_t *pal, uint64_t content_hash)
+{
+  return entry != NULL && entry->current->content_hash == content_hash
+         && entry->current->pal.num_colors == pal->num_colors
+         && memcmp (entry->current->pal.bgr, pal->bgr, sizeof (pal->bgr))
+                == 0;
+}
+
+/**
+ *  BMtoBMP_palette_publish - makes PAL data the current palette for `name`,
+ *  replacing any previous one. Conversions holding the previous palette
+ *  keep using it until they release it. Publishing the colors that are
+ *  already current keeps the current palette, and its tables.
+ *
+ *  @param  reg some initialized `BMtoBMP_PaletteRegistry_t`.
+ *  @param  name  the palette's name, max len = 63.
+ *  @param  pal_data  PAL file data.
+ *  @param  pal_len length of `pal_data` in bytes.
+ *  @return zero on success, non-zero on failure.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_palette_publish (BMtoBMP_PaletteRegistry_t *reg, const char *name,
+                         const uint8_t *pal_data, size_t pal_len)
+{
+  if (strlen (name) >= BMtoBMP_REGISTRY_NAME_MAX_LEN)
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] palette name is too long, %s.\n", name);
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      return -1;
+    }
+
+  BMtoBMP_SharedPalette_t *shared
+      = (BMtoBMP_SharedPalette_t *)calloc (1, sizeof (*shared));
+  if (shared == NULL
+      || BMtoBMP_palette_from_buffer (pal_data, pal_len, &shared->pal) != 0)
+    {
+      free (shared);
+      return -1;
+    }
+  shared->content_hash = fnv1a_hash ((const uint8_t *)shared->pal.bgr,
+                                     sizeof (shared->pal.bgr));
+  shared->refs = 1;
+
+  /* Reloading an unchanged PAL file is common, and needs no new tables. */
+  const uint64_t name_hash
+      = fnv1a_hash ((const uint8_t *)name, strlen (name));
+  pthread_mutex_lock (&reg->update_mutex);
+  BMtoBMP_RegistryEntry_t *entry = find_entry (reg, name, name_hash);
+  const int8_t unchanged
+      = is_current_palette (entry, &shared->pal, shared->content_hash);
+  pthread_mutex_unlock (&reg->update_mutex);
+  if (unchanged)
+    {
+      free (shared);
+      return 0;
+    }
+  /* Built once per published palette, not once per conversion. */
+  BMtoBMP_palette_cache_tables (&shared->pal);
+
+  pthread_mutex_lock (&reg->update_mutex);
+  entry = find_entry (reg, name, name_hash);
+  if (entry == NULL)
+    {
+      if (reg->count == BMtoBMP_REGISTRY_MAX_PALETTES)
+        {
+          pthread_mutex_unlock (&reg->update_mutex);
+#ifdef BMtoBMP_DEBUG_OUTPUT
+          fprintf (stderr, "[BMtoBMP] palette registry is full.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+          BMtoBMP_palette_release (shared);
+          return -1;
+        }
+      entry = &reg->entries[reg->count];
+      entry->name_hash = name_hash;
+      strcpy (entry->name, name);
+      entry->current = shared;
+      __atomic_store_n (&reg->count, reg->count + 1, __ATOMIC_RELEASE);
+      pthread_mutex_unlock (&reg->update_mutex);
+      return 0;
+    }
+
+  BMtoBMP_SharedPalette_t *old
+      = __atomic_exchange_n (&entry->current, shared, __ATOMIC_SEQ_CST);
+  wait_for_readers (reg);
+  pthread_mutex_unlock (&reg->update_mutex);
+  BMtoBMP_palette_release (old);
+  return 0;
+}
+
+/**
+ *  BMtoBMP_palette_load - reads a PAL file and publishes it under `name`,
+ *  see `BMtoBMP_palette_publish()`.
+ *
+ *  @param  reg some initialized `BMtoBMP_PaletteRegistry_t`.
+ *  @param  name  the palette's name, max len = 63.
+ *  @param  pal_file  file ptr (`FILE *`) to some open pal_file.
+ *  @return zero on success, non-zero on failure.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_palette_load (BMtoBMP_PaletteRegistry_t *reg, const char *name,
+                      FILE *pal_file)
+{
+  uint8_t rgb[BMtoBMP_PALETTE_NUM_COLORS * 3];
+  fseek (pal_file, 0x0, SEEK_SET);
+  const size_t len = fread (rgb, sizeof (uint8_t), sizeof (rgb), pal_file);
+  if (ferror (pal_file))
+    {
+#ifdef BMtoBMP_DEBUG_OUTPUT
+      fprintf (stderr, "[BMtoBMP] fread error: unable to read pal file.\n");
+#endif /* BMtoBMP_DEBUG_OUTPUT */
+      return -1;
+    }
+  return BMtoBMP_palette_publish (reg, name, rgb, len);
+}
+
+/**
+ *  BMtoBMP_palette_registry_destroy - drops the registry's references to
+ *  its palettes. Palettes still acquired are freed on their last release.
+ *
+ *  @param  reg some initialized `BMtoBMP_PaletteRegistry_t` that no other
+ *  thread is using.
+ */
+BMtoBMP_API void
+BMtoBMP_palette_registry_destroy (BMtoBMP_PaletteRegistry_t *reg)
+{
+  for (uint32_t i = 0; i < reg->count; i++)
+    {
+      BMtoBMP_palette_release (reg->entries[i].current);
+      reg->entries[i].current = NULL;
+    }
+  reg->count = 0;
+  pthread_mutex_destroy (&reg->update_mutex);
+}
+
+#endif /* _BM_TO_BMP_PALETTES_H_ */
@@ -0,0 +1,396 @@
+//  Copyright (C) 2024  IcePanorama
+//
+//  This file is part of BMtoBMP.
+//
+//  BMtoBMP is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by the
+//  Free Software Foundation, either version 3 of the License, or (at your
+//  option) any later version.
+//  This program is distributed in the hope that it will be useful, but WITHOUT
+//  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+//  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+//  more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program.  If not, see <https://www.gnu.org/licenses/>.
+/* clang-format off */
+/**
+ *
+ *  BMtoBMP conversion statistics - per-image latency histograms and
+ *  throughput samples, recorded from any number of threads without locks
+ *  (GCC-style atomics).
+ *
+ *  Latencies go into log-linear histograms, one for every image and one per
+ *  image size, with buckets at most 1/16 apart so percentiles are within
+ *  about 6%. Every `BMtoBMP_STATS_SAMPLE_NS` the thread recording an image
+ *  also records the images and bytes per second since the last sample.
+ */
+/* clang-format on */
+#ifndef _BM_TO_BMP_STATS_H_
+#define _BM_TO_BMP_STATS_H_
+
+#include "bm_to_bmp_converter.h"
+
+#if !defined(__GNUC__)
+#error "bm_to_bmp_stats.h needs GCC-style atomics"
+#endif /* !__GNUC__ */
+
+/* Values below 2^5 get a bucket each; above, every power of two is split
+ * into 16. */
+#define BMtoBMP_HISTOGRAM_SUB_BITS (4)
+#define BMtoBMP_HISTOGRAM_BUCKETS                                             \
+  ((64 - BMtoBMP_HISTOGRAM_SUB_BITS + 1) << BMtoBMP_HISTOGRAM_SUB_BITS)
+
+#ifndef BMtoBMP_STATS_SAMPLE_NS
+#define BMtoBMP_STATS_SAMPLE_NS (1000000000u)
+#endif /* BMtoBMP_STATS_SAMPLE_NS */
+#define BMtoBMP_STATS_MAX_SAMPLES (3600) // the newest are kept
+
+/* Images are grouped by pixel count: up to 256x256, 1024x1024, 4096x4096,
+ * and larger. */
+#define BMtoBMP_STATS_SIZE_CLASSES (4)
+
+typedef struct BMtoBMP_Histogram_s
+{
+  uint64_t counts[BMtoBMP_HISTOGRAM_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+} BMtoBMP_Histogram_t;
+
+/* Rates since the previous sample. */
+typedef struct BMtoBMP_ThroughputSample_s
+{
+  uint64_t time_ns; // since `BMtoBMP_stats_init()`
+  uint64_t images;
+  uint64_t bytes_out;
+  uint64_t interval_ns;
+} BMtoBMP_ThroughputSample_t;
+
+typedef struct BMtoBMP_Stats_s
+{
+  BMtoBMP_Histogram_t all;
+  BMtoBMP_Histogram_t by_size[BMtoBMP_STATS_SIZE_CLASSES];
+  uint64_t images;
+  uint64_t failed;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t start_ns;
+  /* Updated by the thread that claims `last_sample_ns`. */
+  uint64_t last_sample_ns;
+  uint64_t sampled_images;
+  uint64_t sampled_bytes_out;
+  BMtoBMP_ThroughputSample_t samples[BMtoBMP_STATS_MAX_SAMPLES];
+  uint64_t num_samples; // ever taken; the ring holds the newest
+} BMtoBMP_Stats_t;
+
+static const char *const BMtoBMP_stats_size_names[BMtoBMP_STATS_SIZE_CLASSES]
+    = { "small", "medium", "large", "huge" };
+
+/**
+ *  histogram_bucket - finds the histogram bucket for `value`.
+ *
+ *  @param  value some value.
+ *  @return its bucket index.
+ */
+static uint32_t
+histogram_bucket (uint64_t value)
+{
+  const uint32_t top_bit
+      = value == 0 ? 0 : 63 - (uint32_t)__builtin_clzll (value);
+  const uint32_t shift = top_bit > BMtoBMP_HISTOGRAM_SUB_BITS
+                             ? top_bit - BMtoBMP_HISTOGRAM_SUB_BITS
+                             : 0;
+  return (shift << BMtoBMP_HISTOGRAM_SUB_BITS) + (uint32_t)(value >> shift);
+}
+
+/**
+ *  histogram_bucket_max - returns the largest value in a histogram bucket.
+ *
+ *  @param  bucket  some bucket index.
+ *  @return the value.
+ */
+static uint64_t
+histogram_bucket_max (uint32_t bucket)
+{
+  const uint32_t sub_buckets = 1u << BMtoBMP_HISTOGRAM_SUB_BITS;
+  if (bucket < 2 * sub_buckets)
+    return bucket;
+  const uint32_t shift = (bucket >> BMtoBMP_HISTOGRAM_SUB_BITS) - 1;
+  const uint64_t low
+      = (uint64_t)(bucket - (shift << BMtoBMP_HISTOGRAM_SUB_BITS)) << shift;
+  return low + ((uint64_t)1 << shift) - 1;
+}
+
+/**
+ *  histogram_record - adds a value to a histogram.
+ *
+ *  @param  hist  some `BMtoBMP_Histogram_t`.
+ *  @param  value the value.
+ */
+static void
+histogram_record (BMtoBMP_Histogram_t *hist, uint64_t value)
+{
+  __atomic_fetch_add (&hist->counts[histogram_bucket (value)], 1,
+                      __ATOMIC_RELAXED);
+  __atomic_fetch_add (&hist->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&hist->sum, value, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n (&hist->max, __ATOMIC_RELAXED);
+  while (value > max
+         && !__atomic_compare_exchange_n (&hist->max, &max, value, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/**
+ *  BMtoBMP_histogram_percentile - estimates a percentile of the recorded
+ *  values, rounding up to the end of its bucket.
+ *
+ *  @param  hist  some `BMtoBMP_Histogram_t`.
+ *  @param  percentile  between 0 and 100.
+ *  @return the estimate, or zero if nothing was recorded.
+ */
+BMtoBMP_API uint64_t
+BMtoBMP_histogram_percentile (const BMtoBMP_Histogram_t *hist,
+                              double percentile)
+{
+  const uint64_t count = __atomic_load_n (&hist->count, __ATOMIC_RELAXED);
+  const uint64_t max = __atomic_load_n (&hist->max, __ATOMIC_RELAXED);
+  if (count == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t)(percentile / 100.0 * (double)count + 0.5);
+  if (rank == 0)
+    rank = 1;
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < BMtoBMP_HISTOGRAM_BUCKETS; i++)
+    {
+      seen += __atomic_load_n (&hist->counts[i], __ATOMIC_RELAXED);
+      if (seen >= rank)
+        {
+          const uint64_t value = histogram_bucket_max (i);
+          return value < max ? value : max;
+        }
+    }
+  return max;
+}
+
+/**
+ *  BMtoBMP_stats_init - clears `stats` and starts its clock.
+ *
+ *  @param  stats some `BMtoBMP_Stats_t`.
+ */
+BMtoBMP_API void
+BMtoBMP_stats_init (BMtoBMP_Stats_t *stats)
+{
+  memset (stats, 0, sizeof (*stats));
+  stats->start_ns = monotonic_ns ();
+  stats->last_sample_ns = stats->start_ns;
+}
+
+/**
+ *  maybe_sample_throughput - records a throughput sample if the last one is
+ *  at least `BMtoBMP_STATS_SAMPLE_NS` old and no other thread is taking it.
+ *
+ *  @param  stats some initialized `BMtoBMP_Stats_t`.
+ *  @param  now the current `monotonic_ns()`.
+ */
+static void
+maybe_sample_throughput (BMtoBMP_Stats_t *stats, uint64_t now)
+{
+  uint64_t last = __atomic_load_n (&stats->last_sample_ns, __ATOMIC_RELAXED);
+  if (now - last < BMtoBMP_STATS_SAMPLE_NS
+      || !__atomic_compare_exchange_n (&stats->last_sample_ns, &last, now, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+
+  const uint64_t images = __atomic_load_n (&stats->images, __ATOMIC_RELAXED);
+  const uint64_t bytes_out
+      = __atomic_load_n (&stats->bytes_out, __ATOMIC_RELAXED);
+  const uint64_t n = __atomic_load_n (&stats->num_samples, __ATOMIC_RELAXED);
+  BMtoBMP_ThroughputSample_t *sample
+      = &stats->samples[n % BMtoBMP_STATS_MAX_SAMPLES];
+  __atomic_store_n (&sample->time_ns, now - stats->start_ns, __ATOMIC_RELAXED);
+  __atomic_store_n (
+      &sample->images,
+      images - __atomic_load_n (&stats->sampled_images, __ATOMIC_RELAXED),
+      __ATOMIC_RELAXED);
+  __atomic_store_n (&sample->bytes_out,
+                    bytes_out
+                        - __atomic_load_n (&stats->sampled_bytes_out,
+                                           __ATOMIC_RELAXED),
+                    __ATOMIC_RELAXED);
+  __atomic_store_n (&sample->interval_ns, now - last, __ATOMIC_RELAXED);
+  __atomic_store_n (&stats->sampled_images, images, __ATOMIC_RELAXED);
+  __atomic_store_n (&stats->sampled_bytes_out, bytes_out, __ATOMIC_RELAXED);
+  __atomic_store_n (&stats->num_samples, n + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ *  BMtoBMP_stats_record - records one conversion. Safe to call from any
+ *  number of threads at once.
+ *
+ *  @param  stats some initialized `BMtoBMP_Stats_t`.
+ *  @param  pixels  the image's width times height, or zero if unknown.
+ *  @param  bytes_in  bytes of BM data read.
+ *  @param  bytes_out bytes of BMP data produced.
+ *  @param  latency_ns  how long the conversion took.
+ *  @param  status  what the conversion returned; failures are only counted.
+ */
+BMtoBMP_API void
+BMtoBMP_stats_record (BMtoBMP_Stats_t *stats, uint64_t pixels,
+                      uint64_t bytes_in, uint64_t bytes_out,
+                      uint64_t latency_ns, int8_t status)
+{
+  if (status != 0)
+    {
+      __atomic_fetch_add (&stats->failed, 1, __ATOMIC_RELAXED);
+      return;
+    }
+
+  const uint32_t size_class = pixels <= 256 * 256     ? 0
+                              : pixels <= 1024 * 1024 ? 1
+                              : pixels <= 4096 * 4096 ? 2
+                                                      : 3;
+  histogram_record (&stats->all, latency_ns);
+  histogram_record (&stats->by_size[size_class], latency_ns);
+  __atomic_fetch_add (&stats->bytes_in, bytes_in, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&stats->bytes_out, bytes_out, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&stats->images, 1, __ATOMIC_RELAXED);
+  maybe_sample_throughput (stats, monotonic_ns ());
+}
+
+/**
+ *  write_histogram_json - writes a histogram's summary as a JSON object.
+ *
+ *  @param  hist  some `BMtoBMP_Histogram_t`.
+ *  @param  out where the JSON should be written.
+ */
+static void
+write_histogram_json (const BMtoBMP_Histogram_t *hist, FILE *out)
+{
+  const uint64_t count = __atomic_load_n (&hist->count, __ATOMIC_RELAXED);
+  const uint64_t sum = __atomic_load_n (&hist->sum, __ATOMIC_RELAXED);
+  fprintf (out,
+           "{\"count\": %" PRIu64 ", \"mean\": %" PRIu64 ", \"p50\": %" PRIu64
+           ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"max\": %" PRIu64
+           "}",
+           count, count ? sum / count : 0,
+           BMtoBMP_histogram_percentile (hist, 50),
+           BMtoBMP_histogram_percentile (hist, 90),
+           BMtoBMP_histogram_percentile (hist, 99),
+           __atomic_load_n (&hist->max, __ATOMIC_RELAXED));
+}
+
+/**
+ *  BMtoBMP_stats_write_json - writes totals, latency percentiles in
+ *  nanoseconds, and the kept throughput samples as JSON.
+ *
+ *  @param  stats some initialized `BMtoBMP_Stats_t`.
+ *  @param  out where the JSON should be written.
+ *  @return zero on success, non-zero on failure.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_stats_write_json (const BMtoBMP_Stats_t *stats, FILE *out)
+{
+  const double elapsed_s = (double)(monotonic_ns () - stats->start_ns) / 1e9;
+  const uint64_t images = __atomic_load_n (&stats->images, __ATOMIC_RELAXED);
+  const uint64_t bytes_out
+      = __atomic_load_n (&stats->bytes_out, __ATOMIC_RELAXED);
+  fprintf (out,
+           "{\n  \"images\": %" PRIu64 ",\n  \"failed\": %" PRIu64
+           ",\n  \"bytes_in\": %" PRIu64 ",\n  \"bytes_out\": %" PRIu64
+           ",\n  \"elapsed_seconds\": %.3f,\n  \"images_per_second\": %.1f,"
+           "\n  \"mib_per_second\": %.2f,\n  \"latency_ns\": {\n    \"all\": ",
+           images, __atomic_load_n (&stats->failed, __ATOMIC_RELAXED),
+           __atomic_load_n (&stats->bytes_in, __ATOMIC_RELAXED), bytes_out,
+           elapsed_s, elapsed_s > 0 ? (double)images / elapsed_s : 0.0,
+           elapsed_s > 0 ? (double)bytes_out / 1048576.0 / elapsed_s : 0.0);
+  write_histogram_json (&stats->all, out);
+  for (uint32_t i = 0; i < BMtoBMP_STATS_SIZE_CLASSES; i++)
+    {
+      fprintf (out, ",\n    \"%s\": ", BMtoBMP_stats_size_names[i]);
+      write_histogram_json (&stats->by_size[i], out);
+    }
+
+  fputs ("\n  },\n  \"throughput\": [", out);
+  const uint64_t n = __atomic_load_n (&stats->num_samples, __ATOMIC_ACQUIRE);
+  const uint64_t first
+      = n > BMtoBMP_STATS_MAX_SAMPLES ? n - BMtoBMP_STATS_MAX_SAMPLES : 0;
+  for (uint64_t i = first; i < n; i++)
+    {
+      const BMtoBMP_ThroughputSample_t *sample
+          = &stats->samples[i % BMtoBMP_STATS_MAX_SAMPLES];
+      const double interval_s
+          = (double)__atomic_load_n (&sample->interval_ns, __ATOMIC_RELAXED)
+            / 1e9;
+      fprintf (out,
+               "%s\n    {\"seconds\": %.3f, \"images_per_second\": %.1f, "
+               "\"mib_per_second\": %.2f}",
+               i == first ? "" : ",",
+               (double)__atomic_load_n (&sample->time_ns, __ATOMIC_RELAXED)
+                   / 1e9,
+               (double)__atomic_load_n (&sample->images, __ATOMIC_RELAXED)
+                   / interval_s,
+               (double)__atomic_load_n (&sample->bytes_out, __ATOMIC_RELAXED)
+                   / 1048576.0 / interval_s);
+    }
+  fputs (n > first ? "\n  ]\n}\n" : "]\n}\n", out);
+  return ferror (out) ? -1 : 0;
+}
+
+/**
+ *  BMtoBMP_stats_write_prometheus - writes totals and latency quantiles in
+ *  the Prometheus text format, e.g. for node_exporter's textfile collector.
+ *
+ *  @param  stats some initialized `BMtoBMP_Stats_t`.
+ *  @param  out where the metrics should be written.
+ *  @return zero on success, non-zero on failure.
+ */
+BMtoBMP_API int8_t
+BMtoBMP_stats_write_prometheus (const BMtoBMP_Stats_t *stats, FILE *out)
+{
+  fprintf (out,
+           "# HELP bmtobmp_images_total Images converted.\n"
+           "# TYPE bmtobmp_images_total counter\n"
+           "bmtobmp_images_total %" PRIu64 "\n"
+           "# HELP bmtobmp_failures_total Conversions that failed.\n"
+           "# TYPE bmtobmp_failures_total counter\n"
+           "bmtobmp_failures_total %" PRIu64 "\n"
+           "# HELP bmtobmp_input_bytes_total BM bytes read.\n"
+           "# TYPE bmtobmp_input_bytes_total counter\n"
+           "bmtobmp_input_bytes_total %" PRIu64 "\n"
+           "# HELP bmtobmp_output_bytes_total BMP bytes produced.\n"
+           "# TYPE bmtobmp_output_bytes_total counter\n"
+           "bmtobmp_output_bytes_total %" PRIu64 "\n"
+           "# HELP bmtobmp_latency_seconds Time to convert one image.\n"
+           "# TYPE bmtobmp_latency_seconds summary\n",
+           __atomic_load_n (&stats->images, __ATOMIC_RELAXED),
+           __atomic_load_n (&stats->failed, __ATOMIC_RELAXED),
+           __atomic_load_n (&stats->bytes_in, __ATOMIC_RELAXED),
+           __atomic_load_n (&stats->bytes_out, __ATOMIC_RELAXED));
+
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 1.0 };
+  for (uint32_t i = 0; i < BMtoBMP_STATS_SIZE_CLASSES; i++)
+    {
+      const BMtoBMP_Histogram_t *hist = &stats->by_size[i];
+      for (size_t q = 0; q < sizeof (quantiles) / sizeof (quantiles[0]); q++)
+        fprintf (out,
+                 "bmtobmp_latency_seconds{size=\"%s\",quantile=\"%g\"} "
+                 "%.9f\n",
+                 BMtoBMP_stats_size_names[i], quantiles[q],
+                 (double)BMtoBMP_histogram_percentile (hist,
+                                                       quantiles[q] * 100)
+                     / 1e9);
+      fprintf (out,
+               "bmtobmp_latency_seconds_sum{size=\"%s\"} %.9f\n"
+               "bmtobmp_latency_seconds_count{size=\"%s\"} %" PRIu64 "\n",
+               BMtoBMP_stats_size_names[i],
+               (double)__atomic_load_n (&hist->sum, __ATOMIC_RELAXED) / 1e9,
+               BMtoBMP_stats_size_names[i],
+               __atomic_load_n (&hist->count, __ATOMIC_RELAXED));
+    }
+  return ferror (out) ? -1 : 0;
+}
+
+#endif /* _BM_TO_BMP_STATS_H_ */
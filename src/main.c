@@ -15,33 +15,231 @@
 //  with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "bm_to_bmp_converter.h"
 
+#if defined(__linux__)
+#include "bm_to_bmp_batch.h"
+#include "bm_to_bmp_ipc.h"
+#include "bm_to_bmp_palettes.h"
+#include "bm_to_bmp_stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* How long a BM file must go without being written before --watch converts
+ * it, so files closed several times while being saved convert once. */
+#define WATCH_DEBOUNCE_MS (100)
+
+/* How often --serve rewrites its statistics files. */
+#define STATS_WRITE_INTERVAL_S (10)
+
+typedef struct PendingFile_s
+{
+  char name[NAME_MAX + 1];
+  uint64_t last_write_ns;
+} PendingFile_t;
+
+/* Where --stats-json and --stats-prom write a `BMtoBMP_Stats_t`. */
+typedef struct StatsOutput_s
+{
+  BMtoBMP_Stats_t stats;
+  const char *json_path;
+  const char *prom_path;
+} StatsOutput_t;
+
+static int8_t reload_palette (BMtoBMP_PaletteRegistry_t *palettes,
+                              const char *pal_path);
+static void write_stats_files (const StatsOutput_t *out);
+static void *write_stats_periodically (void *arg);
+static const uint8_t *map_input_file (FILE *fptr, size_t *len);
+#endif /* __linux__ */
+
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(BMtoBMP_POSIX)
+#include <sys/stat.h>
+#endif /* BMtoBMP_POSIX */
+
 static FILE *load_file (const char *filename);
 static void handle_improper_usage_error (const char *exe_name);
 static int8_t validate_user_input (const char *bm_filename,
                                    const char *pal_filename);
+static int8_t get_calibration_path (char *path, size_t path_len);
+static int8_t make_parent_dirs (const char *path);
+static void load_or_run_calibration (int8_t recalibrate);
+static int run_daemon (const char *socket_path, const char *stats_json_path,
+                       const char *stats_prom_path);
+static int8_t convert_via_daemon (const char *socket_path, FILE *bm_file,
+                                  FILE *pal_file,
+                                  const BMtoBMP_Options_t *opts);
+static int verify_output (const char *bmp_path, FILE *bm_file,
+                          FILE *pal_file, const BMtoBMP_Options_t *opts);
+static int run_watch (const char *dir_path, const char *pal_path,
+                      const BMtoBMP_Options_t *opts, uint64_t timeout_ms);
+static int run_batch_mode (const char *dir_path, FILE *pal_file,
+                           const BMtoBMP_Options_t *opts,
+                           const char *stats_json_path,
+                           const char *stats_prom_path);
 
 int
 main (int argc, char **argv)
 {
-  if ((argc < 3) || validate_user_input (argv[1], argv[2]) != 0)
+  BMtoBMP_Options_t opts = { 0 };
+  uint32_t checksum = 0;
+  int8_t recalibrate = 0;
+  uint64_t timeout_ms = 0;
+  const char *serve_path = NULL;
+  const char *connect_path = NULL;
+  const char *verify_path = NULL;
+  const char *watch_path = NULL;
+  const char *batch_path = NULL;
+  const char *stats_json_path = NULL;
+  const char *stats_prom_path = NULL;
+  int argi = 1;
+  for (; argi < argc && strncmp (argv[argi], "--", 2) == 0; argi++)
+    {
+      if (strcmp (argv[argi], "--indexed") == 0)
+        opts.format = BMtoBMP_FORMAT_8BPP_INDEXED;
+      else if (strcmp (argv[argi], "--32bpp") == 0)
+        opts.format = BMtoBMP_FORMAT_32BPP;
+      else if (strcmp (argv[argi], "--top-down") == 0)
+        opts.top_down = 1;
+      else if (strcmp (argv[argi], "--scale") == 0 && argi + 1 < argc)
+        {
+          char *end;
+          const unsigned long n = strtoul (argv[++argi], &end, 10);
+          if (*end != '\0' || (n != 1 && n != 2 && n != 4))
+            handle_improper_usage_error (argv[0]);
+          opts.scale = (uint8_t)n;
+        }
+      else if (strcmp (argv[argi], "--calibrate") == 0)
+        recalibrate = 1;
+      else if (strcmp (argv[argi], "--checksum") == 0)
+        opts.checksum = &checksum;
+      else if (strcmp (argv[argi], "--timeout") == 0 && argi + 1 < argc)
+        {
+          char *end;
+          timeout_ms = strtoull (argv[++argi], &end, 10);
+          if (*end != '\0' || timeout_ms == 0)
+            handle_improper_usage_error (argv[0]);
+        }
+      else if (strcmp (argv[argi], "--serve") == 0 && argi + 1 < argc)
+        serve_path = argv[++argi];
+      else if (strcmp (argv[argi], "--connect") == 0 && argi + 1 < argc)
+        connect_path = argv[++argi];
+      else if (strcmp (argv[argi], "--verify") == 0 && argi + 1 < argc)
+        verify_path = argv[++argi];
+      else if (strcmp (argv[argi], "--watch") == 0 && argi + 1 < argc)
+        watch_path = argv[++argi];
+      else if (strcmp (argv[argi], "--batch") == 0 && argi + 1 < argc)
+        batch_path = argv[++argi];
+      else if (strcmp (argv[argi], "--stats-json") == 0 && argi + 1 < argc)
+        stats_json_path = argv[++argi];
+      else if (strcmp (argv[argi], "--stats-prom") == 0 && argi + 1 < argc)
+        stats_prom_path = argv[++argi];
+      else if (strcmp (argv[argi], "--kernel") == 0 && argi + 1 < argc)
+        {
+          opts.kernel = BMtoBMP_kernel_from_name (argv[++argi]);
+          if (opts.kernel == BMtoBMP_KERNEL_COUNT)
+            handle_improper_usage_error (argv[0]);
+        }
+      else
+        handle_improper_usage_error (argv[0]);
+    }
+
+  /* A forced kernel, or the daemon's, leaves nothing to calibrate. */
+  if (recalibrate
+      && (opts.kernel != BMtoBMP_KERNEL_AUTO || connect_path != NULL))
     handle_improper_usage_error (argv[0]);
 
-  FILE *bm_file = load_file (argv[1]);
-  FILE *pal_file = load_file (argv[2]);
+  /* Only single conversions have one checksum to print. */
+  if (opts.checksum != NULL
+      && (serve_path != NULL || watch_path != NULL || batch_path != NULL))
+    handle_improper_usage_error (argv[0]);
+  if (verify_path != NULL
+      && (serve_path != NULL || connect_path != NULL || watch_path != NULL
+          || batch_path != NULL || opts.checksum != NULL))
+    handle_improper_usage_error (argv[0]);
 
-  printf ("Converting image, %s.\n", argv[1]);
-  if (BMtoBMP_convert_image (bm_file, pal_file, "output") != 0)
+  /* A forced kernel keeps benchmark runs reproducible. */
+  if (serve_path != NULL)
     {
+      if (getenv ("BMTOBMP_KERNEL") == NULL)
+        load_or_run_calibration (recalibrate);
+      return run_daemon (serve_path, stats_json_path, stats_prom_path);
+    }
+
+  if (watch_path != NULL || batch_path != NULL)
+    {
+      if (argc - argi < 1 || validate_user_input ("dir.BM", argv[argi]) != 0)
+        handle_improper_usage_error (argv[0]);
+      if (opts.kernel == BMtoBMP_KERNEL_AUTO
+          && getenv ("BMTOBMP_KERNEL") == NULL)
+        load_or_run_calibration (recalibrate);
+      if (watch_path != NULL)
+        return run_watch (watch_path, argv[argi], &opts, timeout_ms);
+
+      /* The whole batch shares one deadline; files still queued when it
+       * passes fail without leaving a partial BMP behind. */
+      if (timeout_ms != 0)
+        opts.deadline_ns = BMtoBMP_deadline_after_ms (timeout_ms);
+      FILE *pal_file = load_file (argv[argi]);
+      const int status = run_batch_mode (batch_path, pal_file, &opts,
+                                         stats_json_path, stats_prom_path);
+      fclose (pal_file);
+      return status;
+    }
+
+  if ((argc - argi < 2)
+      || validate_user_input (argv[argi], argv[argi + 1]) != 0)
+    handle_improper_usage_error (argv[0]);
+
+  if (connect_path == NULL && opts.kernel == BMtoBMP_KERNEL_AUTO
+      && getenv ("BMTOBMP_KERNEL") == NULL)
+    load_or_run_calibration (recalibrate);
+
+  FILE *bm_file = load_file (argv[argi]);
+  FILE *pal_file = load_file (argv[argi + 1]);
+
+  if (timeout_ms != 0)
+    opts.deadline_ns = BMtoBMP_deadline_after_ms (timeout_ms);
+  if (verify_path != NULL)
+    {
+      const int status = verify_output (verify_path, bm_file, pal_file, &opts);
+      if (status == BMtoBMP_DEADLINE_EXCEEDED)
+        fprintf (stderr, "Error: verification took longer than %" PRIu64
+                         " ms.\n",
+                 timeout_ms);
+      fclose (bm_file);
+      fclose (pal_file);
+      return status != 0;
+    }
+
+  printf ("Converting image, %s.\n", argv[argi]);
+  const int8_t status
+      = connect_path != NULL
+            ? convert_via_daemon (connect_path, bm_file, pal_file, &opts)
+            : BMtoBMP_convert_image_ex (bm_file, pal_file, "output", &opts);
+  if (status != 0)
+    {
+      if (status == BMtoBMP_DEADLINE_EXCEEDED)
+        fprintf (stderr, "Error: conversion took longer than %" PRIu64
+                         " ms.\n",
+                 timeout_ms);
       fclose (bm_file);
       fclose (pal_file);
       exit (1);
     }
   puts ("Done!");
+  if (opts.checksum != NULL)
+    printf ("CRC-32C: %08" PRIx32 "\n", checksum);
 
   fclose (bm_file);
   fclose (pal_file);
@@ -65,23 +263,31 @@ void
 handle_improper_usage_error (const char *exe_name)
 {
   fprintf (stderr,
-           "Improper usage.\n\ttry: %s path/to/file.BM path/to/file.PAL\n",
-           exe_name);
+           "Improper usage.\n\ttry: %s [--indexed | --32bpp] [--top-down] "
+           "[--scale 1|2|4] [--timeout MS] [--calibrate] "
+           "[--kernel auto|scalar|stream|pair|vbmi] "
+           "[--checksum] [--connect SOCKET] path/to/file.BM path/to/file.PAL\n"
+           "\tor: %s [--timeout MS] [--kernel NAME] --verify path/to/file.bmp "
+           "path/to/file.BM path/to/file.PAL\n"
+           "\tor: %s [--calibrate] [--stats-json PATH] [--stats-prom PATH] "
+           "--serve SOCKET\n"
+           "\tor: %s [conversion options] --watch DIR path/to/file.PAL\n"
+           "\tor: %s [conversion options] [--stats-json PATH] "
+           "[--stats-prom PATH] --batch DIR path/to/file.PAL\n",
+           exe_name, exe_name, exe_name, exe_name, exe_name);
   exit (1);
 }
 
 int8_t
 validate_user_input (const char *bm_filename, const char *pal_filename)
 {
-  size_t len = strlen (bm_filename);
-  if (strcmp (bm_filename + (len - 3), ".BM") != 0
-      && strcmp (bm_filename + (len - 3), ".bm") != 0)
+  if (!BMtoBMP_has_bm_extension (bm_filename))
     {
       fprintf (stderr, "Error: %s is not a BM file.\n", bm_filename);
       return -1;
     }
 
-  len = strlen (pal_filename);
+  const size_t len = strlen (pal_filename);
   if (strcmp (pal_filename + (len - 4), ".PAL") != 0
       && strcmp (pal_filename + (len - 4), ".pal") != 0)
     {
@@ -91,3 +297,496 @@ validate_user_input (const char *bm_filename, const char *pal_filename)
 
   return 0;
 }
+
+int8_t
+get_calibration_path (char *path, size_t path_len)
+{
+  const char *override = getenv ("BMTOBMP_CALIBRATION_FILE");
+  const char *cache_home = getenv ("XDG_CACHE_HOME");
+  const char *home = getenv ("HOME");
+  int len = -1;
+  if (override != NULL)
+    len = snprintf (path, path_len, "%s", override);
+  else if (cache_home != NULL)
+    len = snprintf (path, path_len, "%s/bmtobmp-calibration", cache_home);
+  else if (home != NULL)
+    len = snprintf (path, path_len, "%s/.cache/bmtobmp-calibration", home);
+
+  return (len < 0 || (size_t)len >= path_len) ? -1 : 0;
+}
+
+void
+load_or_run_calibration (int8_t recalibrate)
+{
+  char path[1024];
+  if (get_calibration_path (path, sizeof (path)) != 0)
+    return;
+
+  if (!recalibrate && BMtoBMP_load_calibration (path) == 0)
+    return;
+
+  /* Calibrating takes longer than the heuristics lose on one image, so it
+   * is only worth it unasked if the result can be kept. */
+  FILE *cache = make_parent_dirs (path) == 0 ? fopen (path, "a") : NULL;
+  const int8_t cacheable = cache != NULL;
+  if (cache != NULL)
+    fclose (cache);
+  if (!cacheable && !recalibrate)
+    return;
+
+  puts ("Calibrating conversion kernels.");
+  if (BMtoBMP_calibrate (cacheable ? path : NULL) != 0 || !cacheable)
+    fprintf (stderr, "Warning: unable to save kernel calibration to %s.\n",
+             path);
+}
+
+int8_t
+make_parent_dirs (const char *path)
+{
+#if defined(BMtoBMP_POSIX)
+  char dir[1024];
+  const size_t len = strlen (path);
+  if (len >= sizeof (dir))
+    return -1;
+  memcpy (dir, path, len + 1);
+  for (char *slash = strchr (dir + 1, '/'); slash != NULL;
+       slash = strchr (slash + 1, '/'))
+    {
+      *slash = '\0';
+      if (mkdir (dir, 0700) != 0 && errno != EEXIST)
+        return -1;
+      *slash = '/';
+    }
+#else
+  (void)path;
+#endif /* BMtoBMP_POSIX */
+  return 0;
+}
+
+int
+run_daemon (const char *socket_path, const char *stats_json_path,
+            const char *stats_prom_path)
+{
+#if defined(__linux__)
+  const int sock = BMtoBMP_ipc_listen (socket_path);
+  if (sock < 0)
+    {
+      fprintf (stderr, "Error: unable to listen on %s.\n", socket_path);
+      return 1;
+    }
+
+  /* Too big for the stack, and shared with the connection threads. */
+  static StatsOutput_t stats_out;
+  BMtoBMP_stats_init (&stats_out.stats);
+  stats_out.json_path = stats_json_path;
+  stats_out.prom_path = stats_prom_path;
+  pthread_t stats_thread;
+  const uint8_t want_stats
+      = stats_json_path != NULL || stats_prom_path != NULL;
+  if (want_stats
+      && pthread_create (&stats_thread, NULL, write_stats_periodically,
+                         &stats_out)
+             != 0)
+    fprintf (stderr, "Warning: unable to start writing statistics.\n");
+
+  printf ("Serving conversions on %s.\n", socket_path);
+  fflush (stdout);
+  BMtoBMP_ipc_serve (sock, want_stats ? &stats_out.stats : NULL);
+  fprintf (stderr, "Error: unable to accept connections on %s.\n",
+           socket_path);
+  close (sock);
+  return 1;
+#else
+  (void)stats_json_path;
+  (void)stats_prom_path;
+  fprintf (stderr, "Error: --serve is only supported on Linux (%s).\n",
+           socket_path);
+  return 1;
+#endif /* __linux__ */
+}
+
+int8_t
+convert_via_daemon (const char *socket_path, FILE *bm_file, FILE *pal_file,
+                    const BMtoBMP_Options_t *opts)
+{
+#if defined(__linux__)
+  struct stat bm_stat;
+  struct stat pal_stat;
+  uint8_t dims[8];
+  if (fstat (fileno (bm_file), &bm_stat) != 0
+      || fstat (fileno (pal_file), &pal_stat) != 0
+      || pread (fileno (bm_file), dims, sizeof (dims), 0)
+             != (ssize_t)sizeof (dims))
+    {
+      fprintf (stderr, "Error: unable to read input files.\n");
+      return -1;
+    }
+  const uint32_t width = (uint32_t)dims[0] | (uint32_t)dims[1] << 8
+                         | (uint32_t)dims[2] << 16 | (uint32_t)dims[3] << 24;
+  const uint32_t height = (uint32_t)dims[4] | (uint32_t)dims[5] << 8
+                          | (uint32_t)dims[6] << 16 | (uint32_t)dims[7] << 24;
+  const size_t out_len = BMtoBMP_bmp_size (width, height, opts);
+  if (out_len == 0)
+    return -1;
+
+  /* Regular files are not sealed, so the daemon pwrite()s the BMP here
+   * rather than mapping this file. */
+  const int out_fd = open ("output.bmp", O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (out_fd < 0 || ftruncate (out_fd, (off_t)out_len) != 0)
+    {
+      fprintf (stderr, "Error: unable to create output.bmp.\n");
+      if (out_fd >= 0)
+        close (out_fd);
+      return -1;
+    }
+
+  int8_t status = -1;
+  const int sock = BMtoBMP_ipc_connect (socket_path);
+  if (sock < 0)
+    fprintf (stderr, "Error: unable to connect to %s.\n", socket_path);
+  else
+    {
+      status = BMtoBMP_ipc_convert (
+          sock, fileno (bm_file), (size_t)bm_stat.st_size, fileno (pal_file),
+          (size_t)pal_stat.st_size, out_fd, out_len, opts);
+      close (sock);
+    }
+
+  close (out_fd);
+  if (status != 0)
+    unlink ("output.bmp");
+  return status;
+#else
+  (void)bm_file;
+  (void)pal_file;
+  (void)opts;
+  fprintf (stderr, "Error: --connect is only supported on Linux (%s).\n",
+           socket_path);
+  return -1;
+#endif /* __linux__ */
+}
+
+int
+verify_output (const char *bmp_path, FILE *bm_file, FILE *pal_file,
+               const BMtoBMP_Options_t *opts)
+{
+#if defined(__linux__)
+  FILE *bmp_file = load_file (bmp_path);
+  size_t bmp_len = 0;
+  size_t bm_len = 0;
+  size_t pal_len = 0;
+  const uint8_t *bmp = map_input_file (bmp_file, &bmp_len);
+  const uint8_t *bm = map_input_file (bm_file, &bm_len);
+  const uint8_t *pal_data = map_input_file (pal_file, &pal_len);
+  fclose (bmp_file);
+
+  BMtoBMP_Palette_t pal;
+  size_t mismatch = SIZE_MAX;
+  int8_t status = -1;
+  if (bmp == NULL || bm == NULL || pal_data == NULL)
+    fprintf (stderr, "Error: unable to read input files.\n");
+  else if (BMtoBMP_palette_from_buffer (pal_data, pal_len, &pal) == 0)
+    status = BMtoBMP_verify_bmp (bm, bm_len, &pal, bmp, bmp_len, opts,
+                                 &mismatch);
+
+  if (status == 0)
+    printf ("%s matches.\n", bmp_path);
+  else if (mismatch != SIZE_MAX)
+    printf ("%s differs at byte %zu.\n", bmp_path, mismatch);
+  else if (bmp != NULL && bm != NULL && pal_data != NULL
+           && status != BMtoBMP_DEADLINE_EXCEEDED)
+    fprintf (stderr, "Error: unable to convert the BM file.\n");
+
+  if (bmp != NULL)
+    munmap ((void *)bmp, bmp_len);
+  if (bm != NULL)
+    munmap ((void *)bm, bm_len);
+  if (pal_data != NULL)
+    munmap ((void *)pal_data, pal_len);
+  return status;
+#else
+  (void)bm_file;
+  (void)pal_file;
+  (void)opts;
+  fprintf (stderr, "Error: --verify is only supported on Linux (%s).\n",
+           bmp_path);
+  return -1;
+#endif /* __linux__ */
+}
+
+int
+run_watch (const char *dir_path, const char *pal_path,
+           const BMtoBMP_Options_t *opts, uint64_t timeout_ms)
+{
+#if defined(__linux__)
+  BMtoBMP_PaletteRegistry_t palettes;
+  BMtoBMP_palette_registry_init (&palettes);
+  if (reload_palette (&palettes, pal_path) != 0)
+    return 1;
+
+  /* The PAL file's directory is watched too, so saving a new palette
+   * takes effect from the next conversion on. */
+  char pal_dir[PATH_MAX];
+  const char *pal_name = strrchr (pal_path, '/');
+  if (pal_name == NULL)
+    {
+      strcpy (pal_dir, ".");
+      pal_name = pal_path;
+    }
+  else
+    snprintf (pal_dir, sizeof (pal_dir), "%.*s",
+              (int)(pal_name == pal_path ? 1 : pal_name - pal_path),
+              pal_path);
+  if (pal_name != pal_path)
+    pal_name++;
+
+  const int dir_fd = open (dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  const int inotify_fd = inotify_init1 (IN_CLOEXEC);
+  const int dir_wd
+      = inotify_fd < 0 ? -1
+                       : inotify_add_watch (inotify_fd, dir_path,
+                                            IN_CLOSE_WRITE | IN_MOVED_TO);
+  const int pal_wd
+      = dir_wd < 0 ? -1
+                   : inotify_add_watch (inotify_fd, pal_dir,
+                                        IN_CLOSE_WRITE | IN_MOVED_TO);
+  if (dir_fd < 0 || pal_wd < 0)
+    {
+      fprintf (stderr, "Error: unable to watch %s.\n", dir_path);
+      if (dir_fd >= 0)
+        close (dir_fd);
+      if (inotify_fd >= 0)
+        close (inotify_fd);
+      BMtoBMP_palette_registry_destroy (&palettes);
+      return 1;
+    }
+
+  printf ("Watching %s for BM files.\n", dir_path);
+  fflush (stdout);
+  PendingFile_t *pending = NULL;
+  size_t num_pending = 0;
+  size_t pending_cap = 0;
+  BMtoBMP_ConversionBuffers_t bufs;
+  memset (&bufs, 0, sizeof (bufs));
+  BMtoBMP_Options_t file_opts = *opts;
+  char events[4096];
+  for (;;)
+    {
+      struct pollfd pfd = { .fd = inotify_fd, .events = POLLIN };
+      if (poll (&pfd, 1, num_pending > 0 ? WATCH_DEBOUNCE_MS : -1) < 0
+          && errno != EINTR)
+        break;
+
+      const ssize_t len = (pfd.revents & POLLIN)
+                              ? read (inotify_fd, events, sizeof (events))
+                              : 0;
+      const uint64_t now = monotonic_ns ();
+      for (ssize_t i = 0; i < len;)
+        {
+          struct inotify_event event;
+          memcpy (&event, events + i, sizeof (event));
+          const char *name = events + i + sizeof (event);
+          i += (ssize_t)(sizeof (event) + event.len);
+          if (event.len == 0)
+            continue;
+
+          if (event.wd == pal_wd && strcmp (name, pal_name) == 0)
+            reload_palette (&palettes, pal_path);
+          if (event.wd != dir_wd || !BMtoBMP_has_bm_extension (name))
+            continue;
+
+          size_t j = 0;
+          while (j < num_pending && strcmp (pending[j].name, name) != 0)
+            j++;
+          if (j == num_pending)
+            {
+              if (num_pending == pending_cap)
+                {
+                  const size_t cap = pending_cap ? pending_cap * 2 : 16;
+                  PendingFile_t *grown = (PendingFile_t *)realloc (
+                      pending, cap * sizeof (*pending));
+                  if (grown == NULL)
+                    continue;
+                  pending = grown;
+                  pending_cap = cap;
+                }
+              snprintf (pending[j].name, sizeof (pending[j].name), "%s",
+                        name);
+              num_pending++;
+            }
+          pending[j].last_write_ns = now;
+        }
+
+      for (size_t j = 0; j < num_pending;)
+        {
+          if (now - pending[j].last_write_ns
+              < (uint64_t)WATCH_DEBOUNCE_MS * 1000000u)
+            {
+              j++;
+              continue;
+            }
+
+          BMtoBMP_SharedPalette_t *pal
+              = BMtoBMP_palette_acquire (&palettes, "watch");
+          if (timeout_ms != 0)
+            file_opts.deadline_ns = BMtoBMP_deadline_after_ms (timeout_ms);
+          printf ("Converting image, %s.\n", pending[j].name);
+          fflush (stdout);
+          if (BMtoBMP_convert_file_at (dir_fd, pending[j].name, &pal->pal,
+                                       &file_opts, &bufs)
+              != 0)
+            fprintf (stderr, "Error: unable to convert %s.\n",
+                     pending[j].name);
+          BMtoBMP_palette_release (pal);
+          pending[j] = pending[--num_pending];
+        }
+    }
+
+  fprintf (stderr, "Error: unable to watch %s.\n", dir_path);
+  free (pending);
+  BMtoBMP_release_buffers (&bufs);
+  close (inotify_fd);
+  close (dir_fd);
+  BMtoBMP_palette_registry_destroy (&palettes);
+  return 1;
+#else
+  (void)pal_path;
+  (void)opts;
+  (void)timeout_ms;
+  fprintf (stderr, "Error: --watch is only supported on Linux (%s).\n",
+           dir_path);
+  return 1;
+#endif /* __linux__ */
+}
+
+#if defined(__linux__)
+void
+write_stats_files (const StatsOutput_t *out)
+{
+  const char *paths[2] = { out->json_path, out->prom_path };
+  for (int i = 0; i < 2; i++)
+    {
+      /* Renamed into place, so readers never see a partial file. */
+      char tmp_path[PATH_MAX];
+      if (paths[i] == NULL
+          || snprintf (tmp_path, sizeof (tmp_path), "%s.tmp", paths[i])
+                 >= (int)sizeof (tmp_path))
+        continue;
+      FILE *file = fopen (tmp_path, "w");
+      const int8_t status
+          = file == NULL ? -1
+            : i == 0     ? BMtoBMP_stats_write_json (&out->stats, file)
+                         : BMtoBMP_stats_write_prometheus (&out->stats, file);
+      if (file == NULL || fclose (file) != 0 || status != 0
+          || rename (tmp_path, paths[i]) != 0)
+        {
+          fprintf (stderr, "Warning: unable to write statistics to %s.\n",
+                   paths[i]);
+          unlink (tmp_path);
+        }
+    }
+}
+
+void *
+write_stats_periodically (void *arg)
+{
+  for (;;)
+    {
+      sleep (STATS_WRITE_INTERVAL_S);
+      write_stats_files ((const StatsOutput_t *)arg);
+    }
+  return NULL;
+}
+
+int8_t
+reload_palette (BMtoBMP_PaletteRegistry_t *palettes, const char *pal_path)
+{
+  FILE *pal_file = fopen (pal_path, "rb");
+  if (pal_file == NULL
+      || BMtoBMP_palette_load (palettes, "watch", pal_file) != 0)
+    {
+      fprintf (stderr, "Error: unable to load palette, %s.\n", pal_path);
+      if (pal_file != NULL)
+        fclose (pal_file);
+      return -1;
+    }
+  fclose (pal_file);
+  return 0;
+}
+
+const uint8_t *
+map_input_file (FILE *fptr, size_t *len)
+{
+  struct stat st;
+  if (fstat (fileno (fptr), &st) != 0 || st.st_size <= 0)
+    return NULL;
+  void *map = mmap (NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+                    fileno (fptr), 0);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  /* Every byte is read once, but bottom-up BMPs back to front, which
+   * sequential readahead would miss. */
+  madvise (map, (size_t)st.st_size, MADV_WILLNEED);
+  *len = (size_t)st.st_size;
+  return (const uint8_t *)map;
+}
+#endif /* __linux__ */
+
+int
+run_batch_mode (const char *dir_path, FILE *pal_file,
+                const BMtoBMP_Options_t *opts, const char *stats_json_path,
+                const char *stats_prom_path)
+{
+#if defined(__linux__)
+  BMtoBMP_Palette_t pal;
+  if (load_palette (pal_file, &pal) != 0)
+    return 1;
+
+  const long num_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  const uint32_t num_threads = num_cpus > 0 ? (uint32_t)num_cpus : 1;
+  static StatsOutput_t stats_out;
+  BMtoBMP_stats_init (&stats_out.stats);
+  stats_out.json_path = stats_json_path;
+  stats_out.prom_path = stats_prom_path;
+  const uint8_t want_stats
+      = stats_json_path != NULL || stats_prom_path != NULL;
+  BMtoBMP_Batch_t batch;
+  const int8_t init_status
+      = BMtoBMP_batch_init (&batch, dir_path, &pal, opts, num_threads,
+                            want_stats ? &stats_out.stats : NULL);
+  release_palette (&pal); // the batch keeps its own copy
+  if (init_status != 0)
+    {
+      fprintf (stderr, "Error: unable to open directory, %s.\n", dir_path);
+      return 1;
+    }
+
+  printf ("Converting BM files in %s.\n", dir_path);
+  fflush (stdout);
+  const int8_t walk_status = BMtoBMP_batch_walk (&batch, num_threads);
+  BMtoBMP_BatchSummary_t summary;
+  BMtoBMP_batch_finish (&batch, &summary);
+  if (walk_status != 0)
+    fprintf (stderr, "Error: unable to read every directory in %s.\n",
+             dir_path);
+  if (opts->deadline_ns != 0 && monotonic_ns () >= opts->deadline_ns)
+    fprintf (stderr, "Error: the batch took longer than its timeout.\n");
+  printf ("Converted %" PRIu64 " images, %" PRIu64 " failed.\n",
+          summary.converted, summary.failed);
+  if (summary.deduplicated > 0)
+    printf ("Linked %" PRIu64 " duplicates instead of converting them, "
+            "saving %.1f MiB.\n",
+            summary.deduplicated, summary.bytes_saved / 1048576.0);
+  write_stats_files (&stats_out);
+  return (walk_status != 0 || summary.failed != 0) ? 1 : 0;
+#else
+  (void)pal_file;
+  (void)opts;
+  (void)stats_json_path;
+  (void)stats_prom_path;
+  fprintf (stderr, "Error: --batch is only supported on Linux (%s).\n",
+           dir_path);
+  return 1;
+#endif /* __linux__ */
+}